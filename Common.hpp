@@ -12,6 +12,7 @@
 #pragma once
 #define _VERBOSE_ // Comment this line out to disable debug logging completely.
 //#define _FILEVERBOSE_ // Uncomment this line to show file path, line number, and function name for debug logging.
+//#define _INSTRUMENTATION_ // Uncomment this line to compile in the per-processor hypercall statistics.
 
 #include <ntifs.h>
 #include <ntddk.h>
@@ -87,9 +88,24 @@ typedef char int8_t;
 #pragma region Imports
 _IMPORT_ uint64_t RtlFindExportedRoutineByName( uint64_t, const char* );
 _IMPORT_ uint64_t RtlPcToFileHeader( uint64_t, uint64_t* );
+_IMPORT_ void KeGenericCallDpc( PKDEFERRED_ROUTINE, PVOID );
+_IMPORT_ void KeSignalCallDpcDone( PVOID );
+_IMPORT_ LOGICAL KeSignalCallDpcSynchronize( PVOID );
 #pragma endregion
 
 #pragma region Structures
+#ifndef UNW_FLAG_NHANDLER
+#define UNW_FLAG_NHANDLER 0x0
+#define UNW_FLAG_EHANDLER 0x1
+#define UNW_FLAG_UHANDLER 0x2
+#define UNW_FLAG_CHAININFO 0x4
+#endif
+
+// Set in RUNTIME_FUNCTION::UnwindInfo when it points to another RUNTIME_FUNCTION instead.
+#define RUNTIME_FUNCTION_INDIRECT 0x1
+
+// Flags holds the version in the low 3 bits and the UNW_FLAG_* bits above it.
+// FrRegOff holds the frame register in the low 4 bits and the scaled frame offset above it.
 struct UNWIND_INFO_HDR
 {
     uint8_t Flags;
@@ -98,6 +114,18 @@ struct UNWIND_INFO_HDR
     uint8_t FrRegOff;
 };
 
+// https://learn.microsoft.com/en-us/cpp/build/exception-handling-x64#struct-unwind_code
+union UNWIND_CODE
+{
+    struct
+    {
+        uint8_t CodeOffset;
+        uint8_t UnwindOp : 4;
+        uint8_t OpInfo : 4;
+    };
+    uint16_t FrameOffset;
+};
+
 struct RUNTIME_FUNCTION
 {
     uint32_t FunctionStart;
@@ -10,16 +10,23 @@
 */
 
 #include "Common.hpp"
-#include "Misc/DynamicArray.hpp"
+#include "Misc/RcuArray.hpp"
 #include "HyperV/HyperV.hpp"
 #include "HyperV/Emulator/Emulator.hpp"
+#include "HyperV/SignatureCache.hpp"
+#include "HyperV/Stats.hpp"
+#include "HyperV/Delivery.hpp"
+#include "HyperV/Trace.hpp"
+#include "Utils/Xrefs.hpp"
 
 namespace HyperDeceit
 {
-	struct UserCallback_t
+	typedef void(*UserCallback_t)(uint64_t Input, uint64_t Output, uint64_t OldCR3);
+
+	enum class ECallbackDelivery
 	{
-		HyperV::ECommand Cmd;
-		void(*Callback)(uint64_t, uint64_t, uint64_t);
+		Inline,		// Invoked by the hook itself, at DISPATCH_LEVEL or above.
+		Deferred	// Queued by the hook and invoked shortly after by a worker thread at PASSIVE_LEVEL.
 	};
 
 	enum class EHvDStatus
@@ -34,12 +41,41 @@ namespace HyperDeceit
 		FailedToFindCallbacks,
 		IncompatibleWindowsVersion,
 		UnsupportedEnlightenment,
+		CallbackNotFound,
+		InsufficientResources,
+		InstrumentationDisabled,
 		Success
 	};
 
 	uint64_t gKernelBase;
-	bool Unloading;
-	DynamicArray<UserCallback_t> UserCallbacks;
+
+	// Only set once the hook is in place, every API which needs the hook checks this one.
+	bool gInitialized;
+
+	// One callback list per command, and a bit per command which has any callbacks at all.
+	// The hook never locks, writers serialize on CallbacksLock and only free retired lists after a grace period.
+	RcuArray<UserCallback_t> UserCallbacks[ uint32_t( HyperV::ECommandId::Max ) ];
+	volatile long SubscribedCommands;
+	KSPIN_LOCK CallbacksLock;
+	static_assert( uint32_t( HyperV::ECommandId::Max ) <= 32, "SubscribedCommands is too small" );
+
+	// Same for deferred callbacks, those lists are only read by the delivery worker.
+	RcuArray<UserCallback_t> DeferredCallbacks[ uint32_t( HyperV::ECommandId::Max ) ];
+	volatile long DeferredCommands;
+
+	/*
+	*	Emulates the hypercall or passes it on to Hyper-V, whichever applies.
+	*/
+	static __forceinline uint64_t HvDDoHypercall( _In_ HyperV::ECommand Command, _In_opt_ uint64_t Input, _In_opt_ uint64_t Output, _In_ bool Emulated )
+	{
+		if (Emulated)
+			return HyperV::Emulator::EmulateOriginalHyperCall( Command, Input, Output );
+
+		if (HyperV::HyperVRunning)
+			return HyperV::OriginalHypercall( Command, Input, Output );
+
+		return 0;
+	}
 
 	/*
 	*	Actual hook responsible for emulating and calling any available user callbacks
@@ -47,44 +83,168 @@ namespace HyperDeceit
 	*/
 	uint64_t HvDHypercallHook( _In_ HyperV::ECommand Command, _In_opt_ uint64_t Input, _In_opt_ uint64_t Output )
 	{
-		uint64_t Status = 0;
+		// Check if this hypercall is required to be emulated or not...
+		bool Emulated = (HyperV::OriginalHvlEnlightenments & HyperV::GetEnlightenmentFromCommand( Command )) == 0;
+
+		// Usually nobody listens for anything, then there's no need to even work out which command this is.
+		bool Tracing = HyperV::Trace::IsRecording();
+		bool Observed = HyperV::Stats::Enabled || Tracing || SubscribedCommands || DeferredCommands;
+		HyperV::ECommandId CommandId = Observed ? HyperV::GetCommandId( Command ) : HyperV::ECommandId::Unknown;
+
+		// Nobody is listening for this command, unknown commands never have their bit set.
+		// With instrumentation every known command still has to be counted, and the recorder wants every command.
+		uint32_t Id = uint32_t( CommandId );
+		bool Known = CommandId != HyperV::ECommandId::Unknown;
+		bool Subscribed = Known && _bittest( (long*)&SubscribedCommands, Id );
+		bool Deferred = Known && _bittest( (long*)&DeferredCommands, Id );
+		bool Counted = HyperV::Stats::Enabled && Known;
+		if (!Subscribed && !Deferred && !Tracing && !Counted)
+			return HvDDoHypercall( Command, Input, Output, Emulated );
+
+		// Read before the call, switching the address space changes it.
 		uint64_t OldCR3 = __readcr3();
 
-		// Check if this hypercall is required to be emulated or not...
-		if ((HyperV::OriginalHvlEnlightenments & HyperV::GetEnlightenmentFromCommand( Command )) == 0)
-			HyperV::Emulator::EmulateOriginalHyperCall( Command, Input );
-		else if (HyperV::HyperVRunning)
-			Status = HyperV::OriginalHypercall( Command, Input, Output );
+		uint64_t Start = Counted ? HyperV::Stats::Timestamp() : 0;
+		uint64_t Status = HvDDoHypercall( Command, Input, Output, Emulated );
+		uint64_t EmulationCycles = Counted ? HyperV::Stats::Timestamp() - Start : 0;
+
+		// The lists, counters and trace buffers may only be used at DISPATCH_LEVEL or above, that's what keeps them from being freed under us.
+		KIRQL Irql = KeGetCurrentIrql();
+		if (Irql < DISPATCH_LEVEL)
+			KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+
+		if (Tracing)
+			HyperV::Trace::Record( Command, Input, Output, OldCR3, uint64_t( _ReturnAddress() ) );
+
+		if (Counted)
+			HyperV::Stats::RecordInvocation( CommandId, Emulated, EmulationCycles );
+
+		// Deferred callbacks only need the event queued, the worker does the rest.
+		if (Deferred)
+			HyperV::Delivery::Push( Command, Input, Output, OldCR3 );
+
+		// Walk the user callbacks of this command only, the list is null once everything was removed.
+		const RcuArray<UserCallback_t>::Snapshot_t* Callbacks = Known ? UserCallbacks[ Id ].Read() : 0;
+		if (Callbacks)
+		{
+			Start = HyperV::Stats::Timestamp();
+
+			// List flushes hand the callbacks the decoded FlushInput_t instead, valid until they return.
+			uint64_t CallbackInput = Input;
+			HyperV::Emulator::FlushInput_t Flush;
+			if (HyperV::Emulator::IsListFlush( Command ) && HyperV::Emulator::DecodeFlush( Command, Input, &Flush ))
+				CallbackInput = uint64_t( &Flush );
 
-		// Walk all user callbacks responsible for the command and invoke the callback.
-		for (uint32_t i = 0; i < UserCallbacks.Size(); i++)
+			for (uint32_t i = 0; i < Callbacks->Count; i++)
+				Callbacks->Items[ i ]( CallbackInput, Output, OldCR3 );
+
+			HyperV::Stats::RecordCallbacks( CommandId, HyperV::Stats::Timestamp() - Start );
+		}
+
+		if (Irql < DISPATCH_LEVEL)
+			KeLowerIrql( Irql );
+
+		return Status;
+	}
+
+	/*
+	*	Runs the deferred callbacks for a batch of events, called by the delivery worker at PASSIVE_LEVEL.
+	*	The worker holds the delivery lock, which is what keeps the lists from being freed under us.
+	*/
+	static void HvDDeliverEvents( _In_ const HyperV::Delivery::Event_t* Events, _In_ uint32_t Count )
+	{
+		for (uint32_t i = 0; i < Count; i++)
 		{
-			// To avoid a race condition between unloading.
-			if (Unloading) return Status;
+			const HyperV::Delivery::Event_t* Event = &Events[ i ];
 
-			UserCallback_t Callback = UserCallbacks[ i ];
-			if (!Callback.Callback)
+			HyperV::ECommandId CommandId = HyperV::GetCommandId( Event->Command );
+			if (CommandId == HyperV::ECommandId::Unknown)
 				continue;
 
-			if (Callback.Cmd != Command)
+			const RcuArray<UserCallback_t>::Snapshot_t* Callbacks = DeferredCallbacks[ uint32_t( CommandId ) ].Read();
+			if (!Callbacks)
 				continue;
 
-			Callback.Callback( Input, Output, OldCR3 );
+			// The input page has been reused by now, hand out the copy of its start instead.
+			uint64_t Input = Event->HasInputBlock ? uint64_t( Event->InputBlock ) : Event->Input;
+			for (uint32_t a = 0; a < Callbacks->Count; a++)
+				Callbacks->Items[ a ]( Input, Event->Output, Event->OldCR3 );
 		}
+	}
 
-		return Status;
+	/*
+	*	Frees a list unpublished from one of the registries, once nothing can be using it anymore.
+	*/
+	static void HvDRetireCallbacks( _In_ ECallbackDelivery Delivery, _In_opt_ RcuArray<UserCallback_t>::Snapshot_t* Retired )
+	{
+		if (!Retired)
+			return;
+
+		// Deferred lists are never seen by the hook, only by the worker.
+		if (Delivery == ECallbackDelivery::Deferred)
+		{
+			HyperV::Delivery::WaitForBatch();
+			RcuArray<UserCallback_t>::Free( Retired );
+			return;
+		}
+
+		RcuArray<UserCallback_t>::Reclaim( Retired );
+	}
+
+	/*
+	*	Adds a callback to a registry and marks the command, the bit is updated under the same lock as the list
+	*	so a racing removal can't clear it for a list which is not empty.
+	*/
+	static bool HvDRegisterCallback( _In_ ECallbackDelivery Delivery, _In_ uint32_t Id, _In_ UserCallback_t Callback )
+	{
+		RcuArray<UserCallback_t>* Callbacks = Delivery == ECallbackDelivery::Deferred ? DeferredCallbacks : UserCallbacks;
+		volatile long* Commands = Delivery == ECallbackDelivery::Deferred ? &DeferredCommands : &SubscribedCommands;
+		RcuArray<UserCallback_t>::Snapshot_t* Retired;
+
+		KIRQL Irql = KeAcquireSpinLockRaiseToDpc( &CallbacksLock );
+		bool Inserted = Callbacks[ Id ].Insert( Callback, &Retired );
+		if (Inserted)
+			_interlockedbittestandset( Commands, Id );
+		KeReleaseSpinLock( &CallbacksLock, Irql );
+
+		HvDRetireCallbacks( Delivery, Retired );
+		return Inserted;
+	}
+
+	/*
+	*	Removes a callback from a registry, the bit goes away together with the last callback.
+	*/
+	static bool HvDUnregisterCallback( _In_ ECallbackDelivery Delivery, _In_ uint32_t Id, _In_ UserCallback_t Callback )
+	{
+		RcuArray<UserCallback_t>* Callbacks = Delivery == ECallbackDelivery::Deferred ? DeferredCallbacks : UserCallbacks;
+		volatile long* Commands = Delivery == ECallbackDelivery::Deferred ? &DeferredCommands : &SubscribedCommands;
+		RcuArray<UserCallback_t>::Snapshot_t* Retired;
+
+		KIRQL Irql = KeAcquireSpinLockRaiseToDpc( &CallbacksLock );
+		bool Removed = Callbacks[ Id ].Remove( Callback, &Retired );
+		if (Removed && !Callbacks[ Id ].Read())
+			_interlockedbittestandreset( Commands, Id );
+		KeReleaseSpinLock( &CallbacksLock, Irql );
+
+		HvDRetireCallbacks( Delivery, Retired );
+		return Removed;
 	}
 
 	/*
 	*	Inserts callback to intercept a specific hypercall, and also sets up additional stuff,
 	*	like englightenments, callbacks etc...
+	*	Inline callbacks are invoked at DISPATCH_LEVEL or above, deferred ones at PASSIVE_LEVEL.
+	*	Must be called below DISPATCH_LEVEL, and deferred callbacks can't insert deferred callbacks.
+	*	Inline callbacks of the list flushes get a HyperV::Emulator::FlushInput_t* as Input. Deferred callbacks of memory
+	*	based hypercalls get a pointer to a copy of the first DELIVERY_INPUT_BLOCK_SIZE bytes of the input block instead
+	*	of its physical address, valid until they return. For the flushes that covers the fixed header, not the lists.
 	*/
-	EHvDStatus HvDInsertCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3) )
+	EHvDStatus HvDInsertCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3), _In_ ECallbackDelivery Delivery )
 	{
-		if (!Callback)
+		if (!Callback || KeGetCurrentIrql() >= DISPATCH_LEVEL)
 			return EHvDStatus::InvalidArguments;
 
-		if (!HyperV::EnlightenmentInformation)
+		if (!gInitialized)
 			return EHvDStatus::NotInitialized;
 
 		// Get enlightenment from command.
@@ -92,21 +252,30 @@ namespace HyperDeceit
 		if (Enlightenment == HyperV::EEnlightenments::Unknown)
 			return EHvDStatus::UnsupportedEnlightenment;
 
+		// The register input flushes have an enlightenment but no callback slot, the hook only emulates them.
+		HyperV::ECommandId CommandId = HyperV::GetCommandId( Cmd );
+		if (CommandId == HyperV::ECommandId::Unknown)
+			return EHvDStatus::UnsupportedEnlightenment;
+
 		// Close your eyes and pretend this part of the code doesn't exist...
 		if (!HyperV::HyperVRunning)
 		{
 			if (Enlightenment == HyperV::EEnlightenments::VirtualizedSleepState && (!HyperV::EnlightenmentInformation->EnterSleepState || !HyperV::EnlightenmentInformation->NotifyDebugDeviceAvailable))
 			{
 				// Search for the Hyper-V callbacks from HvlGetEnlightenmentInfo.
-				uint64_t Addr = Utils::FindPattern( gKernelBase, "\x48\x8D\x05\xCC\xCC\xCC\xCC\x48\x89\x43\x38\x48\x8D\x05" );
+				uint64_t Addr = HyperV::GetSignatureMatch( HyperV::ESignature::SleepStateCallbacks );
 				if (!Addr)
 					return EHvDStatus::FailedToFindCallbacks;
 
+				// Both are loaded with a lea, with a store in between.
+				uint64_t Callbacks[ 2 ];
+				if (Utils::ResolveRelatives( Addr, Callbacks, 2 ) != 2)
+					return EHvDStatus::FailedToFindCallbacks;
+
 				// By default these callbacks are null, and the initializer has been discarded.
 				// So we should initialize them ourselves.
-				HyperV::EnlightenmentInformation->EnterSleepState = Addr + *(int*)(Addr + 3) + 7; // HalpHvEnterSleepState
-				Addr += 11;
-				HyperV::EnlightenmentInformation->NotifyDebugDeviceAvailable = Addr + *(int*)(Addr + 3) + 7; // HvlNotifyDebugDeviceAvailable
+				HyperV::EnlightenmentInformation->EnterSleepState = Callbacks[ 0 ]; // HalpHvEnterSleepState
+				HyperV::EnlightenmentInformation->NotifyDebugDeviceAvailable = Callbacks[ 1 ]; // HvlNotifyDebugDeviceAvailable
 
 				// Set HalpHvSleepEnlightenedCpuManager to true, so the callbacks above are invoked.
 				*HyperV::HalpHvSleepEnlightenedCpuManager = true;
@@ -115,23 +284,77 @@ namespace HyperDeceit
 
 		if (Enlightenment == HyperV::EEnlightenments::NotifyLongSpinWait)
 		{
-			uint64_t Addr = Utils::FindPattern( gKernelBase, "\x85\x3D\xCC\xCC\xCC\xCC\x75\x1C\x8B\x05\xCC\xCC\xCC\xCC\xA8\x40" );
+			uint64_t Addr = HyperV::GetSignatureMatch( HyperV::ESignature::HvlLongSpinCountMask );
+			if (!Addr)
+				return EHvDStatus::FailedToFindCallbacks;
+
+			Addr = Utils::ResolveRelative( Addr );
 			if (!Addr)
 				return EHvDStatus::FailedToFindCallbacks;
 
-			Addr += *(int*)(Addr + 2) + 6;
 			HyperV::OriginalHvlLongSpinCountMask = *(int*)Addr;
 			HyperV::HvlLongSpinCountMask = (int*)Addr;
 			*HyperV::HvlLongSpinCountMask = 1;
 		}
 
-		// Insert callback and add enlightenment.
-		UserCallbacks.Insert( UserCallback_t{ Cmd, Callback } );
+		// The worker has to be running before the hook can queue anything for it.
+		if (Delivery == ECallbackDelivery::Deferred && !HyperV::Delivery::Start( HvDDeliverEvents ))
+			return EHvDStatus::InsufficientResources;
+
+		// Insert callback, mark the command as subscribed and add enlightenment.
+		if (!HvDRegisterCallback( Delivery, uint32_t( CommandId ), Callback ))
+			return EHvDStatus::InsufficientResources;
+
 		*HyperV::HvlEnlightenments |= uint32_t( Enlightenment );
 
 		return EHvDStatus::Success;
 	}
 
+	/*
+	*	Removes a callback inserted with HvDInsertCallback, once per insertion.
+	*	When this returns the callback is not running on any processor and will not be invoked again.
+	*	Must be called below DISPATCH_LEVEL, so never from within an inline callback.
+	*	Deferred callbacks can't remove deferred callbacks, as that waits for their own batch to finish.
+	*/
+	EHvDStatus HvDRemoveCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3) )
+	{
+		if (!Callback || KeGetCurrentIrql() >= DISPATCH_LEVEL)
+			return EHvDStatus::InvalidArguments;
+
+		if (!gInitialized)
+			return EHvDStatus::NotInitialized;
+
+		HyperV::ECommandId CommandId = HyperV::GetCommandId( Cmd );
+		if (CommandId == HyperV::ECommandId::Unknown)
+			return EHvDStatus::UnsupportedEnlightenment;
+
+		// Inline callbacks first, a callback inserted both ways is removed once per call.
+		uint32_t Id = uint32_t( CommandId );
+		if (!HvDUnregisterCallback( ECallbackDelivery::Inline, Id, Callback ) && !HvDUnregisterCallback( ECallbackDelivery::Deferred, Id, Callback ))
+			return EHvDStatus::CallbackNotFound;
+
+		// The enlightenment is left on, the hook emulates the command when nobody listens anyway.
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Undoes whatever HvDInitialize set up before it failed, so it can be called again.
+	*/
+	static EHvDStatus HvDAbortInitialize( _In_ EHvDStatus Status )
+	{
+		HyperV::Stats::Destroy();
+		Utils::Xrefs::Destroy();
+		Utils::DestroyModuleIndices();
+
+		// Forget everything that was resolved, nothing may use a half initialized state.
+		HyperV::HvcallCodeVa = 0;
+		HyperV::HvlEnlightenments = 0;
+		HyperV::EnlightenmentInformation = 0;
+		HyperV::HalpHvSleepEnlightenedCpuManager = 0;
+		gKernelBase = 0;
+		return Status;
+	}
+
 	/*
 	*	Initialize core components of HyperDeceit.
 	*/
@@ -148,19 +371,41 @@ namespace HyperDeceit
 
 		gKernelBase = KernelBase;
 
+		// Address to function lookups inside ntoskrnl are done a lot, so index it once.
+		Utils::IndexModule( KernelBase );
+
+		// The xref index of ntoskrnl is only swept by the first structural query that needs it.
+		Utils::Xrefs::Bind( KernelBase );
+
+		// Anything imported with HvDImportSignatureCache is only used if it was made for this exact ntoskrnl.
+		HyperV::SignatureCache::Bind( KernelBase );
+
 		if (!HyperV::GetHvcallCodeVa( KernelBase ))
-			return EHvDStatus::FailedToFindHvlInvokeHypercall;
+			return HvDAbortInitialize( EHvDStatus::FailedToFindHvlInvokeHypercall );
 
-		if (!HyperV::GetHvlEnlightenments( KernelBase ))
-			return EHvDStatus::FailedToFindHvlEnlightenments;
+		// Resolve every signature in one pass, including the ones needed later by HvDInsertCallback.
+		// Only fails if the automaton couldn't be built, a signature which isn't found is just left unresolved.
+		if (!HyperV::ResolveSignatures( KernelBase ))
+			return HvDAbortInitialize( EHvDStatus::InsufficientResources );
 
-		if (!HyperV::FindHvEnlightenmentInformation( KernelBase ))
-			return EHvDStatus::FailedToFindEnlightenmentInformation;
+		if (!HyperV::GetHvlEnlightenments())
+			return HvDAbortInitialize( EHvDStatus::FailedToFindHvlEnlightenments );
 
-		if (!HyperV::FindHalpHvSleepEnlightenedCpuManager( KernelBase ))
-			return EHvDStatus::FailedToFindHalpHvSleepEnlightenedCpuManager;
+		if (!HyperV::FindHvEnlightenmentInformation())
+			return HvDAbortInitialize( EHvDStatus::FailedToFindEnlightenmentInformation );
 
-		HyperV::Initialize();
+		if (!HyperV::FindHalpHvSleepEnlightenedCpuManager())
+			return HvDAbortInitialize( EHvDStatus::FailedToFindHalpHvSleepEnlightenedCpuManager );
+
+		if (!HyperV::Stats::Initialize())
+			return HvDAbortInitialize( EHvDStatus::InsufficientResources );
+
+		// Last, as it is the only step which changes the kernel's state.
+		if (!HyperV::Initialize())
+			return HvDAbortInitialize( EHvDStatus::InsufficientResources );
+
+		HyperV::Emulator::Initialize();
+		HyperV::Delivery::Initialize();
 
 		// Store the original stuff...
 		HyperV::OriginalHypercall = decltype(HyperV::OriginalHypercall)(*HyperV::HvcallCodeVa);
@@ -170,7 +415,7 @@ namespace HyperDeceit
 
 		// Swap the HvcallCodeVa pointer with our own hook. 
 		*HyperV::HvcallCodeVa = HvDHypercallHook;
-		Unloading = false;
+		gInitialized = true;
 
 		return EHvDStatus::Success;
 	}
@@ -181,11 +426,13 @@ namespace HyperDeceit
 	EHvDStatus HvDStop()
 	{
 		// Hyperdeceit isn't initialized...
-		if (!HyperV::HalpHvSleepEnlightenedCpuManager)
+		if (!gInitialized)
 			return EHvDStatus::NotInitialized;
 
-		// Botch fix for now....
-		Unloading = true;
+		if (KeGetCurrentIrql() >= DISPATCH_LEVEL)
+			return EHvDStatus::InvalidArguments;
+
+		gInitialized = false;
 
 		// Restore hv callbacks and disable indicator for virtualized cpu manager if
 		// Hyper-V is not running.
@@ -203,13 +450,143 @@ namespace HyperDeceit
 		*HyperV::HvlEnlightenments = HyperV::OriginalHvlEnlightenments;
 		*HyperV::HvcallCodeVa = HyperV::OriginalHypercall;
 
-		// Free all user callbacks.
-		// Also I think this will hit the fan at one point due to a race condition in the hook and unloading process.. Added a botch fix for now tho..
-		UserCallbacks.Destroy();
+		// Unpublish all user callbacks, then wait once for any hook still walking them before freeing.
+		RcuArray<UserCallback_t>::Snapshot_t* Retired[ uint32_t( HyperV::ECommandId::Max ) ];
+		RcuArray<UserCallback_t>::Snapshot_t* RetiredDeferred[ uint32_t( HyperV::ECommandId::Max ) ];
+
+		KIRQL Irql = KeAcquireSpinLockRaiseToDpc( &CallbacksLock );
+		SubscribedCommands = 0;
+		DeferredCommands = 0;
+		for (uint32_t i = 0; i < uint32_t( HyperV::ECommandId::Max ); i++)
+		{
+			Retired[ i ] = UserCallbacks[ i ].Detach();
+			RetiredDeferred[ i ] = DeferredCallbacks[ i ].Detach();
+		}
+		KeReleaseSpinLock( &CallbacksLock, Irql );
+
+		RcuArray<UserCallback_t>::Synchronize();
+
+		// No hook can be pushing events anymore, so the worker and its rings can go.
+		HyperV::Delivery::Destroy();
+
+		for (uint32_t i = 0; i < uint32_t( HyperV::ECommandId::Max ); i++)
+		{
+			RcuArray<UserCallback_t>::Free( Retired[ i ] );
+			RcuArray<UserCallback_t>::Free( RetiredDeferred[ i ] );
+		}
+
+		// The hook only touches the counters and trace buffers at DISPATCH_LEVEL, so the wait above covers them too.
+		HyperV::Stats::Destroy();
+		HyperV::Trace::Destroy();
+		HyperV::Emulator::Destroy();
 
 		// Restore HyperV stuff.
 		HyperV::Stop();
 
+		Utils::Xrefs::Destroy();
+		Utils::DestroyModuleIndices();
+
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Loads signature locations exported by a previous load, must be called before HvDInitialize.
+	*	Every entry is still verified against the bytes in ntoskrnl before it is used.
+	*/
+	EHvDStatus HvDImportSignatureCache( _In_ const void* Buffer, _In_ uint32_t Size )
+	{
+		// Too late, the kernel is already bound and resolved.
+		if (gKernelBase)
+			return EHvDStatus::InvalidArguments;
+
+		if (!HyperV::SignatureCache::Import( Buffer, Size ))
+			return EHvDStatus::InvalidArguments;
+
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Exports the resolved signature locations so the caller can persist them for the next load.
+	*	Pass a null buffer to get the required size.
+	*/
+	EHvDStatus HvDExportSignatureCache( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written )
+	{
+		if (!Written)
+			return EHvDStatus::InvalidArguments;
+
+		if (!gKernelBase)
+			return EHvDStatus::NotInitialized;
+
+		if (!HyperV::SignatureCache::Export( Buffer, Size, Written ))
+			return EHvDStatus::InvalidArguments;
+
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Gets the counters of a command summed over every processor, without blocking the hook.
+	*	Counters of invocations still in flight may or may not be included.
+	*/
+	EHvDStatus HvDGetStats( _In_ HyperV::ECommand Cmd, _Out_ HyperV::Stats::CommandStats_t* Stats )
+	{
+		if (!Stats)
+			return EHvDStatus::InvalidArguments;
+
+		if (!HyperV::Stats::Enabled)
+			return EHvDStatus::InstrumentationDisabled;
+
+		HyperV::ECommandId CommandId = HyperV::GetCommandId( Cmd );
+		if (CommandId == HyperV::ECommandId::Unknown)
+			return EHvDStatus::UnsupportedEnlightenment;
+
+		if (!HyperV::Stats::Query( CommandId, Stats ))
+			return EHvDStatus::NotInitialized;
+
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Starts recording every intercepted hypercall, into a buffer of BytesPerCpu bytes for every processor.
+	*	Any previous recording is thrown away. Must be called at PASSIVE_LEVEL.
+	*/
+	EHvDStatus HvDStartTrace( _In_ uint32_t BytesPerCpu )
+	{
+		if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+			return EHvDStatus::InvalidArguments;
+
+		if (!gInitialized)
+			return EHvDStatus::NotInitialized;
+
+		if (!HyperV::Trace::Start( BytesPerCpu ))
+			return EHvDStatus::InvalidArguments;
+
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Stops recording, the recording can then be exported with HvDExportTrace. Must be called at PASSIVE_LEVEL.
+	*/
+	EHvDStatus HvDStopTrace()
+	{
+		if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+			return EHvDStatus::InvalidArguments;
+
+		HyperV::Trace::Stop();
+		return EHvDStatus::Success;
+	}
+
+	/*
+	*	Exports the last recording in the format described in Includes/HyperDeceitTrace.hpp.
+	*	Recording must be stopped, pass a null buffer to get the required size.
+	*/
+	EHvDStatus HvDExportTrace( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written )
+	{
+		if (!Written)
+			return EHvDStatus::InvalidArguments;
+
+		if (!HyperV::Trace::Export( Buffer, Size, Written ))
+			return EHvDStatus::InvalidArguments;
+
 		return EHvDStatus::Success;
 	}
 
@@ -233,6 +610,9 @@ namespace HyperDeceit
 			CASETOSTR( EHvDStatus::FailedToFindCallbacks );
 			CASETOSTR( EHvDStatus::IncompatibleWindowsVersion );
 			CASETOSTR( EHvDStatus::UnsupportedEnlightenment );
+			CASETOSTR( EHvDStatus::CallbackNotFound );
+			CASETOSTR( EHvDStatus::InsufficientResources );
+			CASETOSTR( EHvDStatus::InstrumentationDisabled );
 			CASETOSTR( EHvDStatus::Success );
 		}
 #undef CASETOSTR
@@ -0,0 +1,366 @@
+/*
+*		File name:
+*			Delivery.cpp
+*
+*		Use:
+*			Deferred delivery of hypercall events through per-processor rings, drained by a passive level worker.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "Delivery.hpp"
+
+namespace HyperDeceit::HyperV::Delivery
+{
+	static_assert( (DELIVERY_RING_SIZE & (DELIVERY_RING_SIZE - 1)) == 0, "DELIVERY_RING_SIZE must be a power of 2" );
+
+	/*
+	*	A slot is free for the producer at position P when Sequence == P,
+	*	and holds a committed event for the consumer when Sequence == P + 1.
+	*/
+	struct alignas( 64 ) Slot_t
+	{
+		volatile int64_t Sequence;
+		Event_t Event;
+	};
+
+	/*
+	*	Several producers can push into the same ring, as the hook can interrupt itself on the same processor.
+	*	There is only one consumer, the worker.
+	*/
+	struct Ring_t
+	{
+		alignas( 64 ) volatile int64_t Head;	// Next position to reserve, only touched by this processor.
+		volatile int64_t Dropped;
+		volatile char Signaled;					// The worker has been asked to drain this ring.
+		KDPC WakeDpc;
+
+		alignas( 64 ) int64_t Tail;				// Next position to consume, only touched by the worker.
+
+		Slot_t Slots[ DELIVERY_RING_SIZE ];
+	};
+
+	Ring_t** Rings;
+	uint32_t RingCount;
+	Handler_t EventHandler;
+
+	// Held by the worker while it runs the handler, and while starting. Not a guarded mutex, those disable
+	// special kernel APCs as well and the handler has to be able to wait for synchronous I/O.
+	ERESOURCE DeliveryLock;
+	KEVENT WakeEvent;
+	PKTHREAD Worker;
+	volatile bool Stopping;
+
+	/*
+	*	Takes the delivery lock, only normal kernel APCs are disabled while it is held.
+	*/
+	static void AcquireDeliveryLock( )
+	{
+		KeEnterCriticalRegion( );
+		ExAcquireResourceExclusiveLite( &DeliveryLock, TRUE );
+	}
+
+	static void ReleaseDeliveryLock( )
+	{
+		ExReleaseResourceLite( &DeliveryLock );
+		KeLeaveCriticalRegion( );
+	}
+
+	/*
+	*	Queued on the processor which pushed into an idle ring, KeSetEvent can't be used at the IRQL the hook may run at.
+	*/
+	static void WakeDpcRoutine( _In_ PKDPC Dpc, _In_ PVOID DeferredContext, _In_ PVOID SystemArgument1, _In_ PVOID SystemArgument2 )
+	{
+		UNREFERENCED_PARAMETER( Dpc );
+		UNREFERENCED_PARAMETER( DeferredContext );
+		UNREFERENCED_PARAMETER( SystemArgument1 );
+		UNREFERENCED_PARAMETER( SystemArgument2 );
+
+		KeSetEvent( &WakeEvent, 0, FALSE );
+	}
+
+	/*
+	*	Moves up to Max committed events out of a ring, in order.
+	*/
+	static uint32_t DrainRing( _In_ Ring_t* Ring, _Out_ Event_t* Events, _In_ uint32_t Max )
+	{
+		uint32_t Count = 0;
+		for ( ; Count < Max; Count++, Ring->Tail++ )
+		{
+			Slot_t* Slot = &Ring->Slots[ Ring->Tail & (DELIVERY_RING_SIZE - 1) ];
+			if ( Slot->Sequence != Ring->Tail + 1 )
+				break;
+
+			_ReadWriteBarrier( );
+			Events[ Count ] = Slot->Event;
+			_ReadWriteBarrier( );
+
+			// Hand the slot back to the producers for the next lap.
+			Slot->Sequence = Ring->Tail + DELIVERY_RING_SIZE;
+		}
+
+		return Count;
+	}
+
+	/*
+	*	Drains every ring in batches until all of them are empty.
+	*/
+	static void DrainAll( _In_ Event_t* Batch )
+	{
+		for ( uint32_t i = 0; i < RingCount; i++ )
+		{
+			Ring_t* Ring = Rings[ i ];
+
+			// Cleared before draining, so anything pushed from now on asks for another round.
+			_InterlockedExchange8( &Ring->Signaled, 0 );
+
+			for ( ;; )
+			{
+				uint32_t Count = DrainRing( Ring, Batch, DELIVERY_BATCH_SIZE );
+				if ( !Count )
+					break;
+
+				AcquireDeliveryLock( );
+				EventHandler( Batch, Count );
+				ReleaseDeliveryLock( );
+			}
+		}
+	}
+
+	/*
+	*	Worker thread, sleeps until a ring has events and drains them.
+	*/
+	static void WorkerRoutine( _In_ PVOID Context )
+	{
+		UNREFERENCED_PARAMETER( Context );
+
+		Event_t Batch[ DELIVERY_BATCH_SIZE ];
+
+		LARGE_INTEGER Timeout;
+		Timeout.QuadPart = -10000LL * DELIVERY_POLL_INTERVAL_MS;
+
+		while ( !Stopping )
+		{
+			KeWaitForSingleObject( &WakeEvent, Executive, KernelMode, FALSE, &Timeout );
+			DrainAll( Batch );
+		}
+
+		PsTerminateSystemThread( STATUS_SUCCESS );
+	}
+
+	/*
+	*	Frees every ring, nothing may be pushing into them anymore.
+	*/
+	static void FreeRings( )
+	{
+		if ( !Rings )
+			return;
+
+		for ( uint32_t i = 0; i < RingCount; i++ )
+		{
+			if ( Rings[ i ] )
+				ExFreePool( Rings[ i ] );
+		}
+
+		ExFreePool( Rings );
+		Rings = 0;
+		RingCount = 0;
+	}
+
+	/*
+	*	Sets up the locks, must be called once before anything else.
+	*/
+	void Initialize( )
+	{
+		ExInitializeResourceLite( &DeliveryLock );
+		KeInitializeEvent( &WakeEvent, SynchronizationEvent, FALSE );
+	}
+
+	/*
+	*	Allocates a ring for every processor and starts the worker, if that wasn't done already.
+	*	Must be called at PASSIVE_LEVEL.
+	*/
+	bool Start( _In_ Handler_t Handler )
+	{
+		if ( Worker )
+			return true;
+
+		AcquireDeliveryLock( );
+		if ( Worker )
+		{
+			ReleaseDeliveryLock( );
+			return true;
+		}
+
+		uint32_t Count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+		Ring_t** NewRings = (Ring_t**)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Count * sizeof( Ring_t* ) );
+		if ( !NewRings )
+		{
+			ReleaseDeliveryLock( );
+			return false;
+		}
+
+		memset( NewRings, 0, Count * sizeof( Ring_t* ) );
+		Rings = NewRings;
+		RingCount = Count;
+
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			// Larger than a page, so it comes page aligned.
+			Ring_t* Ring = (Ring_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, sizeof( Ring_t ) );
+			if ( !Ring )
+			{
+				FreeRings( );
+				ReleaseDeliveryLock( );
+				return false;
+			}
+
+			memset( Ring, 0, sizeof( Ring_t ) );
+			for ( uint32_t Slot = 0; Slot < DELIVERY_RING_SIZE; Slot++ )
+				Ring->Slots[ Slot ].Sequence = Slot;
+
+			// Queued by whichever processor owns the ring, so it runs right there.
+			KeInitializeDpc( &Ring->WakeDpc, WakeDpcRoutine, 0 );
+			Rings[ i ] = Ring;
+		}
+
+		EventHandler = Handler;
+		Stopping = false;
+
+		HANDLE Thread;
+		if ( !NT_SUCCESS( PsCreateSystemThread( &Thread, THREAD_ALL_ACCESS, 0, 0, 0, WorkerRoutine, 0 ) ) )
+		{
+			FreeRings( );
+			ReleaseDeliveryLock( );
+			return false;
+		}
+
+		ObReferenceObjectByHandle( Thread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, (PVOID*)&Worker, 0 );
+		ZwClose( Thread );
+
+		ReleaseDeliveryLock( );
+		return true;
+	}
+
+	/*
+	*	Stops the worker and frees the rings, events still queued are discarded.
+	*	The hook must be gone and every processor past a quiescent point.
+	*/
+	void Stop( )
+	{
+		if ( !Worker )
+			return;
+
+		Stopping = true;
+		KeSetEvent( &WakeEvent, 0, FALSE );
+		KeWaitForSingleObject( Worker, Executive, KernelMode, FALSE, 0 );
+		ObDereferenceObject( Worker );
+		Worker = 0;
+
+		// A wake up DPC may still be queued on some processor.
+		KeFlushQueuedDpcs( );
+
+		int64_t Dropped = 0;
+		for ( uint32_t i = 0; i < RingCount; i++ )
+			Dropped += Rings[ i ]->Dropped;
+
+		if ( Dropped )
+			DBG( "Dropped %lld deferred events, rings were full", Dropped );
+
+		FreeRings( );
+	}
+
+	/*
+	*	Stops the worker and deletes the locks, Initialize has to be called again before anything else.
+	*	Same requirements as Stop.
+	*/
+	void Destroy( )
+	{
+		Stop( );
+		ExDeleteResourceLite( &DeliveryLock );
+	}
+
+	/*
+	*	Copies the start of a memory based hypercall's input block, returns false for fast hypercalls
+	*	or if the input page isn't mapped.
+	*/
+	static bool CopyInputBlock( _In_ ECommand Command, _In_ uint64_t Input, _Out_ uint64_t* Block )
+	{
+		memset( Block, 0, DELIVERY_INPUT_BLOCK_SIZE );
+		if ( (Command & HV_HYPERCALL_FAST_BIT) || !Input )
+			return false;
+
+		PHYSICAL_ADDRESS Physical;
+		Physical.QuadPart = Input;
+
+		const void* Source = MmGetVirtualForPhysical( Physical );
+		if ( !Source || !MmIsAddressValid( (void*)Source ) )
+			return false;
+
+		// The block can't cross into the next page, which may not be mapped.
+		uint64_t Available = PAGE_SIZE - (Input & (PAGE_SIZE - 1));
+		memcpy( Block, Source, Available < DELIVERY_INPUT_BLOCK_SIZE ? size_t( Available ) : DELIVERY_INPUT_BLOCK_SIZE );
+		return true;
+	}
+
+	/*
+	*	Pushes an event into the current processor's ring. Must be called at DISPATCH_LEVEL or above,
+	*	any IRQL up to HIGH_LEVEL works. Returns false if the event was dropped.
+	*/
+	bool Push( _In_ ECommand Command, _In_ uint64_t Input, _In_ uint64_t Output, _In_ uint64_t OldCR3 )
+	{
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		if ( !Rings || Cpu >= RingCount )
+			return false;
+
+		Ring_t* Ring = Rings[ Cpu ];
+
+		// Reserve a slot, the exchange only fails when the hook interrupted itself on this processor.
+		Slot_t* Slot;
+		int64_t Position = Ring->Head;
+		for ( ;; )
+		{
+			Slot = &Ring->Slots[ Position & (DELIVERY_RING_SIZE - 1) ];
+
+			int64_t Difference = Slot->Sequence - Position;
+			if ( Difference < 0 )
+			{
+				_InterlockedIncrement64( &Ring->Dropped );
+				return false;
+			}
+
+			if ( !Difference && InterlockedCompareExchange64( &Ring->Head, Position + 1, Position ) == Position )
+				break;
+
+			Position = Ring->Head;
+		}
+
+		Slot->Event.Command = Command;
+		Slot->Event.Input = Input;
+		Slot->Event.Output = Output;
+		Slot->Event.OldCR3 = OldCR3;
+		Slot->Event.Tsc = __rdtsc( );
+		Slot->Event.Cpu = Cpu;
+		Slot->Event.HasInputBlock = CopyInputBlock( Command, Input, Slot->Event.InputBlock );
+
+		// Commit, the event must be complete before the consumer can see the sequence.
+		_ReadWriteBarrier( );
+		Slot->Sequence = Position + 1;
+
+		if ( !Ring->Signaled && !_InterlockedExchange8( &Ring->Signaled, 1 ) )
+			KeInsertQueueDpc( &Ring->WakeDpc, 0, 0 );
+
+		return true;
+	}
+
+	/*
+	*	Waits for the batch the worker is handing out, if any, to finish.
+	*	Anything unpublished before this call is no longer in use by the handler once it returns.
+	*/
+	void WaitForBatch( )
+	{
+		AcquireDeliveryLock( );
+		ReleaseDeliveryLock( );
+	}
+}
@@ -0,0 +1,56 @@
+/*
+*		File name:
+*			Delivery.hpp
+*
+*		Use:
+*			Deferred delivery of hypercall events through per-processor rings, drained by a passive level worker.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "HyperV.hpp"
+
+// Slots per processor, must be a power of 2. Events arriving while a ring is full are dropped.
+#define DELIVERY_RING_SIZE 256
+
+// Max events handed to the handler at once.
+#define DELIVERY_BATCH_SIZE 64
+
+// Bytes of a memory based hypercall's input block copied into its event, enough for the fixed header of the flushes.
+#define DELIVERY_INPUT_BLOCK_SIZE 32
+
+// The worker also wakes up on its own, in case a wake up request raced with it going to sleep.
+#define DELIVERY_POLL_INTERVAL_MS 50
+
+namespace HyperDeceit::HyperV::Delivery
+{
+	struct Event_t
+	{
+		ECommand Command;
+		uint64_t Input;
+		uint64_t Output;
+		uint64_t OldCR3;
+		uint64_t Tsc;
+		uint32_t Cpu;
+
+		// Input is the physical address of the processor's hypercall input page for memory based hypercalls,
+		// which is reused long before the worker runs. The start of the block is copied here instead,
+		// anything past the end of the page is left zeroed.
+		bool HasInputBlock;
+		uint64_t InputBlock[ DELIVERY_INPUT_BLOCK_SIZE / sizeof( uint64_t ) ];
+	};
+
+	// Called by the worker at PASSIVE_LEVEL, with events of a single processor in the order they were pushed.
+	typedef void( *Handler_t )( _In_ const Event_t* Events, _In_ uint32_t Count );
+
+	void Initialize( );
+	bool Start( _In_ Handler_t Handler );
+	void Stop( );
+	void Destroy( );
+
+	bool Push( _In_ ECommand Command, _In_ uint64_t Input, _In_ uint64_t Output, _In_ uint64_t OldCR3 );
+	void WaitForBatch( );
+}
@@ -11,6 +11,9 @@
 
 #include "Emulator.hpp"
 
+// RFLAGS.IF
+#define EFLAGS_IF_MASK 0x200
+
 // Maybe fix + refactor this later.. Though submit a PR if you want to do this lol :)
 
 namespace HyperDeceit::HyperV::Emulator
@@ -19,8 +22,66 @@ namespace HyperDeceit::HyperV::Emulator
 	*	Flushes the cache responsible for the current core.
 	*/
 	void FlushTB( )
+	{
+		FlushTB( 0 );
+	}
+
+	/*
+	*	Checks if the processor supports INVPCID, which works with CR4.PCIDE off too.
+	*/
+	static bool IsInvpcidSupported( )
+	{
+		static int Supported = -1;
+		if ( Supported != -1 )
+			return Supported;
+
+		int Regs[ 4 ]{};
+		__cpuid( Regs, 0 );
+		if ( Regs[ 0 ] < 7 )
+			return Supported = false;
+
+		// CPUID.7.0:EBX.INVPCID
+		__cpuidex( Regs, 7, 0 );
+		return Supported = (Regs[ 1 ] & (1 << 10)) != 0;
+	}
+
+	/*
+	*	Executes INVPCID with the given type, PCID and address.
+	*/
+	static void Invpcid( _In_ EInvpcidType Type, _In_ uint64_t Pcid, _In_ uint64_t Address )
+	{
+		InvpcidDescriptor_t Descriptor{ Pcid, Address };
+		_invpcid( uint32_t( Type ), &Descriptor );
+	}
+
+	/*
+	*	Flushes the cache responsible for the current core, honoring HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY.
+	*/
+	void FlushTB( _In_ uint64_t Flags )
 	{
 		uint64_t CR4 = __readcr4( );
+		bool NonGlobalOnly = (Flags & HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY) != 0;
+
+		if ( IsInvpcidSupported( ) )
+		{
+			if ( !NonGlobalOnly )
+				return Invpcid( EInvpcidType::AllContextsGlobal, 0, 0 );
+
+			// With PCIDs the address space names one kernel PCID, but under KVA shadowing its user half
+			// lives in another PCID the input doesn't name, so every context has to go.
+			if ( (CR4 & (1 << 17)) || (Flags & HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES) )
+				return Invpcid( EInvpcidType::AllContexts, 0, 0 );
+
+			// Without PCIDs everything is tagged with PCID 0.
+			return Invpcid( EInvpcidType::SingleContext, 0, 0 );
+		}
+
+		// Without PCIDs rewriting CR3 drops every non-global entry, with them it only drops the current PCID's.
+		if ( NonGlobalOnly && !(CR4 & (1 << 17)) )
+		{
+			__writecr3( __readcr3( ) );
+			return;
+		}
 
 		// CR4.PGE + CR4.PCIDE
 		if ( CR4 & ((1 << 7) | (1 << 17)) )
@@ -34,16 +95,601 @@ namespace HyperDeceit::HyperV::Emulator
 		__writecr3( __readcr3( ) );
 	}
 
+	uint32_t FlushListThreshold = FLUSH_LIST_DEFAULT_THRESHOLD;
+
+	// Processor sets are in virtual processor indices, only usable as processor indices while those match.
+	bool VpIndexIsProcessorIndex = true;
+
+	/*
+	*	Sets how many pages a list flush may flush one by one before it flushes everything instead.
+	*	0 always flushes everything.
+	*/
+	void SetFlushListThreshold( _In_ uint32_t Pages )
+	{
+		FlushListThreshold = Pages;
+	}
+
+	/*
+	*	Is this one of the flush hypercalls which take a list of pages?
+	*/
+	bool IsListFlush( _In_ ECommand Cmd )
+	{
+		ECommand Code = ECommand( GetCallCode( Cmd ) & ~HV_HYPERCALL_FAST_BIT );
+		return Code == ECommand::FlushAddressList || Code == ECommand::FlushAddressListEx;
+	}
+
+	/*
+	*	Is the processor one of the targets?
+	*/
+	static bool IsTargeted( _In_ const ProcessorSet_t* Set, _In_ uint32_t Cpu )
+	{
+		if ( Set->All )
+			return true;
+
+		return Cpu / 64 < HV_MAX_VP_BANKS && (Set->Banks[ Cpu / 64 ] >> (Cpu % 64)) & 1;
+	}
+
+	/*
+	*	Decodes the input block of any of the memory based flush hypercalls:
+	*
+	*		HvCallFlushVirtualAddressSpace		AddressSpace, Flags, ProcessorMask
+	*		HvCallFlushVirtualAddressList		AddressSpace, Flags, ProcessorMask, rep GVA ranges
+	*		HvCallFlushVirtualAddressSpaceEx	AddressSpace, Flags, HV_VP_SET
+	*		HvCallFlushVirtualAddressListEx		AddressSpace, Flags, HV_VP_SET, rep GVA ranges
+	*
+	*	HV_VP_SET is its format and valid bank mask, followed by one processor mask per valid bank in the
+	*	variable header. Only the reps from the rep start index on are decoded, the rest were already done.
+	*/
+	bool DecodeFlush( _In_ ECommand Cmd, _In_ uint64_t InputPa, _Out_ FlushInput_t* Flush )
+	{
+		memset( Flush, 0, sizeof( FlushInput_t ) );
+
+		ECommand Code = GetCallCode( Cmd );
+		bool Ex = Code == ECommand::FlushAddressSpaceEx || Code == ECommand::FlushAddressListEx;
+		bool List = Code == ECommand::FlushAddressList || Code == ECommand::FlushAddressListEx;
+		if ( !Ex && !List && Code != ECommand::SlowFlushAddressSpace )
+			return false;
+
+		PHYSICAL_ADDRESS Physical;
+		Physical.QuadPart = InputPa;
+
+		// The hypercall input page is always mapped, if it somehow isn't play it safe.
+		const uint64_t* Block = (const uint64_t*)MmGetVirtualForPhysical( Physical );
+		if ( !Block || !MmIsAddressValid( (void*)Block ) )
+			return false;
+
+		// Everything has to fit in the rest of the input page.
+		uint32_t Available = uint32_t( (PAGE_SIZE - (InputPa & (PAGE_SIZE - 1))) / sizeof( uint64_t ) );
+		uint32_t Header = Ex ? 4 + HV_HYPERCALL_VARIABLE_HEADER_SIZE( Cmd ) : 3;
+		if ( Header > Available )
+			return false;
+
+		Flush->AddressSpace = Block[ 0 ];
+		Flush->Flags = Block[ 1 ];
+		Flush->Processors.All = (Flush->Flags & HV_FLUSH_ALL_PROCESSORS) != 0;
+
+		if ( !Ex )
+		{
+			Flush->Processors.Banks[ 0 ] = Block[ 2 ];
+		}
+		else if ( Block[ 2 ] == HV_GENERIC_SET_ALL )
+		{
+			Flush->Processors.All = true;
+		}
+		else if ( Block[ 2 ] == HV_GENERIC_SET_SPARSE_4K )
+		{
+			// Bank contents are stored in the order of the set bits.
+			uint64_t ValidBankMask = Block[ 3 ];
+			if ( uint32_t( __popcnt64( ValidBankMask ) ) > HV_HYPERCALL_VARIABLE_HEADER_SIZE( Cmd ) )
+				return false;
+
+			uint32_t Content = 4;
+			for ( uint32_t Bank = 0; Bank < HV_MAX_VP_BANKS; Bank++ )
+			{
+				if ( (ValidBankMask >> Bank) & 1 )
+					Flush->Processors.Banks[ Bank ] = Block[ Content++ ];
+			}
+		}
+		else
+		{
+			return false;
+		}
+
+		if ( !List )
+			return true;
+
+		uint32_t RepCount = HV_HYPERCALL_REP_COUNT( Cmd );
+		uint32_t RepStart = HV_HYPERCALL_REP_START( Cmd );
+		if ( RepStart > RepCount || RepCount > Available - Header )
+			return false;
+
+		Flush->Entries = &Block[ Header + RepStart ];
+		Flush->EntryCount = RepCount - RepStart;
+
+		// The extended range format stores large page ranges differently, it is only ever counted as too many pages.
+		for ( uint32_t i = 0; i < Flush->EntryCount; i++ )
+			Flush->PageCount += uint32_t( Flush->Entries[ i ] & 0xFFF ) + 1;
+
+		if ( Flush->Flags & HV_FLUSH_USE_EXTENDED_RANGE_FORMAT )
+			Flush->PageCount = 0xFFFFFFFF;
+
+		return true;
+	}
+
+	/*
+	*	Will the flush be done page by page rather than flushing everything?
+	*/
+	static bool FlushesByPage( _In_ const FlushInput_t* Flush )
+	{
+		// INVLPG only drops the entries of the current PCID, the address space being flushed may have others.
+		// Without PCIDs, every non-global entry belongs to the current address space or is already gone.
+		return Flush->EntryCount && Flush->PageCount <= FlushListThreshold && !(__readcr4( ) & (1 << 17));
+	}
+
+	/*
+	*	Flushes the current core the way the decoded flush asks for.
+	*/
+	static void FlushLocal( _In_ const FlushInput_t* Flush )
+	{
+		if ( !FlushesByPage( Flush ) )
+			return FlushTB( Flush->Flags );
+
+		for ( uint32_t i = 0; i < Flush->EntryCount; i++ )
+		{
+			uint64_t Page = Flush->Entries[ i ] & ~0xFFFULL;
+			uint32_t Additional = uint32_t( Flush->Entries[ i ] & 0xFFF );
+
+			for ( uint32_t j = 0; j <= Additional; j++ )
+				__invlpg( (void*)(Page + uint64_t( j ) * PAGE_SIZE) );
+		}
+	}
+
+	/*
+	*	IPI worker, flushes the current core if it is one of the targets.
+	*/
+	static ULONG_PTR FlushWorker( _In_ ULONG_PTR Context )
+	{
+		const FlushInput_t* Flush = (const FlushInput_t*)Context;
+
+		if ( IsTargeted( &Flush->Processors, KeGetCurrentProcessorIndex( ) ) )
+			FlushLocal( Flush );
+
+		return 0;
+	}
+
+	// One DPC per processor index for targeted flushes below DISPATCH_LEVEL. Only one flush uses them at a time,
+	// FlushDpcsBusy stays taken while there are none.
+	KDPC* FlushDpcs;
+	uint32_t FlushDpcCount;
+	volatile long FlushDpcsBusy = 1;
+	volatile long FlushDpcsPending;
+
+	/*
+	*	DPC routine of targeted flushes, flushes the processor it was queued on.
+	*/
+	static void FlushDpcRoutine( _In_ PKDPC Dpc, _In_ PVOID DeferredContext, _In_ PVOID SystemArgument1, _In_ PVOID SystemArgument2 )
+	{
+		UNREFERENCED_PARAMETER( Dpc );
+		UNREFERENCED_PARAMETER( DeferredContext );
+		UNREFERENCED_PARAMETER( SystemArgument2 );
+
+		// Same as under an IPI, nothing may interrupt the flush with one of its own.
+		uint64_t Flags = __readeflags( );
+		_disable( );
+		FlushLocal( (const FlushInput_t*)SystemArgument1 );
+
+		if ( Flags & EFLAGS_IF_MASK )
+			_enable( );
+
+		InterlockedDecrement( &FlushDpcsPending );
+	}
+
+	/*
+	*	Interrupts only the targets of the flush, with a DPC on each of them, and waits for all of them to finish.
+	*	Returns false if the caller is at DISPATCH_LEVEL or above, where waiting on a DPC could deadlock against
+	*	a processor spinning for us, or if the DPCs are in use. Nothing was done then.
+	*/
+	static bool FlushWithDpcs( _In_ const FlushInput_t* Flush )
+	{
+		if ( Flush->Processors.All || KeGetCurrentIrql( ) >= DISPATCH_LEVEL )
+			return false;
+
+		if ( FlushDpcsBusy || _InterlockedExchange( &FlushDpcsBusy, 1 ) )
+			return false;
+
+		// Stay on this processor until every DPC is queued, our own share is done right here.
+		KIRQL Irql;
+		KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+
+		// Processors which aren't running yet have nothing to flush, and would never answer.
+		uint32_t Count = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+		if ( Count > FlushDpcCount )
+			Count = FlushDpcCount;
+
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			if ( i == Cpu || !IsTargeted( &Flush->Processors, i ) )
+				continue;
+
+			InterlockedIncrement( &FlushDpcsPending );
+			KeInsertQueueDpc( &FlushDpcs[ i ], (PVOID)Flush, 0 );
+		}
+
+		if ( IsTargeted( &Flush->Processors, Cpu ) )
+		{
+			uint64_t Flags = __readeflags( );
+			_disable( );
+			FlushLocal( Flush );
+
+			if ( Flags & EFLAGS_IF_MASK )
+				_enable( );
+		}
+
+		// Lowered before waiting, so a DPC queued on this processor by someone else can still run.
+		KeLowerIrql( Irql );
+
+		while ( FlushDpcsPending )
+			_mm_pause( );
+
+		_InterlockedExchange( &FlushDpcsBusy, 0 );
+		return true;
+	}
+
+	/*
+	*	Flush work queued for one processor while coalescing. Generations come from FlushGeneration,
+	*	a processor is done with every generation up to Completed.
+	*/
+	struct alignas( 64 ) FlushTarget_t
+	{
+		volatile int64_t Requested;			// Newest generation queued for this processor.
+		volatile int64_t GlobalRequested;	// Newest generation which also wants global entries gone.
+		volatile int64_t Completed;			// Only written by this processor.
+	};
+
+	volatile bool FlushCoalescing;
+	uint32_t FlushCoalescingWindow;
+	FlushTarget_t* volatile FlushTargets;
+	uint32_t FlushTargetCount;
+	volatile int64_t FlushGeneration;
+	volatile long FlushLeader;
+
+	/*
+	*	Enables or disables coalescing of remote flushes. While enabled, concurrent flushes are merged into
+	*	whole address space flushes and handed out together by a single IPI, the first requester sends it after
+	*	waiting WindowUs microseconds for more to arrive. Flushes done page by page are never coalesced.
+	*	Must be called at PASSIVE_LEVEL.
+	*/
+	bool SetFlushCoalescing( _In_ bool Enable, _In_ uint32_t WindowUs )
+	{
+		if ( Enable && !FlushTargets )
+		{
+			// Page aligned, so no target shares a cache line with anything else.
+			uint32_t Count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+			uint64_t Size = ROUND_TO_PAGES( Count * sizeof( FlushTarget_t ) );
+
+			FlushTarget_t* Targets = (FlushTarget_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Size );
+			if ( !Targets )
+				return false;
+
+			memset( Targets, 0, Size );
+			FlushTargetCount = Count;
+
+			if ( InterlockedCompareExchangePointer( (void* volatile*)&FlushTargets, Targets, 0 ) )
+				ExFreePool( Targets );
+		}
+
+		FlushCoalescingWindow = WindowUs;
+		FlushCoalescing = Enable;
+		return true;
+	}
+
+	/*
+	*	Raises a generation to at least the given one, generations never go back.
+	*/
+	static void RaiseGeneration( _In_ volatile int64_t* Current, _In_ int64_t Generation )
+	{
+		for ( int64_t Value = *Current; Value < Generation; )
+		{
+			int64_t Previous = InterlockedCompareExchange64( Current, Generation, Value );
+			if ( Previous == Value )
+				break;
+
+			Value = Previous;
+		}
+	}
+
+	/*
+	*	Does everything queued for the current processor, with interrupts off so it can't be interrupted by itself.
+	*/
+	static void ServiceFlushTarget( _In_ FlushTarget_t* Target )
+	{
+		int64_t Requested = Target->Requested;
+		if ( Requested <= Target->Completed )
+			return;
+
+		// Requesters raise GlobalRequested before Requested, so it already covers every generation up to Requested.
+		_ReadWriteBarrier( );
+		bool Global = Target->GlobalRequested > Target->Completed;
+
+		// Every merged request is at most a whole address space, so flushing all of them covers it.
+		FlushTB( Global ? 0 : HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY | HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES );
+
+		_ReadWriteBarrier( );
+		Target->Completed = Requested;
+	}
+
+	/*
+	*	IPI worker of coalesced flushes, every processor does whatever was queued for it so far.
+	*/
+	static ULONG_PTR CoalescedFlushWorker( _In_ ULONG_PTR Context )
+	{
+		FlushTarget_t* Targets = (FlushTarget_t*)Context;
+
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		if ( Cpu < FlushTargetCount )
+			ServiceFlushTarget( &Targets[ Cpu ] );
+
+		return 0;
+	}
+
+	/*
+	*	Queues the flush for every target under a new generation, and waits until all of them are past it.
+	*	Returns false if coalescing is off, in which case nothing was done.
+	*/
+	static bool CoalesceFlush( _In_ const FlushInput_t* Flush )
+	{
+		// The targets are only used at DISPATCH_LEVEL or above, which keeps them alive, and the leader can't be preempted.
+		KIRQL Irql = KeGetCurrentIrql( );
+		if ( Irql < DISPATCH_LEVEL )
+			KeRaiseIrql( DISPATCH_LEVEL, &Irql );
+
+		FlushTarget_t* Targets = FlushTargets;
+		if ( !FlushCoalescing || !Targets )
+		{
+			if ( Irql < DISPATCH_LEVEL )
+				KeLowerIrql( Irql );
+
+			return false;
+		}
+
+		// Processors which aren't running yet have nothing to flush, and would never answer.
+		uint32_t Count = KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS );
+		if ( Count > FlushTargetCount )
+			Count = FlushTargetCount;
+		bool Global = !(Flush->Flags & HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY);
+		int64_t Generation = InterlockedIncrement64( &FlushGeneration );
+
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			if ( !IsTargeted( &Flush->Processors, i ) )
+				continue;
+
+			if ( Global )
+				RaiseGeneration( &Targets[ i ].GlobalRequested, Generation );
+
+			RaiseGeneration( &Targets[ i ].Requested, Generation );
+		}
+
+		// Our own share doesn't need an IPI.
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		if ( Cpu < Count && IsTargeted( &Flush->Processors, Cpu ) )
+		{
+			uint64_t Flags = __readeflags( );
+			_disable( );
+			ServiceFlushTarget( &Targets[ Cpu ] );
+
+			if ( Flags & EFLAGS_IF_MASK )
+				_enable( );
+		}
+
+		for ( uint32_t i = 0; i < Count; )
+		{
+			if ( !IsTargeted( &Flush->Processors, i ) || Targets[ i ].Completed >= Generation )
+			{
+				i++;
+				continue;
+			}
+
+			// Whoever gets here first interrupts everyone once for everything queued so far, the others wait for it.
+			// An IPI which went out before our generation was queued doesn't count, so keep going until it is done.
+			if ( !FlushLeader && !_InterlockedExchange( &FlushLeader, 1 ) )
+			{
+				if ( FlushCoalescingWindow )
+					KeStallExecutionProcessor( FlushCoalescingWindow );
+
+				KeIpiGenericCall( CoalescedFlushWorker, ULONG_PTR( Targets ) );
+				_InterlockedExchange( &FlushLeader, 0 );
+			}
+			else
+			{
+				_mm_pause( );
+			}
+		}
+
+		if ( Irql < DISPATCH_LEVEL )
+			KeLowerIrql( Irql );
+
+		return true;
+	}
+
 	/*
 	*	Flushes the cache for all cores by doing an IPI.
 	*/
 	void FlushTBAllCores( )
 	{
-		KeIpiGenericCall( PKIPI_BROADCAST_WORKER( &FlushTB ), 0 );
+		FlushTBProcessors( 0, HV_FLUSH_ALL_PROCESSORS );
+	}
+
+	/*
+	*	Flushes the cache of the processors in the mask, or of all of them with HV_FLUSH_ALL_PROCESSORS.
+	*/
+	void FlushTBProcessors( _In_ uint64_t ProcessorMask, _In_ uint64_t Flags )
+	{
+		FlushInput_t Flush{ };
+		Flush.Flags = Flags;
+		Flush.Processors.All = (Flags & HV_FLUSH_ALL_PROCESSORS) != 0;
+		Flush.Processors.Banks[ 0 ] = ProcessorMask;
+
+		FlushProcessors( &Flush );
+	}
+
+	/*
+	*	Executes a decoded flush on every processor it targets.
+	*/
+	void FlushProcessors( _In_ const FlushInput_t* Flush )
+	{
+		// The set can't be mapped onto processors, so everyone flushes.
+		if ( !Flush->Processors.All && !VpIndexIsProcessorIndex )
+		{
+			FlushInput_t Everyone = *Flush;
+			Everyone.Processors.All = true;
+			return FlushProcessors( &Everyone );
+		}
+
+		if ( !Flush->Processors.All )
+		{
+			// Only ourselves, which is common for single threaded processes, no need to interrupt anyone.
+			uint32_t Cpu = KeGetCurrentProcessorIndex( );
+			bool Others = false;
+			for ( uint32_t Bank = 0; Bank < HV_MAX_VP_BANKS && !Others; Bank++ )
+				Others = (Flush->Processors.Banks[ Bank ] & ~(Bank == Cpu / 64 ? 1ULL << (Cpu % 64) : 0)) != 0;
+
+			if ( !Others )
+			{
+				if ( IsTargeted( &Flush->Processors, Cpu ) )
+					FlushLocal( Flush );
+
+				return;
+			}
+		}
+
+		if ( FlushCoalescing && !FlushesByPage( Flush ) && CoalesceFlush( Flush ) )
+			return;
+
+		if ( FlushWithDpcs( Flush ) )
+			return;
+
+		// The kernel exports no way to send an IPI to only a set of processors, so everyone gets the IPI,
+		// but the processors outside the set return right away instead of flushing.
+		KeIpiGenericCall( FlushWorker, ULONG_PTR( Flush ) );
 	}
 
 	/*
-	*	Switch to new address space and flush cache for the current core.
+	*	Emulates HvCallFlushVirtualAddressSpace from its input block.
+	*/
+	void FlushAddressSpace( _In_ uint64_t InputPa )
+	{
+		FlushVirtualAddresses( ECommand::SlowFlushAddressSpace, InputPa );
+	}
+
+	/*
+	*	Emulates any of the memory based flush hypercalls, returning the hypercall result value.
+	*	Every rep is done by the time this returns, so the rep count is always reported as complete.
+	*/
+	uint64_t FlushVirtualAddresses( _In_ ECommand Cmd, _In_ uint64_t InputPa )
+	{
+		FlushInput_t Flush;
+		if ( DecodeFlush( Cmd, InputPa, &Flush ) )
+			FlushProcessors( &Flush );
+		else
+			FlushTBAllCores( );
+
+		return HV_STATUS_SUCCESS | HV_HYPERCALL_REPS_COMPLETE( HV_HYPERCALL_REP_COUNT( Cmd ) );
+	}
+
+	/*
+	*	IPI callback flagging any processor whose virtual processor index isn't its processor index.
+	*/
+	static ULONG_PTR CheckVpIndexIPICallback( _In_ ULONG_PTR Mismatch )
+	{
+		if ( __readmsr( HV_X64_MSR_VP_INDEX ) != KeGetCurrentProcessorIndex( ) )
+			*(volatile bool*)Mismatch = true;
+
+		return 0;
+	}
+
+	/*
+	*	Sets up the DPCs of targeted flushes and checks how virtual processors are numbered,
+	*	must be called after HyperV::Initialize.
+	*/
+	void Initialize( )
+	{
+		// Without the DPCs every remote flush is an IPI to everyone, which still works.
+		if ( !FlushDpcs )
+		{
+			uint32_t Count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+			KDPC* Dpcs = (KDPC*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Count * sizeof( KDPC ) );
+			if ( Dpcs )
+			{
+				// Processor indices are dense, anything past the first one without a number can't be targeted.
+				uint32_t i = 0;
+				for ( PROCESSOR_NUMBER Number; i < Count && NT_SUCCESS( KeGetProcessorNumberFromIndex( i, &Number ) ); i++ )
+				{
+					KeInitializeDpc( &Dpcs[ i ], FlushDpcRoutine, 0 );
+					KeSetTargetProcessorDpcEx( &Dpcs[ i ], &Number );
+					KeSetImportanceDpc( &Dpcs[ i ], HighImportance );
+				}
+
+				FlushDpcs = Dpcs;
+				FlushDpcCount = i;
+				_InterlockedExchange( &FlushDpcsBusy, 0 );
+			}
+		}
+
+		// Without Hyper-V there are no virtual processors, the kernel numbers them by processor index.
+		VpIndexIsProcessorIndex = true;
+		if ( !HyperVRunning )
+			return;
+
+		// Can't tell without the privilege, so assume they differ.
+		int Regs[ 4 ]{};
+		__cpuid( Regs, 0x40000003 );
+		if ( !(Regs[ 0 ] & HV_ACCESS_VP_INDEX) )
+		{
+			VpIndexIsProcessorIndex = false;
+			return;
+		}
+
+		volatile bool Mismatch = false;
+		KeIpiGenericCall( CheckVpIndexIPICallback, ULONG_PTR( &Mismatch ) );
+		VpIndexIsProcessorIndex = !Mismatch;
+	}
+
+	/*
+	*	Turns coalescing and targeted flushes off and frees their state, once nothing can be flushing through it anymore.
+	*	Must be called at PASSIVE_LEVEL.
+	*/
+	void Destroy( )
+	{
+		FlushCoalescing = false;
+
+		// Waits for a targeted flush still using the DPCs, and keeps them taken until the next Initialize.
+		while ( _InterlockedExchange( &FlushDpcsBusy, 1 ) )
+			_mm_pause( );
+
+		FlushTarget_t* Targets = FlushTargets;
+		KDPC* Dpcs = FlushDpcs;
+		if ( !Targets && !Dpcs )
+			return;
+
+		FlushTargets = 0;
+		FlushDpcs = 0;
+		FlushDpcCount = 0;
+
+		// Coalesced flushes only use the targets at DISPATCH_LEVEL or above, and a flush DPC may still be returning,
+		// a DPC on every processor waits them out.
+		Utils::DispatchOnAllProcessors( []( void* ) { }, 0 );
+
+		if ( Targets )
+			ExFreePool( Targets );
+
+		if ( Dpcs )
+			ExFreePool( Dpcs );
+	}
+
+	/*
+	*	Switch to new address space, the cache of the current core is only flushed without PCIDs.
 	*/
 	void SwitchAddressSpace( _In_ uint64_t NewCR3 )
 	{
@@ -53,6 +699,14 @@ namespace HyperDeceit::HyperV::Emulator
 			return;
 		}
 
+		// With CR4.PCIDE every address space keeps its own entries, so no flush on top. The value is written as given,
+		// the kernel already sets CR3.NoFlush (bit 63) when the new PCID's entries are still good.
+		if ( __readcr4( ) & (1 << 17) )
+		{
+			__writecr3( NewCR3 );
+			return;
+		}
+
 		__writecr3( NewCR3 );
 		FlushTB( );
 	}
@@ -66,16 +720,32 @@ namespace HyperDeceit::HyperV::Emulator
 	}
 
 	/*
-	*	Emulates the command if it can emulate the command.
+	*	Emulates the command if it can emulate the command, returning the hypercall result value.
 	*/
-	void EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input )
+	uint64_t EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input, _In_opt_ uint64_t Output )
 	{
-		switch ( Cmd )
+		switch ( GetCallCode( Cmd ) )
 		{
-			case ECommand::SlowFlushAddressSpace: return FlushTBAllCores( );
-			case ECommand::FastFlushAddressSpace: return FlushTB( );
-			case ECommand::SwitchAddressSpace: return SwitchAddressSpace( Input );
-			case ECommand::LongSpinWait: return NotifySpinWait( );
+			case ECommand::SlowFlushAddressSpace:
+			case ECommand::FlushAddressList:
+			case ECommand::FlushAddressSpaceEx:
+			case ECommand::FlushAddressListEx:
+				return FlushVirtualAddresses( Cmd, Input );
+
+			// Register input, the address space in Input and the flags in Output.
+			case ECommand::FastFlushAddressSpace: FlushTB( Output ); break;
+			case ECommand::SwitchAddressSpace: SwitchAddressSpace( Input ); break;
+			case ECommand::LongSpinWait: NotifySpinWait( ); break;
+
+			// Fast (register input) variants of the other flushes, too little to decode, flush everything.
+			default:
+				if ( GetEnlightenmentFromCommand( Cmd ) == EEnlightenments::VirtualizedRemoteFlush )
+				{
+					FlushTBAllCores( );
+					return HV_STATUS_SUCCESS | HV_HYPERCALL_REPS_COMPLETE( HV_HYPERCALL_REP_COUNT( Cmd ) );
+				}
 		}
+
+		return HV_STATUS_SUCCESS;
 	}
 }
\ No newline at end of file
@@ -13,12 +13,90 @@
 #include "..\..\Common.hpp"
 #include "..\HyperV.hpp"
 
+// HV_FLUSH_* flags of the flush hypercalls.
+#define HV_FLUSH_ALL_PROCESSORS 0x1
+#define HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES 0x2
+#define HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY 0x4
+#define HV_FLUSH_USE_EXTENDED_RANGE_FORMAT 0x8
+
+// HV_GENERIC_SET formats of the Ex flush hypercalls.
+#define HV_GENERIC_SET_SPARSE_4K 0
+#define HV_GENERIC_SET_ALL 1
+#define HV_MAX_VP_BANKS 64
+
+// Above this many pages a list flush flushes everything instead, see SetFlushListThreshold.
+#define FLUSH_LIST_DEFAULT_THRESHOLD 32
+
+// Index of the current virtual processor, readable with the AccessVpIndex privilege.
+#define HV_X64_MSR_VP_INDEX 0x40000002
+#define HV_ACCESS_VP_INDEX ( 1 << 6 )
+
 namespace HyperDeceit::HyperV::Emulator
 {
+	// Type 0 (one address in one PCID) is left out, list flushes can't name the PCID of the address space
+	// on every processor, so they never flush by page with PCIDs on, see FlushesByPage.
+	enum class EInvpcidType : uint32_t
+	{
+		SingleContext = 1,		// Every non-global entry of one PCID.
+		AllContextsGlobal,		// Everything.
+		AllContexts				// Every non-global entry of every PCID.
+	};
+
+	struct InvpcidDescriptor_t
+	{
+		uint64_t Pcid;			// Only the low 12 bits are used.
+		uint64_t Address;
+	};
+
+	/*
+	*	Input block of HvCallFlushVirtualAddressSpace, bit N of ProcessorMask is virtual processor N.
+	*/
+	struct HV_FLUSH_VIRTUAL_ADDRESS_SPACE_INPUT
+	{
+		uint64_t AddressSpace;
+		uint64_t Flags;
+		uint64_t ProcessorMask;
+	};
+
+	/*
+	*	Processors targeted by a flush, bit N of bank B is processor B * 64 + N.
+	*/
+	struct ProcessorSet_t
+	{
+		bool All;
+		uint64_t Banks[ HV_MAX_VP_BANKS ];
+	};
+
+	/*
+	*	A flush hypercall decoded from its input block, the same for every variant.
+	*	Entries point into the hypercall input page and are only valid while the hypercall is handled.
+	*/
+	struct FlushInput_t
+	{
+		uint64_t AddressSpace;
+		uint64_t Flags;
+		ProcessorSet_t Processors;
+		const uint64_t* Entries;	// Page number in bits 12-63, additional pages after it in bits 0-11.
+		uint32_t EntryCount;		// 0 for the address space variants.
+		uint32_t PageCount;
+	};
+
+	bool IsListFlush( _In_ ECommand Cmd );
+	bool DecodeFlush( _In_ ECommand Cmd, _In_ uint64_t InputPa, _Out_ FlushInput_t* Flush );
+	void SetFlushListThreshold( _In_ uint32_t Pages );
+	bool SetFlushCoalescing( _In_ bool Enable, _In_ uint32_t WindowUs );
+	void Initialize( );
+	void Destroy( );
+
 	void FlushTB( );
+	void FlushTB( _In_ uint64_t Flags );
 	void FlushTBAllCores( );
+	void FlushTBProcessors( _In_ uint64_t ProcessorMask, _In_ uint64_t Flags );
+	void FlushProcessors( _In_ const FlushInput_t* Flush );
+	void FlushAddressSpace( _In_ uint64_t InputPa );
+	uint64_t FlushVirtualAddresses( _In_ ECommand Cmd, _In_ uint64_t InputPa );
 	void SwitchAddressSpace( _In_ uint64_t NewCR3 );
 	void NotifySpinWait( );
 
-	void EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input );
+	uint64_t EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input, _In_opt_ uint64_t Output );
 }
\ No newline at end of file
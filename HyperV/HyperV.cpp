@@ -10,6 +10,8 @@
 */
 
 #include "HyperV.hpp"
+#include "SignatureCache.hpp"
+#include "..\Utils\Xrefs.hpp"
 
 namespace HyperDeceit::HyperV
 {
@@ -23,15 +25,105 @@ namespace HyperDeceit::HyperV
 	bool* HalpHvSleepEnlightenedCpuManager; bool OriginalHalpHvSleepEnlightenedCpuManager;
 	int* HvlLongSpinCountMask; int OriginalHvlLongSpinCountMask;
 	HAL_INTEL_ENLIGHTENMENT_INFORMATION* EnlightenmentInformation; HAL_INTEL_ENLIGHTENMENT_INFORMATION OriginalEnlightenmentInformation;
+	uint64_t SignatureMatches[ uint32_t( ESignature::Max ) ];
+	Utils::SignatureSet Signatures;
+
+	constexpr Utils::Pattern HvlEnlightenmentsPattern( "F7 05 ? ? ? ? 01 00 00 00 74 ? E8" );
+	constexpr Utils::Pattern EnlightenmentInformationPattern( "89 05 ? ? ? ? E8 ? ? ? ? F6 C3 01 74" );
+	constexpr Utils::Pattern HalpHvSleepEnlightenedCpuManagerPattern( "40 38 3D ? ? ? ? 74 ? B9 05" );
+	constexpr Utils::Pattern SleepStateCallbacksPattern( "48 8D 05 ? ? ? ? 48 89 43 38 48 8D 05" );	// HvlGetEnlightenmentInfo callback initializers
+	constexpr Utils::Pattern HvlLongSpinCountMaskPattern( "85 3D ? ? ? ? 75 1C 8B 05 ? ? ? ? A8 40" );
+
+	// Same order as ESignature.
+	constexpr Utils::PatternView SignaturePatterns[] =
+	{
+		HvlEnlightenmentsPattern.View(),
+		EnlightenmentInformationPattern.View(),
+		HalpHvSleepEnlightenedCpuManagerPattern.View(),
+		SleepStateCallbacksPattern.View(),
+		HvlLongSpinCountMaskPattern.View()
+	};
+	static_assert( RTL_NUMBER_OF( SignaturePatterns ) == uint32_t( ESignature::Max ), "Missing signature pattern" );
+
+	/*
+	*	Scans ntoskrnl once for every signature in ESignature and stores the matches.
+	*	Signatures which are still at their cached location are not scanned for.
+	*	Returns false if ntoskrnl could not be scanned, missing matches are left as 0.
+	*/
+	bool ResolveSignatures( _In_ uint64_t KernelBase )
+	{
+		if (!KernelBase)
+			PANIC( PANIC_KERNELBASE_NULL, "Kernel base was null" );
+
+		uint32_t Pending[ uint32_t( ESignature::Max ) ];
+		uint32_t PendingCount = 0;
+
+		Signatures.Destroy();
+		for (uint32_t i = 0; i < uint32_t( ESignature::Max ); i++)
+		{
+			// Cache hit, the bytes are still there.
+			uint64_t Cached = SignatureCache::Lookup( i, SignaturePatterns[ i ].Length );
+			if (Cached && Utils::IsPatternAt( Cached, SignaturePatterns[ i ] ))
+			{
+				SignatureMatches[ i ] = Cached;
+				continue;
+			}
+
+			SignatureMatches[ i ] = 0;
+			Pending[ PendingCount++ ] = i;
+			Signatures.Add( SignaturePatterns[ i ] );
+		}
+
+		bool Scanned = true;
+		if (PendingCount)
+		{
+			// Every signature is code, so only look inside .pdata functions first.
+			// Leaf functions have no unwind data though, so anything left over falls back to the full scan.
+			bool Missing = !Signatures.ScanFunctions( KernelBase );
+			for (uint32_t i = 0; i < PendingCount && !Missing; i++)
+				Missing = !Signatures.Result( i );
+
+			if (Missing)
+				Scanned = Signatures.Scan( KernelBase );
+
+			for (uint32_t i = 0; i < PendingCount; i++)
+				SignatureMatches[ Pending[ i ] ] = Signatures.Result( i );
+		}
+
+		Signatures.Destroy();
+
+		for (uint32_t i = 0; i < uint32_t( ESignature::Max ); i++)
+			SignatureCache::Store( i, SignatureMatches[ i ] );
+
+		return Scanned;
+	}
+
+	/*
+	*	Returns the address the signature matched at, 0 if it was not found.
+	*/
+	uint64_t GetSignatureMatch( _In_ ESignature Signature )
+	{
+		return SignatureMatches[ uint32_t( Signature ) ];
+	}
 
 	/*
 	*	Returns the enlightenment responsible for the command.
 	*/
 	EEnlightenments GetEnlightenmentFromCommand( ECommand Cmd )
 	{
-		switch (Cmd)
+		switch (GetCallCode( Cmd ))
 		{
-			case ECommand::SlowFlushAddressSpace: return EEnlightenments::VirtualizedRemoteFlush;
+			case ECommand::SlowFlushAddressSpace:
+			case ECommand::FlushAddressList:
+			case ECommand::FlushAddressSpaceEx:
+			case ECommand::FlushAddressListEx:
+
+			// Register (XMM) input variants, only ever emulated as a full flush.
+			case ECommand::FlushAddressList | HV_HYPERCALL_FAST_BIT:
+			case ECommand::FlushAddressSpaceEx | HV_HYPERCALL_FAST_BIT:
+			case ECommand::FlushAddressListEx | HV_HYPERCALL_FAST_BIT:
+				return EEnlightenments::VirtualizedRemoteFlush;
+
 			case ECommand::FastFlushAddressSpace: return EEnlightenments::VirtualizedLocalFlush;
 
 			case ECommand::EnterSleepState:
@@ -45,6 +137,27 @@ namespace HyperDeceit::HyperV
 		return EEnlightenments::Unknown;
 	}
 
+	/*
+	*	Returns the dense index of the command, ECommandId::Unknown if it is not one we know of.
+	*/
+	ECommandId GetCommandId( ECommand Cmd )
+	{
+		switch (GetCallCode( Cmd ))
+		{
+			case ECommand::SlowFlushAddressSpace: return ECommandId::SlowFlushAddressSpace;
+			case ECommand::FastFlushAddressSpace: return ECommandId::FastFlushAddressSpace;
+			case ECommand::FlushAddressList: return ECommandId::FlushAddressList;
+			case ECommand::FlushAddressSpaceEx: return ECommandId::FlushAddressSpaceEx;
+			case ECommand::FlushAddressListEx: return ECommandId::FlushAddressListEx;
+			case ECommand::EnterSleepState: return ECommandId::EnterSleepState;
+			case ECommand::DebugDeviceAvailable: return ECommandId::DebugDeviceAvailable;
+			case ECommand::SwitchAddressSpace: return ECommandId::SwitchAddressSpace;
+			case ECommand::LongSpinWait: return ECommandId::LongSpinWait;
+		}
+
+		return ECommandId::Unknown;
+	}
+
 	/*
 	*	Gets the KPRCB offset for "HypercallCachedPages".
 	*	Currently only supports Windows 10 1709 - Windows 11 22H2
@@ -125,17 +238,14 @@ namespace HyperDeceit::HyperV
 	*	Gets the pointer to HalpHvSleepEnlightenedCpuManager bool from ntoskrnl.
 	*	Required for certain callbacks.
 	*/
-	bool* FindHalpHvSleepEnlightenedCpuManager( _In_ uint64_t KernelBase )
+	bool* FindHalpHvSleepEnlightenedCpuManager( )
 	{
-		if (!KernelBase)
-			PANIC( PANIC_KERNELBASE_NULL, "Kernel base was null" );
-
-		uint64_t Addr = Utils::FindPattern( KernelBase, "\x40\x38\x3D\xCC\xCC\xCC\xCC\x74\xCC\xB9\x05" );
+		uint64_t Addr = GetSignatureMatch( ESignature::HalpHvSleepEnlightenedCpuManager );
 		if (!Addr)
 			return 0;
 
 		// Resolves the relative reference to HalpHvSleepEnlightenedCpuManager.
-		HalpHvSleepEnlightenedCpuManager = (bool*)(*(int*)(Addr + 3) + Addr + 7);
+		HalpHvSleepEnlightenedCpuManager = (bool*)Utils::ResolveRelative( Addr );
 		return HalpHvSleepEnlightenedCpuManager;
 	}
 
@@ -143,17 +253,14 @@ namespace HyperDeceit::HyperV
 	*	Gets the pointer to the HAL_INTEL_ENLIGHTENMENT_INFORMATION stored in ntoskrnl.
 	*	Required for certain callbacks.
 	*/
-	HAL_INTEL_ENLIGHTENMENT_INFORMATION* FindHvEnlightenmentInformation( _In_ uint64_t KernelBase )
+	HAL_INTEL_ENLIGHTENMENT_INFORMATION* FindHvEnlightenmentInformation( )
 	{
-		if (!KernelBase)
-			PANIC( PANIC_KERNELBASE_NULL, "Kernel base was null" );
-
-		uint64_t Addr = Utils::FindPattern( KernelBase, "\x89\x05\xCC\xCC\xCC\xCC\xE8\xCC\xCC\xCC\xCC\xF6\xC3\x01\x74" );
+		uint64_t Addr = GetSignatureMatch( ESignature::EnlightenmentInformation );
 		if (!Addr)
 			return 0;
 
 		// Resolves the relative reference to HvEnlightenmentInformation.
-		EnlightenmentInformation = (HAL_INTEL_ENLIGHTENMENT_INFORMATION*)(*(int*)(Addr + 2) + Addr + 6);
+		EnlightenmentInformation = (HAL_INTEL_ENLIGHTENMENT_INFORMATION*)Utils::ResolveRelative( Addr );
 		return EnlightenmentInformation;
 	}
 
@@ -167,8 +274,8 @@ namespace HyperDeceit::HyperV
 		if (!KernelBase)
 			PANIC( PANIC_KERNELBASE_NULL, "Kernel base was null" );
 
-		// Let the windows kernel find the exported routine HvlInvokeHypercall/HvcallInitiateHypercall.
-		uint64_t HvlInvokeHypercall = RtlFindExportedRoutineByName( KernelBase, "HvlInvokeHypercall" );
+		// Find the exported routine HvlInvokeHypercall/HvcallInitiateHypercall, through the export index built at initialization.
+		uint64_t HvlInvokeHypercall = Utils::FindExport( KernelBase, Utils::HashExportName( "HvlInvokeHypercall" ) );
 
 		// Not found???
 		if (!HvlInvokeHypercall)
@@ -177,47 +284,89 @@ namespace HyperDeceit::HyperV
 			return 0;
 		}
 
-		// Get function information from SEH data.
-		RUNTIME_FUNCTION RuntimeData{};
-		UNWIND_INFO_HDR UnwindInfo{};
-		if (!Utils::GetFunctionInformation( HvlInvokeHypercall, &RuntimeData, &UnwindInfo ))
+		// Try the cached location of the reference first, it has to be a mov inside HvlInvokeHypercall itself.
+		// Any other global loaded the same way would pass the byte check alone.
+		uint64_t Cached = SignatureCache::Lookup( CACHE_ENTRY_HVCALLCODEVA, 7 );
+		Utils::LogicalFunction_t Function;
+		if (Cached && (*(uint32_t*)Cached & 0xFFFFFF) == 0x058B48 &&
+			Utils::GetLogicalFunction( Cached, &Function ) && Function.Base + Function.Primary.FunctionStart == HvlInvokeHypercall)
+		{
+			void** Reference = (void**)Utils::ResolveRelative( Cached );
+			if (Reference && MmIsAddressValid( *Reference ))
+			{
+				HvcallCodeVa = Reference;
+				return Reference;
+			}
+		}
+
+		// If something already built the xref index, the reference is one of the globals HvlInvokeHypercall reads.
+		// Sweeping the whole kernel for this one lookup costs far more than decoding the function below.
+		if (Utils::Xrefs::IsBuilt( KernelBase ))
+		{
+			Utils::Xrefs::Xref_t Reads[ 32 ];
+			uint32_t Count = Utils::Xrefs::QueryFunction( HvlInvokeHypercall, Utils::Xrefs::EXrefKind::Read, Reads, 32 );
+			for (uint32_t i = 0; i < Count && i < 32; i++)
+			{
+				// 48 8B 05 ?? ?? ?? ??		mov rax, cs:HvcallCodeVa
+				uint64_t Source = KernelBase + Reads[ i ].Source;
+				void** Reference = (void**)(KernelBase + Reads[ i ].Target);
+				if ((*(uint32_t*)Source & 0xFFFFFF) == 0x058B48 && MmIsAddressValid( *Reference ))
+				{
+					SignatureCache::Store( CACHE_ENTRY_HVCALLCODEVA, Source );
+					HvcallCodeVa = Reference;
+					return Reference;
+				}
+			}
+		}
+
+		// Get the whole function from SEH data, including any chained fragments.
+		if (!Utils::GetLogicalFunction( HvlInvokeHypercall, &Function ))
 		{
 			// Should literally never occur, but still handle it just in case....
 			DBG( "Failed to find HvlInvokeHypercall SEH information" );
 			return 0;
 		}
 
-		// Skip prologue.
-		uint64_t PC = HvlInvokeHypercall + UnwindInfo.PrologueSize;
-
-		// Walk till the end of the function is reached.
-		while (PC < (HvlInvokeHypercall + RuntimeData.FunctionEnd))
+		for (uint32_t i = 0; i < Function.FragmentCount; i++)
 		{
-			hde64s HDE;
-			hde64_disasm( (void*)PC, &HDE );
+			RUNTIME_FUNCTION* Fragment = &Function.Fragments[ i ];
+			uint64_t PC = Function.Base + Fragment->FunctionStart;
+			uint64_t End = Function.Base + Fragment->FunctionEnd;
 
-			// Failed to disassemble???
-			if (HDE.flags & F_ERROR)
-				PANIC( PANIC_FAILED_TO_DISASSEMBLE, "Failed to disassemble 0x%p", PC );
+			// Skip prologue.
+			if (Fragment->FunctionStart == Function.Primary.FunctionStart)
+				PC += Function.PrimaryUnwind.PrologueSize;
 
-			// 48 8B 05 ?? ?? ?? ??		mov rax, cs:HvcallCodeVa
-			uint32_t Opcode = *(uint32_t*)PC & 0xFFFFFF;
-			if (Opcode == 0x058B48)
+			// Walk till the end of the fragment is reached.
+			while (PC < End)
 			{
-				// Resolve HvcallCodeVa.
-				void** Reference = (void**)(*(int*)(PC + 3) + PC + 7);
-
-				// If Hyper-V is not running, HvcallCodeVa always points to HvcallpNoHypervisorPresent.
-				// But if it is running, it will point to a page which is just a vmcall + ret with the rest of the page nop'd out.
-				if (!MmIsAddressValid( *Reference ))
-					continue;
-
-				HvcallCodeVa = Reference;
-				return Reference;
+				// Only the length is needed, so skip the full decode.
+				uint32_t Length = hde64_length( (void*)PC );
+
+				// Failed to disassemble???
+				if (!Length)
+					PANIC( PANIC_FAILED_TO_DISASSEMBLE, "Failed to disassemble 0x%p", PC );
+
+				// 48 8B 05 ?? ?? ?? ??		mov rax, cs:HvcallCodeVa
+				uint32_t Opcode = *(uint32_t*)PC & 0xFFFFFF;
+				if (Opcode == 0x058B48)
+				{
+					// Resolve HvcallCodeVa.
+					void** Reference = (void**)Utils::ResolveRelative( PC );
+
+					// If Hyper-V is not running, HvcallCodeVa always points to HvcallpNoHypervisorPresent.
+					// But if it is running, it will point to a page which is just a vmcall + ret with the rest of the page nop'd out.
+					if (Reference && MmIsAddressValid( *Reference ))
+					{
+						SignatureCache::Store( CACHE_ENTRY_HVCALLCODEVA, PC );
+						HvcallCodeVa = Reference;
+						return Reference;
+					}
+				}
+
+				// Increment instruction pointer.
+				PC += Length;
 			}
-
-			// Increment instruction pointer.
-			PC += HDE.len;
 		}
 
 		return 0;
@@ -227,17 +376,14 @@ namespace HyperDeceit::HyperV
 	*	Gets the HvlEnlightenments pointer from ntoskrnl,
 	*	Required to setup the enlightenments by HyperV / to trick windows.
 	*/
-	uint32_t* GetHvlEnlightenments( _In_ uint64_t KernelBase )
+	uint32_t* GetHvlEnlightenments( )
 	{
-		if (!KernelBase)
-			PANIC( PANIC_KERNELBASE_NULL, "Kernel base was null" );
-
-		uint64_t Addr = Utils::FindPattern( KernelBase, "\xF7\x05\xCC\xCC\xCC\xCC\x01\x00\x00\x00\x74\xCC\xE8" );
+		uint64_t Addr = GetSignatureMatch( ESignature::HvlEnlightenments );
 		if (!Addr)
 			return 0;
 
 		// Resolves the relative reference to HvlEnlightenments.
-		HvlEnlightenments = (uint32_t*)(*(int*)(Addr + 2) + Addr + 10);
+		HvlEnlightenments = (uint32_t*)Utils::ResolveRelative( Addr );
 		return HvlEnlightenments;
 	}
 }
\ No newline at end of file
@@ -12,8 +12,20 @@
 #pragma once
 #include "..\Common.hpp"
 #include "..\Utils\Utils.hpp"
+#include "..\Utils\SignatureSet.hpp"
 #include "..\Misc\HDE\HDE64.hpp"
 
+// Fields of the hypercall control value.
+#define HV_HYPERCALL_CODE_MASK 0x1FFFF
+#define HV_HYPERCALL_FAST_BIT 0x10000
+#define HV_HYPERCALL_VARIABLE_HEADER_SIZE( Control ) uint32_t( ((Control) >> 17) & 0x3FF )
+#define HV_HYPERCALL_REP_COUNT( Control ) uint32_t( ((Control) >> 32) & 0xFFF )
+#define HV_HYPERCALL_REP_START( Control ) uint32_t( ((Control) >> 48) & 0xFFF )
+
+// Hypercall result value, the status and how many reps were completed.
+#define HV_STATUS_SUCCESS 0
+#define HV_HYPERCALL_REPS_COMPLETE( Count ) (uint64_t( Count ) << 32)
+
 namespace HyperDeceit::HyperV
 {
 	enum EEnlightenments : uint32_t
@@ -31,6 +43,9 @@ namespace HyperDeceit::HyperV
 	{
 		SlowFlushAddressSpace = 2,
 		FastFlushAddressSpace = 0x10002,
+		FlushAddressList = 3,
+		FlushAddressSpaceEx = 0x13,
+		FlushAddressListEx = 0x14,
 
 		EnterSleepState = 0x84,
 		DebugDeviceAvailable = 0x87,
@@ -40,6 +55,32 @@ namespace HyperDeceit::HyperV
 		LongSpinWait = 0x10008
 	};
 
+	// Dense index of every ECommand, for per-command tables.
+	enum class ECommandId : uint32_t
+	{
+		SlowFlushAddressSpace,
+		FastFlushAddressSpace,
+		FlushAddressList,
+		FlushAddressSpaceEx,
+		FlushAddressListEx,
+		EnterSleepState,
+		DebugDeviceAvailable,
+		SwitchAddressSpace,
+		LongSpinWait,
+		Max,
+		Unknown = Max
+	};
+
+	// Every signature HyperDeceit scans ntoskrnl for, resolved in one pass by ResolveSignatures.
+	enum class ESignature : uint32_t
+	{
+		HvlEnlightenments,
+		EnlightenmentInformation,
+		HalpHvSleepEnlightenedCpuManager,
+		SleepStateCallbacks,
+		HvlLongSpinCountMask,
+		Max
+	};
 
 	typedef uint64_t( *HvDCallTemplate )(_In_ HyperV::ECommand Command, _In_ uint64_t Arg1, _In_ uint64_t Arg2);
 	
@@ -52,15 +93,28 @@ namespace HyperDeceit::HyperV
 	extern bool* HalpHvSleepEnlightenedCpuManager; extern bool OriginalHalpHvSleepEnlightenedCpuManager;
 	extern HAL_INTEL_ENLIGHTENMENT_INFORMATION* EnlightenmentInformation; extern HAL_INTEL_ENLIGHTENMENT_INFORMATION OriginalEnlightenmentInformation;
 	extern int* HvlLongSpinCountMask; extern int OriginalHvlLongSpinCountMask;
+	extern uint64_t SignatureMatches[ uint32_t( ESignature::Max ) ];
 
 
 	bool Initialize( );
 	void Stop( );
 
+	/*
+	*	The call code and fast bit of a hypercall control value, without the rep and variable header fields.
+	*/
+	__forceinline ECommand GetCallCode( ECommand Cmd )
+	{
+		return ECommand( Cmd & HV_HYPERCALL_CODE_MASK );
+	}
+
 	EEnlightenments GetEnlightenmentFromCommand( ECommand Cmd );
+	ECommandId GetCommandId( ECommand Cmd );
+
+	bool ResolveSignatures( _In_ uint64_t KernelBase );
+	uint64_t GetSignatureMatch( _In_ ESignature Signature );
 
 	void** GetHvcallCodeVa( _In_ uint64_t KernelBase );
-	uint32_t* GetHvlEnlightenments( _In_ uint64_t KernelBase );
-	HAL_INTEL_ENLIGHTENMENT_INFORMATION* FindHvEnlightenmentInformation( _In_ uint64_t KernelBase );
-	bool* FindHalpHvSleepEnlightenedCpuManager( _In_ uint64_t KernelBase );
+	uint32_t* GetHvlEnlightenments( );
+	HAL_INTEL_ENLIGHTENMENT_INFORMATION* FindHvEnlightenmentInformation( );
+	bool* FindHalpHvSleepEnlightenedCpuManager( );
 }
\ No newline at end of file
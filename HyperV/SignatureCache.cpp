@@ -0,0 +1,154 @@
+/*
+*		File name:
+*			SignatureCache.cpp
+*
+*		Use:
+*			Caches resolved signature locations across loads for the same ntoskrnl.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "SignatureCache.hpp"
+
+namespace HyperDeceit::HyperV::SignatureCache
+{
+	SignatureCache_t Cache;
+	uint64_t ImageBase;
+
+	/*
+	*	FNV-1a over the cache, excluding the checksum field.
+	*/
+	static uint32_t ComputeChecksum( _In_ const SignatureCache_t* Cache )
+	{
+		uint32_t Hash = 0x811C9DC5;
+		for ( uint32_t i = 0; i < offsetof( SignatureCache_t, Checksum ); i++ )
+			Hash = (Hash ^ ((const uint8_t*)Cache)[ i ]) * 0x01000193;
+
+		return Hash;
+	}
+
+	/*
+	*	Writes the cache to a buffer. If the buffer is null, only the required size is returned.
+	*/
+	bool Serialize( _In_ const SignatureCache_t* Cache, _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written )
+	{
+		*Written = sizeof( SignatureCache_t );
+		if ( !Buffer )
+			return true;
+
+		if ( Size < sizeof( SignatureCache_t ) )
+			return false;
+
+		SignatureCache_t Out = *Cache;
+		Out.Magic = SIGNATURE_CACHE_MAGIC;
+		Out.Version = SIGNATURE_CACHE_VERSION;
+		Out.EntryCount = CACHE_ENTRY_COUNT;
+		Out.Checksum = ComputeChecksum( &Out );
+
+		memcpy( Buffer, &Out, sizeof( SignatureCache_t ) );
+		return true;
+	}
+
+	/*
+	*	Reads a cache from a buffer, rejecting anything from another version or anything corrupted.
+	*/
+	bool Deserialize( _In_ const void* Buffer, _In_ uint32_t Size, _Out_ SignatureCache_t* Cache )
+	{
+		if ( !Buffer || Size != sizeof( SignatureCache_t ) )
+			return false;
+
+		SignatureCache_t In;
+		memcpy( &In, Buffer, sizeof( SignatureCache_t ) );
+
+		if ( In.Magic != SIGNATURE_CACHE_MAGIC || In.Version != SIGNATURE_CACHE_VERSION || In.EntryCount != CACHE_ENTRY_COUNT )
+			return false;
+
+		if ( In.Checksum != ComputeChecksum( &In ) )
+			return false;
+
+		*Cache = In;
+		return true;
+	}
+
+	/*
+	*	Loads a previously exported cache, has to be done before binding to the kernel.
+	*/
+	bool Import( _In_ const void* Buffer, _In_ uint32_t Size )
+	{
+		return Deserialize( Buffer, Size, &Cache );
+	}
+
+	/*
+	*	Exports the current cache so it can be persisted by the caller.
+	*/
+	bool Export( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written )
+	{
+		if ( !ImageBase )
+			return false;
+
+		return Serialize( &Cache, Buffer, Size, Written );
+	}
+
+	/*
+	*	Ties the cache to the kernel image, entries from another image are thrown away.
+	*/
+	void Bind( _In_ uint64_t KernelBase )
+	{
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( KernelBase );
+
+		if ( Cache.TimeDateStamp != NT->FileHeader.TimeDateStamp ||
+			Cache.SizeOfImage != NT->OptionalHeader.SizeOfImage ||
+			Cache.CheckSum != NT->OptionalHeader.CheckSum )
+		{
+			memset( &Cache, 0, sizeof( SignatureCache_t ) );
+			Cache.TimeDateStamp = NT->FileHeader.TimeDateStamp;
+			Cache.SizeOfImage = NT->OptionalHeader.SizeOfImage;
+			Cache.CheckSum = NT->OptionalHeader.CheckSum;
+		}
+
+		ImageBase = KernelBase;
+	}
+
+	/*
+	*	Gets the cached address for an entry, 0 if there is none or if the bytes at it
+	*	would not be inside a non-discardable section. The caller still has to check the bytes.
+	*/
+	uint64_t Lookup( _In_ uint32_t Entry, _In_ uint32_t Length )
+	{
+		if ( !ImageBase || Entry >= CACHE_ENTRY_COUNT || !Cache.Rva[ Entry ] )
+			return 0;
+
+		uint32_t Rva = Cache.Rva[ Entry ];
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( ImageBase );
+		PIMAGE_SECTION_HEADER SectionHeader = IMAGE_FIRST_SECTION( NT );
+
+		for ( int i = 0; i < NT->FileHeader.NumberOfSections; i++, SectionHeader++ )
+		{
+			if ( Rva < SectionHeader->VirtualAddress || Rva - SectionHeader->VirtualAddress >= SectionHeader->Misc.VirtualSize )
+				continue;
+
+			// Discardable sections are invalidated, so we should ignore them.
+			if ( SectionHeader->Characteristics & IMAGE_SCN_MEM_DISCARDABLE )
+				return 0;
+
+			if ( Length > SectionHeader->Misc.VirtualSize - (Rva - SectionHeader->VirtualAddress) )
+				return 0;
+
+			return ImageBase + Rva;
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Remembers where an entry was resolved, a null address clears it.
+	*/
+	void Store( _In_ uint32_t Entry, _In_ uint64_t Address )
+	{
+		if ( !ImageBase || Entry >= CACHE_ENTRY_COUNT )
+			return;
+
+		Cache.Rva[ Entry ] = Address ? uint32_t( Address - ImageBase ) : 0;
+	}
+}
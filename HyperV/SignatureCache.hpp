@@ -0,0 +1,52 @@
+/*
+*		File name:
+*			SignatureCache.hpp
+*
+*		Use:
+*			Caches resolved signature locations across loads for the same ntoskrnl.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "HyperV.hpp"
+
+// Bump the version whenever ESignature or the layout below changes.
+#define SIGNATURE_CACHE_MAGIC 'CSDH'
+#define SIGNATURE_CACHE_VERSION 1
+
+// The first entries are the signatures in ESignature order, followed by the HvcallCodeVa reference.
+#define CACHE_ENTRY_HVCALLCODEVA uint32_t( HyperDeceit::HyperV::ESignature::Max )
+#define CACHE_ENTRY_COUNT (CACHE_ENTRY_HVCALLCODEVA + 1)
+
+namespace HyperDeceit::HyperV::SignatureCache
+{
+	/*
+	*	Serialized cache, little endian. The key is taken from ntoskrnl's headers,
+	*	the checksum is FNV-1a over everything but the checksum itself.
+	*/
+#pragma pack( push, 1 )
+	struct SignatureCache_t
+	{
+		uint32_t Magic;
+		uint16_t Version;
+		uint16_t EntryCount;
+		uint32_t TimeDateStamp;
+		uint32_t SizeOfImage;
+		uint32_t CheckSum;
+		uint32_t Rva[ CACHE_ENTRY_COUNT ];	// RVA of the match, 0 if unknown.
+		uint32_t Checksum;
+	};
+#pragma pack( pop )
+
+	bool Serialize( _In_ const SignatureCache_t* Cache, _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written );
+	bool Deserialize( _In_ const void* Buffer, _In_ uint32_t Size, _Out_ SignatureCache_t* Cache );
+
+	bool Import( _In_ const void* Buffer, _In_ uint32_t Size );
+	bool Export( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written );
+	void Bind( _In_ uint64_t KernelBase );
+	uint64_t Lookup( _In_ uint32_t Entry, _In_ uint32_t Length );
+	void Store( _In_ uint32_t Entry, _In_ uint64_t Address );
+}
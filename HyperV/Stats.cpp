@@ -0,0 +1,90 @@
+/*
+*		File name:
+*			Stats.cpp
+*
+*		Use:
+*			Per-processor hypercall statistics, compiled out without _INSTRUMENTATION_.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "Stats.hpp"
+
+#ifdef _INSTRUMENTATION_
+namespace HyperDeceit::HyperV::Stats
+{
+	CpuStats_t* PerCpu;
+	uint32_t CpuCount;
+	void* Allocation;
+
+	/*
+	*	Allocates zeroed counters for every processor which can ever be added to the system.
+	*/
+	bool Initialize( )
+	{
+		if ( PerCpu )
+			return true;
+
+		uint32_t Count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+		uint64_t Size = uint64_t( Count ) * sizeof( CpuStats_t ) + alignof( CpuStats_t );
+
+		Allocation = ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Size );
+		if ( !Allocation )
+			return false;
+
+		memset( Allocation, 0, Size );
+
+		// Pool allocations are only 16 byte aligned.
+		CpuCount = Count;
+		PerCpu = (CpuStats_t*)((uint64_t( Allocation ) + alignof( CpuStats_t ) - 1) & ~uint64_t( alignof( CpuStats_t ) - 1 ));
+		return true;
+	}
+
+	/*
+	*	Frees the counters. Must be called below DISPATCH_LEVEL.
+	*/
+	void Destroy( )
+	{
+		void* Retired = Allocation;
+		if ( !Retired )
+			return;
+
+		PerCpu = 0;
+		CpuCount = 0;
+		Allocation = 0;
+
+		// The hook only uses the counters at DISPATCH_LEVEL or above, a DPC on every processor waits them out.
+		Utils::DispatchOnAllProcessors( []( void* ) { }, 0 );
+		ExFreePool( Retired );
+	}
+
+	/*
+	*	Sums the counters of a command over every processor. Nothing is locked, so counters
+	*	being updated while this runs may be off by the invocations still in flight.
+	*/
+	bool Query( _In_ ECommandId Id, _Out_ CommandStats_t* Out )
+	{
+		memset( Out, 0, sizeof( CommandStats_t ) );
+		if ( !PerCpu || Id >= ECommandId::Max )
+			return false;
+
+		for ( uint32_t Cpu = 0; Cpu < CpuCount; Cpu++ )
+		{
+			const volatile CommandStats_t* Stats = &PerCpu[ Cpu ].Commands[ uint32_t( Id ) ].Stats;
+
+			Out->Invocations += Stats->Invocations;
+			Out->Emulated += Stats->Emulated;
+			Out->Forwarded += Stats->Forwarded;
+
+			for ( uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++ )
+			{
+				Out->EmulationCycles[ i ] += Stats->EmulationCycles[ i ];
+				Out->CallbackCycles[ i ] += Stats->CallbackCycles[ i ];
+			}
+		}
+
+		return true;
+	}
+}
+#endif
@@ -0,0 +1,120 @@
+/*
+*		File name:
+*			Stats.hpp
+*
+*		Use:
+*			Per-processor hypercall statistics, compiled out without _INSTRUMENTATION_.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "HyperV.hpp"
+
+// Bucket i counts samples taking [2^i, 2^(i+1)) TSC ticks, the last bucket takes everything longer.
+#define STATS_HISTOGRAM_BUCKETS 32
+
+namespace HyperDeceit::HyperV::Stats
+{
+	struct CommandStats_t
+	{
+		uint64_t Invocations;
+		uint64_t Emulated;		// Handled by the emulator.
+		uint64_t Forwarded;		// Passed on to Hyper-V.
+		uint64_t EmulationCycles[ STATS_HISTOGRAM_BUCKETS ];
+		uint64_t CallbackCycles[ STATS_HISTOGRAM_BUCKETS ];	// All callbacks of one invocation together.
+	};
+
+	/*
+	*	A processor's counters for every command, each command starting on its own cache line
+	*	so no two processors or commands ever share one.
+	*/
+	struct alignas( 64 ) CpuStats_t
+	{
+		struct alignas( 64 )
+		{
+			CommandStats_t Stats;
+		} Commands[ uint32_t( ECommandId::Max ) ];
+	};
+
+#ifdef _INSTRUMENTATION_
+	constexpr bool Enabled = true;
+
+	extern CpuStats_t* PerCpu;
+	extern uint32_t CpuCount;
+
+	/*
+	*	Returns the bucket of a duration in TSC ticks.
+	*/
+	__forceinline uint32_t GetBucket( _In_ uint64_t Cycles )
+	{
+		unsigned long Index;
+		if ( !_BitScanReverse64( &Index, Cycles ) )
+			return 0;
+
+		return Index < STATS_HISTOGRAM_BUCKETS ? Index : STATS_HISTOGRAM_BUCKETS - 1;
+	}
+
+	/*
+	*	Gets the current processor's counters of a command, null if there are none.
+	*	The caller must stay at DISPATCH_LEVEL or above while using them.
+	*/
+	__forceinline CommandStats_t* GetCommandStats( _In_ ECommandId Id )
+	{
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		if ( !PerCpu || Cpu >= CpuCount || Id >= ECommandId::Max )
+			return 0;
+
+		return &PerCpu[ Cpu ].Commands[ uint32_t( Id ) ].Stats;
+	}
+
+	__forceinline uint64_t Timestamp( )
+	{
+		return __rdtsc( );
+	}
+
+	/*
+	*	Records a single invocation, EmulationCycles is only used when it was emulated.
+	*/
+	__forceinline void RecordInvocation( _In_ ECommandId Id, _In_ bool Emulated, _In_ uint64_t EmulationCycles )
+	{
+		CommandStats_t* Stats = GetCommandStats( Id );
+		if ( !Stats )
+			return;
+
+		Stats->Invocations++;
+		if ( Emulated )
+		{
+			Stats->Emulated++;
+			Stats->EmulationCycles[ GetBucket( EmulationCycles ) ]++;
+		}
+		else
+		{
+			Stats->Forwarded++;
+		}
+	}
+
+	__forceinline void RecordCallbacks( _In_ ECommandId Id, _In_ uint64_t Cycles )
+	{
+		CommandStats_t* Stats = GetCommandStats( Id );
+		if ( Stats )
+			Stats->CallbackCycles[ GetBucket( Cycles ) ]++;
+	}
+
+	bool Initialize( );
+	void Destroy( );
+	bool Query( _In_ ECommandId Id, _Out_ CommandStats_t* Out );
+#else
+	constexpr bool Enabled = false;
+
+	__forceinline uint64_t Timestamp( ) { return 0; }
+	__forceinline void RecordInvocation( _In_ ECommandId, _In_ bool, _In_ uint64_t ) { }
+	__forceinline void RecordCallbacks( _In_ ECommandId, _In_ uint64_t ) { }
+
+	inline bool Initialize( ) { return true; }
+	inline void Destroy( ) { }
+	inline bool Query( _In_ ECommandId, _Out_ CommandStats_t* ) { return false; }
+#endif
+}
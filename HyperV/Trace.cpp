@@ -0,0 +1,251 @@
+/*
+*		File name:
+*			Trace.cpp
+*
+*		Use:
+*			Records every intercepted hypercall into per-processor buffers, exported in the format
+*			described in Includes/HyperDeceitTrace.hpp.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "Trace.hpp"
+
+// RFLAGS.IF
+#define EFLAGS_IF_MASK 0x200
+
+namespace HyperDeceit::HyperV::Trace
+{
+	/*
+	*	One processor's records, only ever written by that processor.
+	*/
+	struct TraceBuffer_t
+	{
+		uint64_t LastTsc;		// 0 until the first sync record.
+		uint64_t Lost;
+		uint32_t Count;
+		uint32_t Capacity;
+		TraceRecord_t Records[ 1 ];
+	};
+
+	volatile bool Recording;
+
+	TraceBuffer_t** Buffers;
+	uint32_t BufferCount;
+	uint32_t BufferSize;
+
+	uint64_t StartTsc, EndTsc;
+	uint64_t StartQpc, EndQpc, QpcFrequency;
+
+	/*
+	*	Records a hypercall on the current processor, dropping it if the buffer is full.
+	*	Must be called at DISPATCH_LEVEL or above.
+	*/
+	void Record( _In_ ECommand Command, _In_ uint64_t Input, _In_ uint64_t Output, _In_ uint64_t CR3, _In_ uint64_t ReturnAddress )
+	{
+		// Checked again here, the caller may have sampled it before raising the IRQL and Stop only waits for
+		// processors which were already at DISPATCH_LEVEL.
+		uint32_t Cpu = KeGetCurrentProcessorIndex( );
+		if ( !Recording || !Buffers || Cpu >= BufferCount )
+			return;
+
+		TraceBuffer_t* Buffer = Buffers[ Cpu ];
+
+		// The hook can interrupt itself, with interrupts off the slots and the TSC delta can't be raced for.
+		uint64_t Flags = __readeflags( );
+		_disable( );
+
+		uint64_t Tsc = __rdtsc( );
+		uint64_t Delta = Tsc - Buffer->LastTsc;
+		bool Sync = !Buffer->LastTsc || Delta > 0xFFFFFFFF;
+
+		if ( Buffer->Count + (Sync ? 2 : 1) > Buffer->Capacity )
+		{
+			Buffer->Lost++;
+		}
+		else
+		{
+			TraceRecord_t* Record;
+			if ( Sync )
+			{
+				Record = &Buffer->Records[ Buffer->Count++ ];
+				memset( Record, 0, sizeof( TraceRecord_t ) );
+				Record->Command = TRACE_COMMAND_SYNC;
+				Record->Input = Tsc;
+				Delta = 0;
+			}
+
+			Record = &Buffer->Records[ Buffer->Count++ ];
+			Record->TscDelta = uint32_t( Delta );
+			Record->Command = uint32_t( Command );
+			Record->Input = Input;
+			Record->Output = Output;
+			Record->CR3 = CR3;
+			Record->ReturnAddress = ReturnAddress;
+			Buffer->LastTsc = Tsc;
+		}
+
+		if ( Flags & EFLAGS_IF_MASK )
+			_enable( );
+	}
+
+	/*
+	*	Frees every buffer, the recorder must be stopped.
+	*/
+	static void FreeBuffers( )
+	{
+		if ( !Buffers )
+			return;
+
+		for ( uint32_t i = 0; i < BufferCount; i++ )
+		{
+			if ( Buffers[ i ] )
+				ExFreePool( Buffers[ i ] );
+		}
+
+		ExFreePool( Buffers );
+		Buffers = 0;
+		BufferCount = 0;
+		BufferSize = 0;
+	}
+
+	/*
+	*	Starts a new recording, throwing away the previous one. Buffers are reused if the size didn't change.
+	*	Must be called at PASSIVE_LEVEL.
+	*/
+	bool Start( _In_ uint32_t BytesPerCpu )
+	{
+		if ( Recording || BytesPerCpu < TRACE_MIN_BUFFER_SIZE || BytesPerCpu > TRACE_MAX_BUFFER_SIZE )
+			return false;
+
+		if ( Buffers && BufferSize != BytesPerCpu )
+			FreeBuffers( );
+
+		if ( !Buffers )
+		{
+			uint32_t Count = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+			TraceBuffer_t** Allocated = (TraceBuffer_t**)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Count * sizeof( TraceBuffer_t* ) );
+			if ( !Allocated )
+				return false;
+
+			for ( uint32_t i = 0; i < Count; i++ )
+			{
+				Allocated[ i ] = (TraceBuffer_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, BytesPerCpu );
+				if ( !Allocated[ i ] )
+				{
+					while ( i-- )
+						ExFreePool( Allocated[ i ] );
+
+					ExFreePool( Allocated );
+					return false;
+				}
+			}
+
+			// Only published once every buffer exists.
+			Buffers = Allocated;
+			BufferCount = Count;
+			BufferSize = BytesPerCpu;
+		}
+
+		for ( uint32_t i = 0; i < BufferCount; i++ )
+		{
+			TraceBuffer_t* Buffer = Buffers[ i ];
+			Buffer->LastTsc = 0;
+			Buffer->Lost = 0;
+			Buffer->Count = 0;
+			Buffer->Capacity = uint32_t( (BufferSize - FIELD_OFFSET( TraceBuffer_t, Records )) / sizeof( TraceRecord_t ) );
+		}
+
+		// Both clocks are sampled at the start and the end, to work out the TSC frequency.
+		LARGE_INTEGER Frequency;
+		StartQpc = KeQueryPerformanceCounter( &Frequency ).QuadPart;
+		StartTsc = __rdtsc( );
+		QpcFrequency = Frequency.QuadPart;
+
+		// Last, Record does nothing until every buffer is reset.
+		Recording = true;
+		return true;
+	}
+
+	/*
+	*	Stops recording, once this returns no processor is writing into the buffers anymore.
+	*	Must be called at PASSIVE_LEVEL.
+	*/
+	void Stop( )
+	{
+		if ( !Recording )
+			return;
+
+		Recording = false;
+
+		// Records are only written at DISPATCH_LEVEL or above, a DPC on every processor waits them out.
+		Utils::DispatchOnAllProcessors( []( void* ) { }, 0 );
+
+		EndQpc = KeQueryPerformanceCounter( 0 ).QuadPart;
+		EndTsc = __rdtsc( );
+	}
+
+	/*
+	*	Writes the last recording to a buffer, the recorder must be stopped.
+	*	If the buffer is null, only the required size is returned.
+	*/
+	bool Export( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written )
+	{
+		*Written = 0;
+		if ( Recording || !Buffers )
+			return false;
+
+		uint64_t Required = sizeof( TraceFileHeader_t );
+		for ( uint32_t i = 0; i < BufferCount; i++ )
+			Required += sizeof( TraceStreamHeader_t ) + uint64_t( Buffers[ i ]->Count ) * sizeof( TraceRecord_t );
+
+		if ( Required > 0xFFFFFFFF )
+			return false;
+
+		*Written = uint32_t( Required );
+		if ( !Buffer )
+			return true;
+
+		if ( Size < Required )
+			return false;
+
+		// Split up so the multiplication can't overflow for any sane recording length.
+		uint64_t Ticks = EndTsc - StartTsc;
+		uint64_t Elapsed = EndQpc - StartQpc;
+
+		TraceFileHeader_t* Header = (TraceFileHeader_t*)Buffer;
+		memset( Header, 0, sizeof( TraceFileHeader_t ) );
+		Header->Magic = TRACE_FILE_MAGIC;
+		Header->Version = TRACE_FILE_VERSION;
+		Header->RecordSize = sizeof( TraceRecord_t );
+		Header->CpuCount = BufferCount;
+		Header->TscFrequency = Elapsed ? (Ticks / Elapsed) * QpcFrequency + ((Ticks % Elapsed) * QpcFrequency) / Elapsed : 0;
+		Header->StartTsc = StartTsc;
+		Header->EndTsc = EndTsc;
+
+		uint8_t* Out = (uint8_t*)(Header + 1);
+		for ( uint32_t i = 0; i < BufferCount; i++ )
+		{
+			TraceStreamHeader_t* Stream = (TraceStreamHeader_t*)Out;
+			Stream->Cpu = i;
+			Stream->RecordCount = Buffers[ i ]->Count;
+			Stream->Lost = Buffers[ i ]->Lost;
+			Out += sizeof( TraceStreamHeader_t );
+
+			memcpy( Out, Buffers[ i ]->Records, Buffers[ i ]->Count * sizeof( TraceRecord_t ) );
+			Out += Buffers[ i ]->Count * sizeof( TraceRecord_t );
+		}
+
+		return true;
+	}
+
+	/*
+	*	Stops recording and frees the buffers.
+	*/
+	void Destroy( )
+	{
+		Stop( );
+		FreeBuffers( );
+	}
+}
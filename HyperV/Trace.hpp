@@ -0,0 +1,40 @@
+/*
+*		File name:
+*			Trace.hpp
+*
+*		Use:
+*			Records every intercepted hypercall into per-processor buffers, exported in the format
+*			described in Includes/HyperDeceitTrace.hpp.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "..\Includes\HyperDeceitTrace.hpp"
+#include "HyperV.hpp"
+
+// Smallest and largest buffer a single processor can record into.
+#define TRACE_MIN_BUFFER_SIZE 0x1000
+#define TRACE_MAX_BUFFER_SIZE 0x4000000
+
+namespace HyperDeceit::HyperV::Trace
+{
+	extern volatile bool Recording;
+
+	/*
+	*	Is the recorder running? Only a hint for the hook, Record checks it again at DISPATCH_LEVEL.
+	*/
+	__forceinline bool IsRecording( )
+	{
+		return Recording;
+	}
+
+	void Record( _In_ ECommand Command, _In_ uint64_t Input, _In_ uint64_t Output, _In_ uint64_t CR3, _In_ uint64_t ReturnAddress );
+
+	bool Start( _In_ uint32_t BytesPerCpu );
+	void Stop( );
+	bool Export( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written );
+	void Destroy( );
+}
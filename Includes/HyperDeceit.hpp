@@ -19,6 +19,14 @@ typedef unsigned char uint8_t;
 #define _In_
 #endif
 
+#ifndef _Out_
+#define _Out_
+#endif
+
+#ifndef _Out_opt_
+#define _Out_opt_
+#endif
+
 namespace HyperDeceit
 {
 	namespace HyperV
@@ -27,6 +35,9 @@ namespace HyperDeceit
 		{
 			SlowFlushAddressSpace = 2,
 			FastFlushAddressSpace = 0x10002,
+			FlushAddressList = 3,
+			FlushAddressSpaceEx = 0x13,
+			FlushAddressListEx = 0x14,
 
 			EnterSleepState = 0x84,
 			DebugDeviceAvailable = 0x87,
@@ -38,15 +49,60 @@ namespace HyperDeceit
 
 		namespace Emulator
 		{
+			// Processors targeted by a flush, bit N of bank B is processor B * 64 + N.
+			struct ProcessorSet_t
+			{
+				bool All;
+				uint64_t Banks[ 64 ];
+			};
+
+			// What inline callbacks of the list flushes get as Input, Entries are only valid during the callback.
+			struct FlushInput_t
+			{
+				uint64_t AddressSpace;
+				uint64_t Flags;
+				ProcessorSet_t Processors;
+				const uint64_t* Entries;	// Page number in bits 12-63, additional pages after it in bits 0-11.
+				uint32_t EntryCount;
+				uint32_t PageCount;
+			};
+
+			void SetFlushListThreshold( _In_ uint32_t Pages );
+			bool SetFlushCoalescing( _In_ bool Enable, _In_ uint32_t WindowUs = 0 );
+
 			void FlushTB();
+			void FlushTB( _In_ uint64_t Flags );
 			void FlushTBAllCores();
+			void FlushTBProcessors( _In_ uint64_t ProcessorMask, _In_ uint64_t Flags );
+			void FlushProcessors( _In_ const FlushInput_t* Flush );
+			void FlushAddressSpace( _In_ uint64_t InputPa );
 			void SwitchAddressSpace( _In_ uint64_t NewCR3 );
 			void NotifySpinWait();
 
-			void EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input );
+			uint64_t EmulateOriginalHyperCall( _In_ ECommand Cmd, _In_ uint64_t Input, _In_ uint64_t Output = 0 );
+		}
+
+		namespace Stats
+		{
+			// Bucket i counts samples taking [2^i, 2^(i+1)) TSC ticks, the last bucket takes everything longer.
+			struct CommandStats_t
+			{
+				uint64_t Invocations;
+				uint64_t Emulated;
+				uint64_t Forwarded;
+				uint64_t EmulationCycles[ 32 ];
+				uint64_t CallbackCycles[ 32 ];
+			};
 		}
 	}
 
+	enum class ECallbackDelivery
+	{
+		Inline,		// Invoked by the hook itself, at DISPATCH_LEVEL or above.
+		Deferred	// Queued by the hook and invoked shortly after by a worker thread at PASSIVE_LEVEL.
+					// Memory based hypercalls get a pointer to a copy of the first 32 bytes of their input block as Input.
+	};
+
 	enum class EHvDStatus
 	{
 		Unknown,
@@ -59,12 +115,27 @@ namespace HyperDeceit
 		FailedToFindCallbacks,
 		IncompatibleWindowsVersion,
 		UnsupportedEnlightenment,
+		CallbackNotFound,
+		InsufficientResources,
+		InstrumentationDisabled,
 		Success
 	};
 
 	EHvDStatus HvDInitialize( _In_ uint64_t KernelBase );
-	EHvDStatus HvDInsertCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3) );
+	EHvDStatus HvDInsertCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3), _In_ ECallbackDelivery Delivery = ECallbackDelivery::Inline );
+	EHvDStatus HvDRemoveCallback( _In_ HyperV::ECommand Cmd, _In_ void(*Callback)(uint64_t Input, uint64_t Output, uint64_t OldCR3) );
 	EHvDStatus HvDStop();
 
+	EHvDStatus HvDImportSignatureCache( _In_ const void* Buffer, _In_ uint32_t Size );
+	EHvDStatus HvDExportSignatureCache( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written );
+
+	// Traces are exported in the format described in HyperDeceitTrace.hpp.
+	EHvDStatus HvDStartTrace( _In_ uint32_t BytesPerCpu );
+	EHvDStatus HvDStopTrace();
+	EHvDStatus HvDExportTrace( _Out_opt_ void* Buffer, _In_ uint32_t Size, _Out_ uint32_t* Written );
+
+	// Only available when HyperDeceit is built with _INSTRUMENTATION_.
+	EHvDStatus HvDGetStats( _In_ HyperV::ECommand Cmd, _Out_ HyperV::Stats::CommandStats_t* Stats );
+
 	const char* HvDGetStatusString( EHvDStatus Status );
 }
@@ -0,0 +1,68 @@
+/*
+*		File name:
+*			HyperDeceitTrace.hpp
+*
+*		Use:
+*			Binary format of the hypercall traces exported by HvDExportTrace, shared by the driver
+*			and any host side tooling. Include it after uint8_t ... uint64_t are defined.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+
+/*
+*	Layout, everything little endian and tightly packed:
+*
+*		TraceFileHeader_t
+*		CpuCount times:
+*			TraceStreamHeader_t
+*			RecordCount times TraceRecord_t, in the order they were recorded on that processor.
+*
+*	Each record stores the TSC as a delta to the previous record of the same stream. The first record of a
+*	stream, and any record whose delta would not fit, is preceded by a sync record (Command == TRACE_COMMAND_SYNC)
+*	carrying the absolute TSC in Input, with a delta of 0. Streams are merged by their absolute TSC, which
+*	assumes an invariant TSC synchronized across processors, as on anything Windows 10+ supports.
+*
+*	Command is the low half of the hypercall control value, the call code (HyperDeceit::HyperV::ECommand for the ones
+*	HyperDeceit knows about) with the fast bit and variable header size. The rep fields don't fit.
+*	CR3 is the CR3 at the time of the hypercall, so it identifies the process which was running.
+*/
+#define TRACE_FILE_MAGIC 0x48445254	// "TRDH" as the first bytes of the file.
+#define TRACE_FILE_VERSION 1
+
+#define TRACE_COMMAND_SYNC 0xFFFFFFFF
+
+#pragma pack( push, 1 )
+struct TraceFileHeader_t
+{
+	uint32_t Magic;
+	uint16_t Version;
+	uint16_t RecordSize;		// sizeof( TraceRecord_t ), newer versions may only grow it.
+	uint32_t CpuCount;
+	uint32_t Reserved;
+	uint64_t TscFrequency;		// Ticks per second, measured over the recording.
+	uint64_t StartTsc;
+	uint64_t EndTsc;
+};
+
+struct TraceStreamHeader_t
+{
+	uint32_t Cpu;				// Processor index.
+	uint32_t RecordCount;		// Sync records included.
+	uint64_t Lost;				// Hypercalls not recorded because the buffer was full.
+};
+
+struct TraceRecord_t
+{
+	uint32_t TscDelta;
+	uint32_t Command;
+	uint64_t Input;
+	uint64_t Output;
+	uint64_t CR3;
+	uint64_t ReturnAddress;		// Where in the kernel the hypercall was made from.
+};
+#pragma pack( pop )
+
+static_assert( sizeof( TraceRecord_t ) == 40, "TraceRecord_t layout changed, bump TRACE_FILE_VERSION" );
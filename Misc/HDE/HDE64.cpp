@@ -10,27 +10,180 @@
 #include "HDE64.hpp"
 #include "Table64.hpp"
 
-unsigned int hde64_disasm( const void* code, hde64s* hs )
+/*
+ * Decodes the 0F 38 and 0F 3A maps and VEX/EVEX encodings, which the
+ * tables do not cover. p points at the escape byte, right after the
+ * legacy prefixes and REX. Every instruction in these maps has a ModR/M
+ * byte, except vzeroupper/vzeroall, and the immediate is at most a byte.
+ */
+static unsigned int hde64_disasm_extended( const void* code, uint8_t* p, uint8_t pref, hde64s* hs )
+{
+	uint8_t c = *p++, map, opcode, m_mod, m_rm, disp_size = 0, imm8 = 0, modrm = 1;
+
+	hs->opcode = c;
+
+	if ( c == 0x0f )
+	{
+		hs->opcode2 = *p++;
+		map = hs->opcode2 == 0x38 ? 2 : 3;
+		hs->opcode3 = opcode = *p++;
+	}
+	else
+	{
+		/* 66, F2, F3, LOCK and REX are encoded inside the VEX/EVEX prefix */
+		if ( ( hs->flags & F_PREFIX_REX ) || ( pref & ( PRE_F2 | PRE_F3 | PRE_66 | PRE_LOCK ) ) )
+			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+
+		if ( c == 0xc5 )
+		{
+			hs->flags |= F_VEX;
+			hs->rex_r = !( *p++ & 0x80 );
+			map = 1;
+		}
+		else if ( c == 0xc4 )
+		{
+			hs->flags |= F_VEX;
+			hs->rex_r = !( p[ 0 ] & 0x80 );
+			hs->rex_x = !( p[ 0 ] & 0x40 );
+			hs->rex_b = !( p[ 0 ] & 0x20 );
+			hs->rex_w = p[ 1 ] >> 7;
+			map = p[ 0 ] & 0x1f;
+			p += 2;
+
+			if ( !map || map > 3 )
+				hs->flags |= F_ERROR | F_ERROR_OPCODE;
+		}
+		else
+		{
+			hs->flags |= F_EVEX;
+			hs->rex_r = !( p[ 0 ] & 0x80 );
+			hs->rex_x = !( p[ 0 ] & 0x40 );
+			hs->rex_b = !( p[ 0 ] & 0x20 );
+			hs->rex_w = p[ 1 ] >> 7;
+			map = p[ 0 ] & 7;
+
+			/* P1 bit 2 is always set, maps 5 and 6 hold the FP16 instructions */
+			if ( !( p[ 1 ] & 4 ) || !map || map == 4 || map == 7 )
+				hs->flags |= F_ERROR | F_ERROR_OPCODE;
+
+			p += 3;
+		}
+
+		hs->vex_map = map;
+		hs->opcode2 = opcode = *p++;
+
+		if ( map == 1 && opcode == 0x77 && !( hs->flags & F_EVEX ) )
+			modrm = 0;
+	}
+
+	if ( map == 3 )
+		imm8 = 1;
+	else if ( map == 1 )
+	{
+		switch ( opcode )
+		{
+			case 0x70:
+			case 0x71:
+			case 0x72:
+			case 0x73:
+			case 0xc2:
+			case 0xc4:
+			case 0xc5:
+			case 0xc6:
+				imm8 = 1;
+		}
+	}
+
+	if ( modrm )
+	{
+		hs->flags |= F_MODRM;
+		hs->modrm = c = *p++;
+		hs->modrm_mod = m_mod = c >> 6;
+		hs->modrm_rm = m_rm = c & 7;
+		hs->modrm_reg = ( c & 0x3f ) >> 3;
+
+		/* 67 selects 32 bit addressing in long mode, the encoding stays the same */
+		if ( m_mod == 1 )
+			disp_size = 1;
+		else if ( m_mod == 2 || ( m_mod == 0 && m_rm == 5 ) )
+			disp_size = 4;
+
+		if ( m_mod != 3 && m_rm == 4 )
+		{
+			hs->flags |= F_SIB;
+			hs->sib = c = *p++;
+			hs->sib_scale = c >> 6;
+			hs->sib_index = ( c & 0x3f ) >> 3;
+			if ( ( hs->sib_base = c & 7 ) == 5 && m_mod == 0 )
+				disp_size = 4;
+		}
+
+		if ( disp_size == 1 )
+		{
+			hs->flags |= F_DISP8;
+			hs->disp.disp8 = *p;
+		}
+		else if ( disp_size == 4 )
+		{
+			hs->flags |= F_DISP32;
+			hs->disp.disp32 = *(uint32_t*)p;
+		}
+		p += disp_size;
+	}
+
+	if ( imm8 )
+	{
+		hs->flags |= F_IMM8;
+		hs->imm.imm8 = *p++;
+	}
+
+	if ( ( hs->len = (uint8_t)( p - (uint8_t*)code ) ) > 15 )
+	{
+		hs->flags |= F_ERROR | F_ERROR_LENGTH;
+		hs->len = 15;
+	}
+
+	return (unsigned int)hs->len;
+}
+
+/*
+ * Shared by hde64_disasm and hde64_length. With Full everything is
+ * extracted into hs and errors are only flagged. Without it hs is never
+ * touched, nothing is stored and the first error returns 0.
+ */
+#define HDE_STORE( ... ) if constexpr ( Full ) { __VA_ARGS__; }
+#define HDE_ERROR( flag )					\
+	{										\
+		if constexpr ( !Full )				\
+			return 0;						\
+		else								\
+			hs->flags |= F_ERROR | ( flag );	\
+	}
+
+template <bool Full>
+static __forceinline unsigned int hde64_decode( const void* code, hde64s* hs )
 {
 	uint8_t x, c = 0, *p = (uint8_t*)code, cflags, opcode, pref = 0;
-	uint8_t *ht = hde64_table, m_mod, m_reg, m_rm, disp_size = 0;
-	uint8_t op64 = 0;
+	const uint8_t* ht;
+	const hde64_opcode *map = hde64_opcodes.one, *entry = map;
+	uint8_t m_mod, m_reg, m_rm, disp_size = 0;
+	uint8_t op64 = 0, opcode2 = 0;
 
-	__stosb( (PUCHAR)hs, 0, sizeof( hde64s ) );
+	HDE_STORE( memset( hs, 0, sizeof( hde64s ) ) );
 
 	for ( x = 16; x; x-- )
 		switch ( c = *p++ )
 		{
 			case 0xf3:
-				hs->p_rep = c;
+				HDE_STORE( hs->p_rep = c );
 				pref |= PRE_F3;
 				break;
 			case 0xf2:
-				hs->p_rep = c;
+				HDE_STORE( hs->p_rep = c );
 				pref |= PRE_F2;
 				break;
 			case 0xf0:
-				hs->p_lock = c;
+				HDE_STORE( hs->p_lock = c );
 				pref |= PRE_LOCK;
 				break;
 			case 0x26:
@@ -39,15 +192,15 @@ unsigned int hde64_disasm( const void* code, hde64s* hs )
 			case 0x3e:
 			case 0x64:
 			case 0x65:
-				hs->p_seg = c;
+				HDE_STORE( hs->p_seg = c );
 				pref |= PRE_SEG;
 				break;
 			case 0x66:
-				hs->p_66 = c;
+				HDE_STORE( hs->p_66 = c );
 				pref |= PRE_66;
 				break;
 			case 0x67:
-				hs->p_67 = c;
+				HDE_STORE( hs->p_67 = c );
 				pref |= PRE_67;
 				break;
 			default:
@@ -55,32 +208,49 @@ unsigned int hde64_disasm( const void* code, hde64s* hs )
 		}
 pref_done:
 
-	hs->flags = (uint32_t)pref << 23;
+	HDE_STORE( hs->flags = (uint32_t)pref << 23 );
 
 	if ( !pref )
 		pref |= PRE_NONE;
 
 	if ( ( c & 0xf0 ) == 0x40 )
 	{
-		hs->flags |= F_PREFIX_REX;
-		hs->rex_w = ( c & 0xf ) >> 3;
-		if ( hs->rex_w && ( *p & 0xf8 ) == 0xb8 )
+		HDE_STORE(
+			hs->flags |= F_PREFIX_REX;
+			hs->rex_w = ( c & 0xf ) >> 3;
+			hs->rex_r = ( c & 7 ) >> 2;
+			hs->rex_x = ( c & 3 ) >> 1;
+			hs->rex_b = c & 1 );
+
+		if ( ( c & 8 ) && ( *p & 0xf8 ) == 0xb8 )
 			op64++;
 
-		hs->rex_r = ( c & 7 ) >> 2;
-		hs->rex_x = ( c & 3 ) >> 1;
-		hs->rex_b = c & 1;
 		if ( ( ( c = *p++ ) & 0xf0 ) == 0x40 )
 		{
 			opcode = c;
+			HDE_ERROR( F_ERROR_OPCODE );
 			goto error_opcode;
 		}
 	}
 
-	if ( ( hs->opcode = c ) == 0x0f )
+	if ( c == 0xc4 || c == 0xc5 || c == 0x62 || ( c == 0x0f && ( *p == 0x38 || *p == 0x3a ) ) )
 	{
-		hs->opcode2 = c = *p++;
-		ht += DELTA_OPCODES;
+		if constexpr ( Full )
+			return hde64_disasm_extended( code, p - 1, pref, hs );
+		else
+		{
+			/* rare enough to simply take the full decoder */
+			hde64s full;
+			return hde64_decode<true>( code, &full ) && !( full.flags & F_ERROR ) ? full.len : 0;
+		}
+	}
+
+	HDE_STORE( hs->opcode = c );
+	if ( c == 0x0f )
+	{
+		opcode2 = c = *p++;
+		HDE_STORE( hs->opcode2 = c );
+		map = hde64_opcodes.two;
 	}
 	else if ( c >= 0xa0 && c <= 0xa3 )
 	{
@@ -92,45 +262,40 @@ pref_done:
 	}
 
 	opcode = c;
-	cflags = ht[ ht[ opcode / 4 ] + ( opcode % 4 ) ];
+	entry = &map[ opcode ];
+	cflags = entry->cflags;
+	x = entry->group;
 
 	if ( cflags == C_ERROR )
 	{
+		HDE_ERROR( F_ERROR_OPCODE );
 	error_opcode:
-		hs->flags |= F_ERROR | F_ERROR_OPCODE;
 		cflags = 0;
+		x = 0;
 		if ( ( opcode & -3 ) == 0x24 )
 			cflags++;
 	}
 
-	x = 0;
-	if ( cflags & C_GROUP )
-	{
-		uint16_t t;
-		t = *(uint16_t*)( ht + ( cflags & 0x7f ) );
-		cflags = (uint8_t)t;
-		x = (uint8_t)( t >> 8 );
-	}
-
-	if ( hs->opcode2 )
-	{
-		ht = hde64_table + DELTA_PREFIXES;
-		if ( ht[ ht[ opcode / 4 ] + ( opcode % 4 ) ] & pref )
-			hs->flags |= F_ERROR | F_ERROR_OPCODE;
-	}
+	if ( opcode2 && ( entry->prefix_error & pref ) )
+		HDE_ERROR( F_ERROR_OPCODE );
 
 	if ( cflags & C_MODRM )
 	{
-		hs->flags |= F_MODRM;
-		hs->modrm = c = *p++;
-		hs->modrm_mod = m_mod = c >> 6;
-		hs->modrm_rm = m_rm = c & 7;
-		hs->modrm_reg = m_reg = ( c & 0x3f ) >> 3;
+		c = *p++;
+		m_mod = c >> 6;
+		m_rm = c & 7;
+		m_reg = ( c & 0x3f ) >> 3;
+		HDE_STORE(
+			hs->flags |= F_MODRM;
+			hs->modrm = c;
+			hs->modrm_mod = m_mod;
+			hs->modrm_rm = m_rm;
+			hs->modrm_reg = m_reg );
 
 		if ( x && ( ( x << m_reg ) & 0x80 ) )
-			hs->flags |= F_ERROR | F_ERROR_OPCODE;
+			HDE_ERROR( F_ERROR_OPCODE );
 
-		if ( !hs->opcode2 && opcode >= 0xd9 && opcode <= 0xdf )
+		if ( !opcode2 && opcode >= 0xd9 && opcode <= 0xdf )
 		{
 			uint8_t t = opcode - 0xd9;
 			if ( m_mod == 3 )
@@ -144,19 +309,20 @@ pref_done:
 				t = ht[ t ] << m_reg;
 			}
 			if ( t & 0x80 )
-				hs->flags |= F_ERROR | F_ERROR_OPCODE;
+				HDE_ERROR( F_ERROR_OPCODE );
 		}
 
 		if ( pref & PRE_LOCK )
 		{
 			if ( m_mod == 3 )
 			{
-				hs->flags |= F_ERROR | F_ERROR_LOCK;
+				HDE_ERROR( F_ERROR_LOCK );
 			}
 			else
 			{
-				uint8_t *table_end, op = opcode;
-				if ( hs->opcode2 )
+				const uint8_t* table_end;
+				uint8_t op = opcode;
+				if ( opcode2 )
 				{
 					ht = hde64_table + DELTA_OP2_LOCK_OK;
 					table_end = ht + DELTA_OP_ONLY_MEM - DELTA_OP2_LOCK_OK;
@@ -175,12 +341,12 @@ pref_done:
 						else
 							break;
 					}
-				hs->flags |= F_ERROR | F_ERROR_LOCK;
+				HDE_ERROR( F_ERROR_LOCK );
 			no_lock_error:;
 			}
 		}
 
-		if ( hs->opcode2 )
+		if ( opcode2 )
 		{
 			switch ( opcode )
 			{
@@ -217,10 +383,11 @@ pref_done:
 			}
 		}
 
-		if ( m_mod == 3 )
+		/* 0F 01 with mod 3 holds swapgs, rdtscp, vmcall, stac/clac, xgetbv and friends */
+		if ( m_mod == 3 && !( opcode2 && opcode == 0x01 ) )
 		{
-			uint8_t* table_end;
-			if ( hs->opcode2 )
+			const uint8_t* table_end;
+			if ( opcode2 )
 			{
 				ht = hde64_table + DELTA_OP2_ONLY_MEM;
 				table_end = ht + sizeof( hde64_table ) - DELTA_OP2_ONLY_MEM;
@@ -240,7 +407,7 @@ pref_done:
 				}
 			goto no_error_operand;
 		}
-		else if ( hs->opcode2 )
+		else if ( opcode2 )
 		{
 			switch ( opcode )
 			{
@@ -263,11 +430,10 @@ pref_done:
 			goto no_error_operand;
 
 	error_operand:
-		hs->flags |= F_ERROR | F_ERROR_OPERAND;
+		HDE_ERROR( F_ERROR_OPERAND );
 	no_error_operand:
 
-		c = *p++;
-		if ( m_reg <= 1 )
+		if ( m_reg <= 1 && !opcode2 )
 		{
 			if ( opcode == 0xf6 )
 				cflags |= C_IMM8;
@@ -298,35 +464,34 @@ pref_done:
 
 		if ( m_mod != 3 && m_rm == 4 )
 		{
-			hs->flags |= F_SIB;
-			p++;
-			hs->sib = c;
-			hs->sib_scale = c >> 6;
-			hs->sib_index = ( c & 0x3f ) >> 3;
-			if ( ( hs->sib_base = c & 7 ) == 5 && !( m_mod & 1 ) )
+			c = *p++;
+			HDE_STORE(
+				hs->flags |= F_SIB;
+				hs->sib = c;
+				hs->sib_scale = c >> 6;
+				hs->sib_index = ( c & 0x3f ) >> 3;
+				hs->sib_base = c & 7 );
+
+			if ( ( c & 7 ) == 5 && !( m_mod & 1 ) )
 				disp_size = 4;
 		}
 
-		p--;
 		switch ( disp_size )
 		{
 			case 1:
-				hs->flags |= F_DISP8;
-				hs->disp.disp8 = *p;
+				HDE_STORE( hs->flags |= F_DISP8; hs->disp.disp8 = *p );
 				break;
 			case 2:
-				hs->flags |= F_DISP16;
-				hs->disp.disp16 = *(uint16_t*)p;
+				HDE_STORE( hs->flags |= F_DISP16; hs->disp.disp16 = *(uint16_t*)p );
 				break;
 			case 4:
-				hs->flags |= F_DISP32;
-				hs->disp.disp32 = *(uint32_t*)p;
+				HDE_STORE( hs->flags |= F_DISP32; hs->disp.disp32 = *(uint32_t*)p );
 				break;
 		}
 		p += disp_size;
 	}
 	else if ( pref & PRE_LOCK )
-		hs->flags |= F_ERROR | F_ERROR_LOCK;
+		HDE_ERROR( F_ERROR_LOCK );
 
 	if ( cflags & C_IMM_P66 )
 	{
@@ -334,8 +499,7 @@ pref_done:
 		{
 			if ( pref & PRE_66 )
 			{
-				hs->flags |= F_IMM16 | F_RELATIVE;
-				hs->imm.imm16 = *(uint16_t*)p;
+				HDE_STORE( hs->flags |= F_IMM16 | F_RELATIVE; hs->imm.imm16 = *(uint16_t*)p );
 				p += 2;
 				goto disasm_done;
 			}
@@ -343,56 +507,122 @@ pref_done:
 		}
 		if ( op64 )
 		{
-			hs->flags |= F_IMM64;
-			hs->imm.imm64 = *(uint64_t*)p;
+			HDE_STORE( hs->flags |= F_IMM64; hs->imm.imm64 = *(uint64_t*)p );
 			p += 8;
 		}
 		else if ( !( pref & PRE_66 ) )
 		{
-			hs->flags |= F_IMM32;
-			hs->imm.imm32 = *(uint32_t*)p;
+			HDE_STORE( hs->flags |= F_IMM32; hs->imm.imm32 = *(uint32_t*)p );
 			p += 4;
 		}
 		else
 			goto imm16_ok;
 	}
 
-
 	if ( cflags & C_IMM16 )
 	{
 	imm16_ok:
-		hs->flags |= F_IMM16;
-		hs->imm.imm16 = *(uint16_t*)p;
+		HDE_STORE( hs->flags |= F_IMM16; hs->imm.imm16 = *(uint16_t*)p );
 		p += 2;
 	}
 	if ( cflags & C_IMM8 )
 	{
-		hs->flags |= F_IMM8;
-		hs->imm.imm8 = *p++;
+		HDE_STORE( hs->flags |= F_IMM8; hs->imm.imm8 = *p );
+		p++;
 	}
 
 	if ( cflags & C_REL32 )
 	{
 	rel32_ok:
-		hs->flags |= F_IMM32 | F_RELATIVE;
-		hs->imm.imm32 = *(uint32_t*)p;
+		HDE_STORE( hs->flags |= F_IMM32 | F_RELATIVE; hs->imm.imm32 = *(uint32_t*)p );
 		p += 4;
 	}
 	else if ( cflags & C_REL8 )
 	{
-		hs->flags |= F_IMM8 | F_RELATIVE;
-		hs->imm.imm8 = *p++;
+		HDE_STORE( hs->flags |= F_IMM8 | F_RELATIVE; hs->imm.imm8 = *p );
+		p++;
 	}
 
 disasm_done:
 
-	if ( ( hs->len = (uint8_t)( p - (uint8_t*)code ) ) > 15 )
+	if ( p - (uint8_t*)code > 15 )
 	{
-		hs->flags |= F_ERROR | F_ERROR_LENGTH;
-		hs->len = 15;
+		HDE_ERROR( F_ERROR_LENGTH );
+		HDE_STORE( hs->len = 15; return 15 );
 	}
 
-	return (unsigned int)hs->len;
+	HDE_STORE( hs->len = (uint8_t)( p - (uint8_t*)code ) );
+	return (unsigned int)( p - (uint8_t*)code );
+}
+
+#undef HDE_STORE
+#undef HDE_ERROR
+
+unsigned int hde64_disasm( const void* code, hde64s* hs )
+{
+	return hde64_decode<true>( code, hs );
+}
+
+/*
+ * Length only variant of hde64_disasm, same tables and same validation
+ * but nothing is extracted or stored. Returns 0 if hde64_disasm would
+ * flag the instruction with F_ERROR.
+ */
+unsigned int hde64_length( const void* code )
+{
+	return hde64_decode<false>( code, 0 );
+}
+
+/*
+ * Decodes a whole range in one pass into the arrays of batch. Stops at
+ * the end of the range, when the arrays are full, or on the first
+ * invalid instruction, whose flags are then left in batch->flags.
+ */
+unsigned int hde64_decode_range( const void* code, unsigned int size, hde64_batch* batch )
+{
+	uint8_t* p = (uint8_t*)code;
+	uint32_t count = 0, rip_count = 0, offset = 0;
+	hde64s hs;
+
+	batch->flags = 0;
+
+	while ( offset < size && count < batch->capacity )
+	{
+		hde64_disasm( p + offset, &hs );
+
+		if ( hs.flags & F_ERROR )
+		{
+			batch->flags = hs.flags;
+			break;
+		}
+
+		if ( offset + hs.len > size )
+			break;
+
+		batch->offset[ count ] = offset;
+		batch->len[ count ] = hs.len;
+		batch->opcode[ count ] = hs.opcode;
+		batch->opcode2[ count ] = hs.opcode2;
+		batch->opcode3[ count ] = hs.opcode3;
+		batch->vex_map[ count ] = hs.vex_map;
+		batch->modrm_reg[ count ] = hs.modrm_reg;
+
+		/* mod 00 r/m 101 is RIP relative in long mode */
+		if ( ( hs.flags & F_DISP32 ) && hs.modrm_mod == 0 && hs.modrm_rm == 5 )
+		{
+			batch->rip[ rip_count ] = count;
+			batch->rip_disp[ rip_count ] = (int32_t)hs.disp.disp32;
+			rip_count++;
+		}
+
+		offset += hs.len;
+		count++;
+	}
+
+	batch->count = count;
+	batch->rip_count = rip_count;
+	batch->size = offset;
+	return count;
 }
 
 #endif // defined(_M_X64) || defined(__x86_64__)
\ No newline at end of file
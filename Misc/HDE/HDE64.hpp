@@ -36,6 +36,8 @@
 #define F_ERROR_LENGTH 0x00004000
 #define F_ERROR_LOCK 0x00008000
 #define F_ERROR_OPERAND 0x00010000
+#define F_VEX 0x00020000
+#define F_EVEX 0x00040000
 #define F_PREFIX_REPNZ 0x01000000
 #define F_PREFIX_REPX 0x02000000
 #define F_PREFIX_REP 0x03000000
@@ -58,10 +60,30 @@
 #define PREFIX_OPERAND_SIZE 0x66
 #define PREFIX_ADDRESS_SIZE 0x67
 
-#pragma pack( push, 1 )
-
+/*
+ * The wide fields come first and everything is naturally aligned, so
+ * clearing the structure is five aligned 8 byte stores.
+ *
+ * 0F 38 xx and 0F 3A xx keep 0F in opcode, the escape in opcode2 and the
+ * opcode in opcode3. VEX and EVEX keep C4, C5 or 62 in opcode, the opcode
+ * in opcode2 and the map (1 = 0F, 2 = 0F 38, 3 = 0F 3A) in vex_map.
+ */
 typedef struct
 {
+	union
+	{
+		uint8_t imm8;
+		uint16_t imm16;
+		uint32_t imm32;
+		uint64_t imm64;
+	} imm;
+	union
+	{
+		uint8_t disp8;
+		uint16_t disp16;
+		uint32_t disp32;
+	} disp;
+	uint32_t flags;
 	uint8_t len;
 	uint8_t p_rep;
 	uint8_t p_lock;
@@ -75,6 +97,8 @@ typedef struct
 	uint8_t rex_b;
 	uint8_t opcode;
 	uint8_t opcode2;
+	uint8_t opcode3;
+	uint8_t vex_map;
 	uint8_t modrm;
 	uint8_t modrm_mod;
 	uint8_t modrm_reg;
@@ -83,23 +107,29 @@ typedef struct
 	uint8_t sib_scale;
 	uint8_t sib_index;
 	uint8_t sib_base;
-	union
-	{
-		uint8_t imm8;
-		uint16_t imm16;
-		uint32_t imm32;
-		uint64_t imm64;
-	} imm;
-	union
-	{
-		uint8_t disp8;
-		uint16_t disp16;
-		uint32_t disp32;
-	} disp;
-	uint32_t flags;
 } hde64s;
 
-#pragma pack( pop )
+/*
+ * Structure of arrays filled by hde64_decode_range, every array is
+ * supplied by the caller and holds at least capacity entries.
+ */
+typedef struct
+{
+	uint32_t* offset;	/* offset of each instruction from the start of the range */
+	uint8_t* len;
+	uint8_t* opcode;
+	uint8_t* opcode2;	/* 0 for one byte opcodes */
+	uint8_t* opcode3;	/* 0 unless 0F 38 or 0F 3A */
+	uint8_t* vex_map;	/* 0 unless VEX or EVEX */
+	uint8_t* modrm_reg;	/* 0 without a ModR/M byte */
+	uint32_t* rip;		/* index of each instruction with a RIP relative operand */
+	int32_t* rip_disp;	/* and its displacement, target = code + offset + len + disp */
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t rip_count;
+	uint32_t size;		/* bytes decoded */
+	uint32_t flags;		/* flags of the instruction decoding stopped at, if it failed */
+} hde64_batch;
 
 #ifdef __cplusplus
 extern "C" {
@@ -108,6 +138,12 @@ extern "C" {
 /* __cdecl */
 unsigned int hde64_disasm( const void* code, hde64s* hs );
 
+/* __cdecl, returns 0 for instructions hde64_disasm flags with F_ERROR */
+unsigned int hde64_length( const void* code );
+
+/* __cdecl, linear sweep over [code, code + size), returns the instruction count */
+unsigned int hde64_decode_range( const void* code, unsigned int size, hde64_batch* batch );
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,7 +34,7 @@
 #define DELTA_OP_ONLY_MEM 0x1d8
 #define DELTA_OP2_ONLY_MEM 0x1e7
 
-unsigned char hde64_table[] = {
+constexpr uint8_t hde64_table[] = {
 	0xa5, 0xaa, 0xa5, 0xb8, 0xa5, 0xaa, 0xa5, 0xaa, 0xa5, 0xb8, 0xa5, 0xb8, 0xa5, 0xb8, 0xa5,
 	0xb8, 0xc0, 0xc0, 0xc0, 0xc0, 0xc0, 0xc0, 0xc0, 0xc0, 0xac, 0xc0, 0xcc, 0xc0, 0xa1, 0xa1,
 	0xa1, 0xa1, 0xb1, 0xa5, 0xa5, 0xa6, 0xc0, 0xc0, 0xd7, 0xda, 0xe0, 0xc0, 0xe4, 0xc0, 0xea,
@@ -71,4 +71,66 @@ unsigned char hde64_table[] = {
 	0x00, 0x16, 0x08, 0x00, 0x17, 0x09, 0x00, 0x2b, 0x09, 0x00, 0xae, 0xff, 0x07, 0xb2, 0xff,
 	0x00, 0xb4, 0xff, 0x00, 0xb5, 0xff, 0x00, 0xc3, 0x01, 0x00, 0xc7, 0xff, 0xbf, 0xe7, 0x08,
 	0x00, 0xf0, 0x02, 0x00
-};
\ No newline at end of file
+};
+
+/*
+ * Flattened opcode table generated from hde64_table at compile time.
+ * One entry per opcode and map, with the group and the prefixes which
+ * are invalid for two byte opcodes already resolved, so a decode needs
+ * a single lookup instead of a chain of dependent ones.
+ */
+typedef struct
+{
+	uint8_t cflags;		/* C_ERROR, or the flags of the opcode (never C_GROUP) */
+	uint8_t group;		/* bit 7 - reg set if the ModR/M reg field is invalid */
+	uint8_t prefix_error;	/* PRE_* invalid for this two byte opcode */
+	uint8_t reserved;
+} hde64_opcode;
+
+typedef struct
+{
+	hde64_opcode one[ 256 ];
+	hde64_opcode two[ 256 ];
+} hde64_opcodes_t;
+
+constexpr hde64_opcode hde64_make_opcode( const uint8_t* ht, uint8_t opcode, bool two_byte )
+{
+	hde64_opcode entry = {};
+	entry.cflags = ht[ ht[ opcode / 4 ] + ( opcode % 4 ) ];
+
+	if ( entry.cflags != C_ERROR && ( entry.cflags & C_GROUP ) )
+	{
+		const uint8_t* group = ht + ( entry.cflags & 0x7f );
+		entry.cflags = group[ 0 ];
+		entry.group = group[ 1 ];
+	}
+
+	if ( two_byte )
+	{
+		const uint8_t* pt = hde64_table + DELTA_PREFIXES;
+		entry.prefix_error = pt[ pt[ opcode / 4 ] + ( opcode % 4 ) ];
+	}
+
+	return entry;
+}
+
+constexpr hde64_opcodes_t hde64_make_opcodes( )
+{
+	hde64_opcodes_t opcodes = {};
+	for ( int i = 0; i < 256; i++ )
+	{
+		opcodes.one[ i ] = hde64_make_opcode( hde64_table, (uint8_t)i, false );
+		opcodes.two[ i ] = hde64_make_opcode( hde64_table + DELTA_OPCODES, (uint8_t)i, true );
+	}
+
+	/* encodings newer than the tables */
+	opcodes.two[ 0x01 ].group &= ~( 0x80 >> 5 );		/* 0F 01 /5, serialize, rdpkru, wrpkru */
+	opcodes.two[ 0x0b ].cflags = C_NONE;			/* ud2 */
+	opcodes.two[ 0xb8 ].cflags = C_MODRM;			/* popcnt */
+	opcodes.two[ 0xb8 ].prefix_error = PRE_NONE | PRE_F2;
+	opcodes.two[ 0xbc ].prefix_error &= ~PRE_F3;		/* tzcnt */
+	opcodes.two[ 0xbd ].prefix_error &= ~PRE_F3;		/* lzcnt */
+	return opcodes;
+}
+
+alignas( 64 ) constexpr hde64_opcodes_t hde64_opcodes = hde64_make_opcodes( );
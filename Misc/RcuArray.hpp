@@ -0,0 +1,174 @@
+/*
+*		File name:
+*			RcuArray.hpp
+*
+*		Use:
+*			Read-copy-update array, readers never lock and never see an array being modified.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+
+#pragma once
+#include "..\Common.hpp"
+
+/*
+*	Every change copies the current array into a new one and publishes it with a single pointer swap.
+*	Readers load the pointer once and must stay at DISPATCH_LEVEL or above while they use it, so a
+*	DPC having run on every processor means no reader can still hold a retired array.
+*
+*	Writers are not serialized here, the owner has to do that, and Reclaim must be called below DISPATCH_LEVEL.
+*/
+template<typename T>
+class RcuArray
+{
+public:
+	struct Snapshot_t
+	{
+		uint32_t Count;
+		T Items[ 1 ];
+	};
+
+private:
+	Snapshot_t* volatile Current;
+
+	/*
+	*	Allocates a snapshot holding Count items, the items are left for the caller to fill in.
+	*/
+	static Snapshot_t* Allocate( _In_ uint32_t Count )
+	{
+		Snapshot_t* Snapshot = (Snapshot_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, FIELD_OFFSET( Snapshot_t, Items ) + Count * sizeof( T ) );
+		if ( Snapshot )
+			Snapshot->Count = Count;
+
+		return Snapshot;
+	}
+
+	/*
+	*	Publishes a new snapshot and returns the old one, which readers may still be using.
+	*/
+	Snapshot_t* Publish( _In_opt_ Snapshot_t* Snapshot )
+	{
+		return (Snapshot_t*)InterlockedExchangePointer( (void* volatile*)&Current, Snapshot );
+	}
+
+	/*
+	*	Does nothing, other than proving the processor left whatever it was doing at DISPATCH_LEVEL or above.
+	*/
+	static void QuiescentDpc( _In_ PKDPC Dpc, _In_ PVOID DeferredContext, _In_ PVOID SystemArgument1, _In_ PVOID SystemArgument2 )
+	{
+		UNREFERENCED_PARAMETER( Dpc );
+		UNREFERENCED_PARAMETER( DeferredContext );
+
+		KeSignalCallDpcSynchronize( SystemArgument2 );
+		KeSignalCallDpcDone( SystemArgument1 );
+	}
+
+public:
+
+	/*
+	*	Gets the current snapshot, null if the array is empty.
+	*	The caller must be at DISPATCH_LEVEL or above until it is done with the snapshot.
+	*/
+	const Snapshot_t* Read( ) const
+	{
+		return Current;
+	}
+
+	/*
+	*	Publishes a copy of the array with the item appended. Returns false if out of resources.
+	*	The previous snapshot is returned through Retired and must be passed to Reclaim.
+	*/
+	bool Insert( _In_ T Item, _Out_ Snapshot_t** Retired )
+	{
+		*Retired = 0;
+
+		const Snapshot_t* Old = Current;
+		uint32_t Count = Old ? Old->Count : 0;
+
+		Snapshot_t* New = Allocate( Count + 1 );
+		if ( !New )
+			return false;
+
+		if ( Count )
+			memcpy( New->Items, Old->Items, Count * sizeof( T ) );
+
+		New->Items[ Count ] = Item;
+		*Retired = Publish( New );
+		return true;
+	}
+
+	/*
+	*	Publishes a copy of the array without the first occurrence of the item, or no array at all
+	*	if it was the last one. Returns false if the item was not found or out of resources.
+	*	The previous snapshot is returned through Retired and must be passed to Reclaim.
+	*/
+	bool Remove( _In_ T Item, _Out_ Snapshot_t** Retired )
+	{
+		*Retired = 0;
+
+		const Snapshot_t* Old = Current;
+		if ( !Old )
+			return false;
+
+		uint32_t Index = 0;
+		while ( Index < Old->Count && !(Old->Items[ Index ] == Item) )
+			Index++;
+
+		if ( Index == Old->Count )
+			return false;
+
+		Snapshot_t* New = 0;
+		if ( Old->Count > 1 )
+		{
+			New = Allocate( Old->Count - 1 );
+			if ( !New )
+				return false;
+
+			memcpy( New->Items, Old->Items, Index * sizeof( T ) );
+			memcpy( &New->Items[ Index ], &Old->Items[ Index + 1 ], (Old->Count - Index - 1) * sizeof( T ) );
+		}
+
+		*Retired = Publish( New );
+		return true;
+	}
+
+	/*
+	*	Unpublishes the array, the returned snapshot must be passed to Reclaim.
+	*/
+	Snapshot_t* Detach( )
+	{
+		return Publish( 0 );
+	}
+
+	/*
+	*	Waits until every processor has passed a quiescent point.
+	*	Any snapshot unpublished before this call is unreachable once it returns.
+	*/
+	static void Synchronize( )
+	{
+		KeGenericCallDpc( QuiescentDpc, 0 );
+	}
+
+	/*
+	*	Frees a snapshot without waiting, only for snapshots already known to be unreachable.
+	*/
+	static void Free( _In_opt_ Snapshot_t* Retired )
+	{
+		if ( Retired )
+			ExFreePool( Retired );
+	}
+
+	/*
+	*	Waits for every reader of a retired snapshot to finish, then frees it.
+	*/
+	static void Reclaim( _In_opt_ Snapshot_t* Retired )
+	{
+		if ( !Retired )
+			return;
+
+		Synchronize( );
+		Free( Retired );
+	}
+};
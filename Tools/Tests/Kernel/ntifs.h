@@ -0,0 +1,167 @@
+/*
+*		File name:
+*			ntifs.h
+*
+*		Use:
+*			User mode stand-in for the WDK headers, so the host tests can compile the driver sources as they are.
+*			Only covers what those sources use, everything runs on a single "processor" at PASSIVE_LEVEL,
+*			pool allocations come from the CRT and anything touching real kernel state is a no-op.
+*			Meant for one translation unit per test, the stubs are defined right here.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include <sal.h>
+// No <stdint.h>, Common.hpp brings its own fixed width types like the WDK expects.
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <intrin.h>
+
+#pragma region Types
+typedef void VOID, *PVOID;
+typedef char CHAR;
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN;
+typedef short SHORT;
+typedef unsigned short USHORT, WORD;
+typedef long LONG, NTSTATUS;
+typedef unsigned long ULONG, *PULONG, DWORD, LOGICAL;
+typedef long long LONGLONG, LONG64;
+typedef unsigned long long ULONGLONG, ULONG64, DWORD64, ULONG_PTR, SIZE_T, KAFFINITY;
+typedef unsigned char BYTE;
+typedef void* HANDLE;
+
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef struct _PROCESSOR_NUMBER
+{
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	PagedPool,
+	NonPagedPoolNx = 512
+} POOL_TYPE;
+
+typedef struct _KDPC* PKDPC;
+typedef void( *PKDEFERRED_ROUTINE )( PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2 );
+typedef ULONG_PTR( *PKIPI_BROADCAST_WORKER )( ULONG_PTR Argument );
+
+typedef struct _XSTATE_SAVE
+{
+	ULONG64 Mask;
+} XSTATE_SAVE, *PXSTATE_SAVE;
+
+typedef struct _KUSER_SHARED_DATA
+{
+	ULONG NtBuildNumber;
+} KUSER_SHARED_DATA;
+#pragma endregion
+
+#pragma region Definitions
+#define TRUE 1
+#define FALSE 0
+#define NTAPI
+
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define NT_SUCCESS( Status ) (((NTSTATUS)(Status)) >= 0)
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL 15
+
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+#define MAXULONG 0xFFFFFFFF
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+#define XSTATE_MASK_AVX (1ULL << 2)
+
+#define InterlockedIncrement _InterlockedIncrement
+#define InterlockedIncrement64 _InterlockedIncrement64
+#define InterlockedCompareExchange64 _InterlockedCompareExchange64
+#define InterlockedCompareExchangePointer _InterlockedCompareExchangePointer
+#define InterlockedExchangePointer _InterlockedExchangePointer
+
+#define RTL_NUMBER_OF( A ) (sizeof( A ) / sizeof( (A)[ 0 ] ))
+#define FIELD_OFFSET( Type, Field ) ((LONG)offsetof( Type, Field ))
+#define UNREFERENCED_PARAMETER( P ) (void)(P)
+
+// Pretends to be the newest supported build, so every build number check passes.
+inline KUSER_SHARED_DATA StandInSharedUserData{ 22621 };
+#define SharedUserData (&StandInSharedUserData)
+#pragma endregion
+
+#pragma region Stubs
+inline PVOID ExAllocatePool( POOL_TYPE, SIZE_T Size ) { return malloc( Size ); }
+inline void ExFreePool( PVOID P ) { free( P ); }
+
+inline KIRQL KeGetCurrentIrql( ) { return PASSIVE_LEVEL; }
+inline void KeRaiseIrql( KIRQL, PKIRQL OldIrql ) { *OldIrql = PASSIVE_LEVEL; }
+inline void KeLowerIrql( KIRQL ) { }
+inline KIRQL KeAcquireSpinLockRaiseToDpc( PKSPIN_LOCK ) { return PASSIVE_LEVEL; }
+inline void KeReleaseSpinLock( PKSPIN_LOCK, KIRQL ) { }
+inline void KeInitializeSpinLock( PKSPIN_LOCK Lock ) { *Lock = 0; }
+
+inline ULONG KeGetCurrentProcessorIndex( ) { return 0; }
+inline ULONG KeQueryActiveProcessorCountEx( USHORT ) { return 1; }
+inline ULONG KeQueryMaximumProcessorCountEx( USHORT ) { return 1; }
+inline ULONG_PTR KeIpiGenericCall( PKIPI_BROADCAST_WORKER Worker, ULONG_PTR Argument ) { return Worker( Argument ); }
+
+// User mode threads have their extended state saved by the OS already.
+inline NTSTATUS KeSaveExtendedProcessorState( ULONG64 Mask, PXSTATE_SAVE Save ) { Save->Mask = Mask; return STATUS_SUCCESS; }
+inline void KeRestoreExtendedProcessorState( PXSTATE_SAVE ) { }
+
+inline BOOLEAN MmIsAddressValid( PVOID Address ) { return Address != 0; }
+inline PVOID MmGetVirtualForPhysical( PHYSICAL_ADDRESS ) { return 0; }
+
+inline ULONG DbgPrintEx( ULONG, ULONG, const char* Format, ... )
+{
+	va_list Args;
+	va_start( Args, Format );
+	vfprintf( stderr, Format, Args );
+	va_end( Args );
+	return 0;
+}
+
+inline void KeBugCheck( ULONG Code )
+{
+	fprintf( stderr, "KeBugCheck( 0x%lX )\n", Code );
+	abort( );
+}
+#pragma endregion
+
+#pragma region Imports
+// Common.hpp declares these as dllimport, so calls go through the __imp_ pointers defined below.
+extern "C" inline ULONG64 StandInRtlFindExportedRoutineByName( ULONG64, const char* ) { return 0; }
+extern "C" inline ULONG64 StandInRtlPcToFileHeader( ULONG64, ULONG64* Base ) { *Base = 0; return 0; }
+extern "C" inline void StandInKeGenericCallDpc( PKDEFERRED_ROUTINE Routine, PVOID Context ) { Routine( 0, Context, 0, 0 ); }
+extern "C" inline void StandInKeSignalCallDpcDone( PVOID ) { }
+extern "C" inline LOGICAL StandInKeSignalCallDpcSynchronize( PVOID ) { return TRUE; }
+
+extern "C" inline void* __imp_RtlFindExportedRoutineByName = (void*)&StandInRtlFindExportedRoutineByName;
+extern "C" inline void* __imp_RtlPcToFileHeader = (void*)&StandInRtlPcToFileHeader;
+extern "C" inline void* __imp_KeGenericCallDpc = (void*)&StandInKeGenericCallDpc;
+extern "C" inline void* __imp_KeSignalCallDpcDone = (void*)&StandInKeSignalCallDpcDone;
+extern "C" inline void* __imp_KeSignalCallDpcSynchronize = (void*)&StandInKeSignalCallDpcSynchronize;
+#pragma endregion
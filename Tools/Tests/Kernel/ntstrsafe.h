@@ -0,0 +1,12 @@
+/*
+*		File name:
+*			ntstrsafe.h
+*
+*		Use:
+*			Empty, everything the host tests need is in ntifs.h and ntimage.h.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
@@ -0,0 +1,369 @@
+/*
+*		File name:
+*			PatternTests.cpp
+*
+*		Use:
+*			Host side test for the pattern scanners. Checks that the SSE2/AVX2 scan, the anchored scan and
+*			Horspool always return the same match as FindPatternScalar on random buffers and masks, then
+*			prints the throughput of each of them. Also makes sure the chunked module scan never hands pageable
+*			or discardable sections to its dispatcher. The driver sources are compiled in as they are, against
+*			the user mode stand-ins in Kernel\, e.g. "cl /std:c++20 /O2 /I Kernel PatternTests.cpp".
+*
+*			Usage: PatternTests [seed]
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "..\..\Utils\Utils.cpp"
+#include "..\..\Misc\HDE\HDE64.cpp"
+
+#include <time.h>
+
+// Large enough to take the AVX2 path, see AVX2_MIN_SEARCH_SIZE.
+#define MAX_BUFFER_SIZE 0x10000
+#define MAX_PATTERN_LENGTH 64
+#define ITERATIONS 200000
+
+#define THROUGHPUT_BUFFER_SIZE ( 64 * 1024 * 1024 )
+#define THROUGHPUT_ROUNDS 8
+
+static uint32_t Failures = 0;
+
+// One pattern for each flavour of FindPattern_C.
+static constexpr Utils::Pattern Short( "48 8B 05 ? ? ? ? 48 85 C0 74" );
+static constexpr Utils::Pattern Long( "48 8B 05 ? ? ? ? 4C 8B DC 49 89 5B 08 49 89 6B 10 49 89 73 18 57 41 54 41 55 41 56 41 57 48 81 EC 80 00 00 00 48 33 C4" );
+static_assert( !Short.PreferHorspool && Long.PreferHorspool, "The patterns don't cover both scanners" );
+
+static uint64_t RandomState = 0x9E3779B97F4A7C15;
+
+/*
+*	xorshift64, the same seed always gives the same run.
+*/
+static uint64_t Random( )
+{
+	RandomState ^= RandomState << 13;
+	RandomState ^= RandomState >> 7;
+	RandomState ^= RandomState << 17;
+	return RandomState;
+}
+
+/*
+*	Builds the Horspool skip table the same way Utils::Pattern does.
+*/
+static void BuildSkipTable( const uint8_t* Pattern, const uint8_t* Mask, uint32_t Length, uint8_t* Skip )
+{
+	uint32_t DefaultSkip = Length;
+	for ( uint32_t i = 0; i + 1 < Length; i++ )
+	{
+		if ( !Mask[ i ] )
+			DefaultSkip = Length - 1 - i;
+	}
+
+	for ( uint32_t i = 0; i < 256; i++ )
+		Skip[ i ] = uint8_t( DefaultSkip );
+
+	for ( uint32_t i = 0; i + 1 < Length; i++ )
+	{
+		if ( Mask[ i ] && Length - 1 - i < DefaultSkip )
+			Skip[ Pattern[ i ] ] = uint8_t( Length - 1 - i );
+	}
+}
+
+static void Check( bool Condition, const char* Scanner, uint32_t Iteration, uint32_t Size, uint32_t Length, uint64_t Expected, uint64_t Result, uint64_t Base )
+{
+	if ( Condition )
+		return;
+
+	if ( Failures++ < 16 )
+	{
+		printf( "FAIL %s: iteration %u, size 0x%X, length %u, expected %lld, got %lld\n", Scanner, Iteration, Size, Length,
+			Expected ? (long long)(Expected - Base) : -1ll, Result ? (long long)(Result - Base) : -1ll );
+	}
+}
+
+/*
+*	Random buffers, patterns and masks, every scanner has to agree with FindPatternScalar.
+*/
+static void TestRandom( uint8_t* Buffer )
+{
+	uint8_t Pattern[ MAX_PATTERN_LENGTH ];
+	uint8_t Mask[ MAX_PATTERN_LENGTH ];
+	uint8_t Skip[ 256 ];
+
+	for ( uint32_t Iteration = 0; Iteration < ITERATIONS; Iteration++ )
+	{
+		// Mostly small blocks, but enough big ones to go through the AVX2 path too.
+		uint32_t Size = Iteration & 7 ? uint32_t( Random( ) % 0x400 ) + 1 : uint32_t( Random( ) % MAX_BUFFER_SIZE ) + 1;
+
+		// A small alphabet makes for plenty of candidates and near misses.
+		uint32_t Alphabet = Iteration & 1 ? 256 : uint32_t( Random( ) % 4 ) + 1;
+		for ( uint32_t i = 0; i < Size; i++ )
+			Buffer[ i ] = uint8_t( Random( ) % Alphabet );
+
+		uint32_t Length = uint32_t( Random( ) % MAX_PATTERN_LENGTH ) + 1;
+		if ( Length > Size )
+			Length = Size;
+
+		// Usually cut out of the buffer so there is a match, sometimes made up.
+		uint32_t Source = uint32_t( Random( ) % (Size - Length + 1) );
+		bool Planted = Random( ) % 4 != 0;
+		uint32_t Wildcards = uint32_t( Random( ) % 4 );
+		for ( uint32_t i = 0; i < Length; i++ )
+		{
+			Pattern[ i ] = Planted ? Buffer[ Source + i ] : uint8_t( Random( ) % Alphabet );
+			Mask[ i ] = Random( ) % 4 < Wildcards ? 0x00 : 0xFF;
+
+			// Garbage under a wildcard must not matter.
+			if ( !Mask[ i ] )
+				Pattern[ i ] = uint8_t( Random( ) );
+		}
+
+		uint64_t Base = uint64_t( Buffer );
+		uint64_t Expected = Utils::FindPatternScalar( Base, Size, Pattern, Mask, Length );
+		if ( Planted )
+			Check( Expected && Expected <= Base + Source, "FindPatternScalar", Iteration, Size, Length, Base + Source, Expected, Base );
+
+		uint64_t Result = Utils::FindPatternMasked( Base, Size, Pattern, Mask, Length );
+		Check( Result == Expected, "FindPatternMasked", Iteration, Size, Length, Expected, Result, Base );
+
+		uint32_t First, Second;
+		if ( Utils::SelectAnchors( Pattern, Mask, Length, &First, &Second ) )
+		{
+			Result = Utils::FindPatternAnchored( Base, Size, Pattern, Mask, Length, First, Second );
+			Check( Result == Expected, "FindPatternAnchored", Iteration, Size, Length, Expected, Result, Base );
+		}
+
+		BuildSkipTable( Pattern, Mask, Length, Skip );
+		Result = Utils::FindPatternHorspool( Base, Size, Pattern, Mask, Length, Skip );
+		Check( Result == Expected, "FindPatternHorspool", Iteration, Size, Length, Expected, Result, Base );
+	}
+}
+
+/*
+*	Compile-time patterns, both the anchored and the Horspool flavour of FindPattern_C.
+*/
+static void TestCompiled( uint8_t* Buffer )
+{
+	for ( uint32_t Iteration = 0; Iteration < ITERATIONS / 100; Iteration++ )
+	{
+		uint32_t Size = uint32_t( Random( ) % MAX_BUFFER_SIZE ) + Long.Length;
+		for ( uint32_t i = 0; i < Size; i++ )
+			Buffer[ i ] = uint8_t( Random( ) );
+
+		// Plant both a few times, with random bytes under the wildcards.
+		for ( uint32_t n = uint32_t( Random( ) % 3 ); n; n-- )
+		{
+			uint32_t Offset = uint32_t( Random( ) % (Size - Short.Length + 1) );
+			for ( uint32_t i = 0; i < Short.Length; i++ )
+				Buffer[ Offset + i ] = Short.Mask[ i ] ? Short.Bytes[ i ] : Buffer[ Offset + i ];
+
+			Offset = uint32_t( Random( ) % (Size - Long.Length + 1) );
+			for ( uint32_t i = 0; i < Long.Length; i++ )
+				Buffer[ Offset + i ] = Long.Mask[ i ] ? Long.Bytes[ i ] : Buffer[ Offset + i ];
+		}
+
+		uint64_t Base = uint64_t( Buffer );
+		uint64_t Expected = Utils::FindPatternScalar( Base, Size, Short.Bytes, Short.Mask, Short.Length );
+		uint64_t Result = Utils::FindPattern_C( Base, Size, Short );
+		Check( Result == Expected, "FindPattern_C (anchored)", Iteration, Size, Short.Length, Expected, Result, Base );
+
+		Expected = Utils::FindPatternScalar( Base, Size, Long.Bytes, Long.Mask, Long.Length );
+		Result = Utils::FindPattern_C( Base, Size, Long );
+		Check( Result == Expected, "FindPattern_C (Horspool)", Iteration, Size, Long.Length, Expected, Result, Base );
+	}
+}
+
+// Image for FindPatternChunked, a pageable section, a non-paged one of a few chunks and a discardable one.
+#define CHUNKED_PAGE_RVA 0x1000
+#define CHUNKED_TEXT_RVA 0x2000
+#define CHUNKED_TEXT_SIZE ( PARALLEL_SCAN_CHUNK_SIZE * 2 + 0x1000 )
+#define CHUNKED_INIT_RVA ( CHUNKED_TEXT_RVA + CHUNKED_TEXT_SIZE )
+#define CHUNKED_IMAGE_SIZE ( CHUNKED_INIT_RVA + 0x1000 )
+
+static uint8_t* ChunkedImage = 0;
+static bool Dispatching = false;
+
+/*
+*	Fails on any chunk outside of the non-paged section while the dispatcher runs, as those would be
+*	scanned at DISPATCH_LEVEL in the driver, and on any chunk of the discardable section at all.
+*/
+static uint64_t ChunkedScanner( uint64_t SearchStart, uint32_t SearchSize, const void* Pattern )
+{
+	uint64_t Rva = SearchStart - uint64_t( ChunkedImage );
+	if ( Rva >= CHUNKED_INIT_RVA || (Dispatching && (Rva < CHUNKED_TEXT_RVA || Rva + SearchSize > CHUNKED_INIT_RVA)) )
+	{
+		if ( Failures++ < 16 )
+			printf( "FAIL FindPatternChunked: chunk at 0x%llX, size 0x%X, dispatching %u\n", (unsigned long long)Rva, SearchSize, Dispatching );
+	}
+
+	return Utils::FindPattern_C( SearchStart, SearchSize, *(const decltype( Short )*)Pattern );
+}
+
+static void ChunkedDispatcher( void( *Worker )( void* Context ), void* Context )
+{
+	Dispatching = true;
+	Worker( Context );
+	Dispatching = false;
+}
+
+static void Plant( uint32_t Rva )
+{
+	memcpy( ChunkedImage + Rva, Short.Bytes, Short.Length );
+}
+
+/*
+*	FindPatternChunked returns the lowest match no matter which sections went to the dispatcher.
+*/
+static void TestChunked( )
+{
+	ChunkedImage = (uint8_t*)calloc( 1, CHUNKED_IMAGE_SIZE );
+	if ( !ChunkedImage )
+	{
+		Failures++;
+		return;
+	}
+
+	PIMAGE_DOS_HEADER Dos = PIMAGE_DOS_HEADER( ChunkedImage );
+	Dos->e_magic = IMAGE_DOS_SIGNATURE;
+	Dos->e_lfanew = 0x80;
+
+	PIMAGE_NT_HEADERS64 NT = NTHEADER( ChunkedImage );
+	NT->Signature = IMAGE_NT_SIGNATURE;
+	NT->FileHeader.NumberOfSections = 3;
+	NT->FileHeader.SizeOfOptionalHeader = sizeof( IMAGE_OPTIONAL_HEADER64 );
+	NT->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	NT->OptionalHeader.SizeOfImage = CHUNKED_IMAGE_SIZE;
+
+	PIMAGE_SECTION_HEADER Sections = IMAGE_FIRST_SECTION( NT );
+	Sections[ 0 ].VirtualAddress = CHUNKED_PAGE_RVA;
+	Sections[ 0 ].Misc.VirtualSize = CHUNKED_TEXT_RVA - CHUNKED_PAGE_RVA;
+	Sections[ 0 ].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+
+	Sections[ 1 ].VirtualAddress = CHUNKED_TEXT_RVA;
+	Sections[ 1 ].Misc.VirtualSize = CHUNKED_TEXT_SIZE;
+	Sections[ 1 ].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_NOT_PAGED | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+
+	Sections[ 2 ].VirtualAddress = CHUNKED_INIT_RVA;
+	Sections[ 2 ].Misc.VirtualSize = CHUNKED_IMAGE_SIZE - CHUNKED_INIT_RVA;
+	Sections[ 2 ].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_DISCARDABLE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+
+	uint64_t Base = uint64_t( ChunkedImage );
+	auto Scan = [ & ]( ) { return Utils::FindPatternChunked( Base, &Short, Short.Length, ChunkedScanner, ChunkedDispatcher ); };
+
+	// Only in the discardable section.
+	Plant( CHUNKED_INIT_RVA + 0x10 );
+	Check( Scan( ) == 0, "FindPatternChunked (discardable)", 0, CHUNKED_IMAGE_SIZE, Short.Length, 0, Scan( ), Base );
+
+	// Across the boundary of two chunks of the non-paged section.
+	uint32_t Rva = CHUNKED_TEXT_RVA + PARALLEL_SCAN_CHUNK_SIZE - 4;
+	Plant( Rva );
+	Check( Scan( ) == Base + Rva, "FindPatternChunked (non-paged)", 1, CHUNKED_IMAGE_SIZE, Short.Length, Base + Rva, Scan( ), Base );
+
+	// The pageable match is lower, even though the non-paged one is found first.
+	Plant( CHUNKED_PAGE_RVA + 0x20 );
+	Check( Scan( ) == Base + CHUNKED_PAGE_RVA + 0x20, "FindPatternChunked (pageable)", 2, CHUNKED_IMAGE_SIZE, Short.Length, Base + CHUNKED_PAGE_RVA + 0x20, Scan( ), Base );
+
+	free( ChunkedImage );
+	ChunkedImage = 0;
+}
+
+typedef uint64_t( *Scanner_t )( uint64_t SearchStart, uint32_t SearchSize );
+
+static void Measure( const char* Name, Scanner_t Scanner, uint8_t* Buffer, uint64_t Expected )
+{
+	clock_t Start = clock( );
+	for ( uint32_t i = 0; i < THROUGHPUT_ROUNDS; i++ )
+	{
+		if ( Scanner( uint64_t( Buffer ), THROUGHPUT_BUFFER_SIZE ) != Expected )
+		{
+			printf( "FAIL %s: wrong match while measuring\n", Name );
+			Failures++;
+			return;
+		}
+	}
+
+	double Seconds = double( clock( ) - Start ) / CLOCKS_PER_SEC;
+	double Megabytes = double( THROUGHPUT_BUFFER_SIZE ) * THROUGHPUT_ROUNDS / (1024 * 1024);
+	printf( "  %-28s %10.1f MB/s\n", Name, Seconds > 0 ? Megabytes / Seconds : 0 );
+}
+
+/*
+*	Scans a big buffer of kernel-like bytes for a pattern which only sits at the very end.
+*/
+static void TestThroughput( )
+{
+	uint8_t* Buffer = (uint8_t*)malloc( THROUGHPUT_BUFFER_SIZE );
+	if ( !Buffer )
+	{
+		printf( "FAIL could not allocate the throughput buffer\n" );
+		Failures++;
+		return;
+	}
+
+	// Common bytes show up a lot, so anchors are picked the same way they would be on real code.
+	for ( uint32_t i = 0; i < THROUGHPUT_BUFFER_SIZE; i++ )
+	{
+		uint64_t r = Random( );
+		Buffer[ i ] = r & 1 ? Utils::CommonBytes[ (r >> 8) % sizeof( Utils::CommonBytes ) ] : uint8_t( r >> 16 );
+	}
+
+	uint8_t* ShortAt = Buffer + THROUGHPUT_BUFFER_SIZE - Long.Length - Short.Length;
+	uint8_t* LongAt = Buffer + THROUGHPUT_BUFFER_SIZE - Long.Length;
+	memcpy( ShortAt, Short.Bytes, Short.Length );
+	memcpy( LongAt, Long.Bytes, Long.Length );
+
+	// Random bytes could match before the planted copies, the scalar scan has the final word.
+	uint64_t ShortExpected = Utils::FindPatternScalar( uint64_t( Buffer ), THROUGHPUT_BUFFER_SIZE, Short.Bytes, Short.Mask, Short.Length );
+	uint64_t LongExpected = Utils::FindPatternScalar( uint64_t( Buffer ), THROUGHPUT_BUFFER_SIZE, Long.Bytes, Long.Mask, Long.Length );
+
+	printf( "Throughput over %u MB, AVX2 %s:\n", THROUGHPUT_BUFFER_SIZE / (1024 * 1024), Utils::IsAvx2Supported( ) ? "used" : "unavailable" );
+
+	Measure( "FindPatternScalar", []( uint64_t Start, uint32_t Size ) -> uint64_t
+	{
+		return Utils::FindPatternScalar( Start, Size, Short.Bytes, Short.Mask, Short.Length );
+	}, Buffer, ShortExpected );
+
+	Measure( "FindPatternMasked", []( uint64_t Start, uint32_t Size ) -> uint64_t
+	{
+		return Utils::FindPatternMasked( Start, Size, Short.Bytes, Short.Mask, Short.Length );
+	}, Buffer, ShortExpected );
+
+	Measure( "FindPattern_C (anchored)", []( uint64_t Start, uint32_t Size ) -> uint64_t
+	{
+		return Utils::FindPattern_C( Start, Size, Short );
+	}, Buffer, ShortExpected );
+
+	Measure( "FindPatternScalar (long)", []( uint64_t Start, uint32_t Size ) -> uint64_t
+	{
+		return Utils::FindPatternScalar( Start, Size, Long.Bytes, Long.Mask, Long.Length );
+	}, Buffer, LongExpected );
+
+	Measure( "FindPattern_C (Horspool)", []( uint64_t Start, uint32_t Size ) -> uint64_t
+	{
+		return Utils::FindPattern_C( Start, Size, Long );
+	}, Buffer, LongExpected );
+
+	free( Buffer );
+}
+
+int main( int argc, char** argv )
+{
+	if ( argc > 1 )
+		RandomState = strtoull( argv[ 1 ], 0, 0 ) | 1;
+
+	uint8_t* Buffer = (uint8_t*)malloc( MAX_BUFFER_SIZE + MAX_PATTERN_LENGTH );
+	if ( !Buffer )
+		return 1;
+
+	TestRandom( Buffer );
+	TestCompiled( Buffer );
+	free( Buffer );
+
+	TestChunked( );
+
+	TestThroughput( );
+
+	printf( "%s, %u failure(s)\n", Failures ? "FAILED" : "PASSED", Failures );
+	return Failures ? 1 : 0;
+}
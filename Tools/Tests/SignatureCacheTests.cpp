@@ -0,0 +1,255 @@
+/*
+*		File name:
+*			SignatureCacheTests.cpp
+*
+*		Use:
+*			Host side test for the signature cache. Round trips a cache through Export and Import, and makes sure
+*			truncated, corrupted or foreign records are never used. Builds against the user mode stand-ins in
+*			Kernel\, e.g. "cl /std:c++20 /O2 /I Kernel SignatureCacheTests.cpp".
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "..\..\HyperV\SignatureCache.cpp"
+
+using namespace HyperDeceit::HyperV;
+
+#define IMAGE_SIZE 0x4000
+#define TEXT_RVA 0x1000
+#define INIT_RVA 0x2000
+#define SECTION_SIZE 0x1000
+
+#define CHECK( Condition )																\
+	{																					\
+		if ( !(Condition) )																\
+		{																				\
+			printf( "FAIL %s:%d: %s\n", __FUNCTION__, __LINE__, #Condition );			\
+			Failures++;																	\
+		}																				\
+	}
+
+static uint32_t Failures = 0;
+
+/*
+*	Minimal PE image, a .text section followed by a discardable INIT section.
+*/
+static uint64_t CreateImage( uint32_t TimeDateStamp, uint32_t SizeOfImage, uint32_t CheckSum )
+{
+	uint8_t* Image = (uint8_t*)calloc( 1, IMAGE_SIZE );
+	if ( !Image )
+	{
+		printf( "FAIL could not allocate an image\n" );
+		exit( 1 );
+	}
+
+	PIMAGE_DOS_HEADER Dos = PIMAGE_DOS_HEADER( Image );
+	Dos->e_magic = IMAGE_DOS_SIGNATURE;
+	Dos->e_lfanew = 0x80;
+
+	PIMAGE_NT_HEADERS64 NT = NTHEADER( Image );
+	NT->Signature = IMAGE_NT_SIGNATURE;
+	NT->FileHeader.NumberOfSections = 2;
+	NT->FileHeader.TimeDateStamp = TimeDateStamp;
+	NT->FileHeader.SizeOfOptionalHeader = sizeof( IMAGE_OPTIONAL_HEADER64 );
+	NT->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	NT->OptionalHeader.SizeOfImage = SizeOfImage;
+	NT->OptionalHeader.CheckSum = CheckSum;
+
+	PIMAGE_SECTION_HEADER Sections = IMAGE_FIRST_SECTION( NT );
+	memcpy( Sections[ 0 ].Name, ".text", 5 );
+	Sections[ 0 ].VirtualAddress = TEXT_RVA;
+	Sections[ 0 ].Misc.VirtualSize = SECTION_SIZE;
+	Sections[ 0 ].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+
+	memcpy( Sections[ 1 ].Name, "INIT", 4 );
+	Sections[ 1 ].VirtualAddress = INIT_RVA;
+	Sections[ 1 ].Misc.VirtualSize = SECTION_SIZE;
+	Sections[ 1 ].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_DISCARDABLE;
+
+	return uint64_t( Image );
+}
+
+/*
+*	Forgets everything, like a fresh load of the driver.
+*/
+static void Reset( )
+{
+	memset( &SignatureCache::Cache, 0, sizeof( SignatureCache::Cache ) );
+	SignatureCache::ImageBase = 0;
+}
+
+/*
+*	Resolves a couple of entries against an image and exports them.
+*/
+static void ExportRecord( uint64_t Image, SignatureCache::SignatureCache_t* Record )
+{
+	Reset( );
+	SignatureCache::Bind( Image );
+	SignatureCache::Store( 0, Image + TEXT_RVA + 0x10 );
+	SignatureCache::Store( CACHE_ENTRY_HVCALLCODEVA, Image + TEXT_RVA + 0x800 );
+
+	uint32_t Written = 0;
+	CHECK( SignatureCache::Export( Record, sizeof( *Record ), &Written ) );
+	CHECK( Written == sizeof( *Record ) );
+}
+
+static void TestRoundTrip( uint64_t Image, uint64_t Reloaded )
+{
+	// Nothing to export before binding.
+	Reset( );
+	uint32_t Written = 0;
+	uint8_t Buffer[ sizeof( SignatureCache::SignatureCache_t ) + 1 ];
+	CHECK( !SignatureCache::Export( Buffer, sizeof( Buffer ), &Written ) );
+
+	SignatureCache::Bind( Image );
+	CHECK( SignatureCache::Export( 0, 0, &Written ) && Written == sizeof( SignatureCache::SignatureCache_t ) );
+	CHECK( !SignatureCache::Export( Buffer, Written - 1, &Written ) );
+
+	SignatureCache::SignatureCache_t Record;
+	ExportRecord( Image, &Record );
+
+	// Same kernel, loaded at another address.
+	Reset( );
+	CHECK( SignatureCache::Import( &Record, sizeof( Record ) ) );
+	SignatureCache::Bind( Reloaded );
+	CHECK( SignatureCache::Lookup( 0, 8 ) == Reloaded + TEXT_RVA + 0x10 );
+	CHECK( SignatureCache::Lookup( CACHE_ENTRY_HVCALLCODEVA, 7 ) == Reloaded + TEXT_RVA + 0x800 );
+
+	// Entries which were never stored, or don't exist.
+	CHECK( SignatureCache::Lookup( 1, 8 ) == 0 );
+	CHECK( SignatureCache::Lookup( CACHE_ENTRY_COUNT, 8 ) == 0 );
+
+	// The bytes have to fit in the section.
+	CHECK( SignatureCache::Lookup( CACHE_ENTRY_HVCALLCODEVA, SECTION_SIZE - 0x800 ) != 0 );
+	CHECK( SignatureCache::Lookup( CACHE_ENTRY_HVCALLCODEVA, SECTION_SIZE - 0x800 + 1 ) == 0 );
+
+	// Discardable sections are gone after initialization.
+	SignatureCache::Store( 1, Reloaded + INIT_RVA + 0x10 );
+	CHECK( SignatureCache::Lookup( 1, 8 ) == 0 );
+
+	// Clearing an entry.
+	SignatureCache::Store( 0, 0 );
+	CHECK( SignatureCache::Lookup( 0, 8 ) == 0 );
+
+	// Exporting again gives back the same record, plus whatever changed since.
+	SignatureCache::SignatureCache_t Again;
+	CHECK( SignatureCache::Export( &Again, sizeof( Again ), &Written ) );
+	CHECK( Again.Rva[ 0 ] == 0 && Again.Rva[ 1 ] == INIT_RVA + 0x10 && Again.Rva[ CACHE_ENTRY_HVCALLCODEVA ] == TEXT_RVA + 0x800 );
+	CHECK( Again.TimeDateStamp == Record.TimeDateStamp && Again.SizeOfImage == Record.SizeOfImage && Again.CheckSum == Record.CheckSum );
+}
+
+static void TestTruncated( uint64_t Image )
+{
+	SignatureCache::SignatureCache_t Record;
+	ExportRecord( Image, &Record );
+
+	uint8_t Buffer[ sizeof( Record ) + 1 ]{};
+	memcpy( Buffer, &Record, sizeof( Record ) );
+
+	Reset( );
+	CHECK( !SignatureCache::Import( 0, sizeof( Record ) ) );
+	CHECK( !SignatureCache::Import( Buffer, 0 ) );
+
+	for ( uint32_t Size = 1; Size < sizeof( Record ); Size++ )
+		CHECK( !SignatureCache::Import( Buffer, Size ) );
+
+	// Trailing bytes mean it isn't the record we think it is either.
+	CHECK( !SignatureCache::Import( Buffer, sizeof( Buffer ) ) );
+
+	// Nothing was taken over from the rejected records.
+	SignatureCache::Bind( Image );
+	CHECK( SignatureCache::Lookup( 0, 8 ) == 0 );
+}
+
+static void TestChecksum( uint64_t Image )
+{
+	SignatureCache::SignatureCache_t Record;
+	ExportRecord( Image, &Record );
+
+	// Any single bit flip, anywhere, has to be caught.
+	for ( uint32_t Byte = 0; Byte < sizeof( Record ); Byte++ )
+	{
+		for ( uint32_t Bit = 0; Bit < 8; Bit++ )
+		{
+			SignatureCache::SignatureCache_t Corrupted = Record;
+			((uint8_t*)&Corrupted)[ Byte ] ^= uint8_t( 1 << Bit );
+
+			Reset( );
+			CHECK( !SignatureCache::Import( &Corrupted, sizeof( Corrupted ) ) );
+		}
+	}
+
+	// Another version is rejected even with a valid checksum.
+	SignatureCache::SignatureCache_t Other = Record;
+	Other.Version++;
+	Other.Checksum = SignatureCache::ComputeChecksum( &Other );
+	Reset( );
+	CHECK( !SignatureCache::Import( &Other, sizeof( Other ) ) );
+
+	Other = Record;
+	Other.EntryCount--;
+	Other.Checksum = SignatureCache::ComputeChecksum( &Other );
+	CHECK( !SignatureCache::Import( &Other, sizeof( Other ) ) );
+
+	// A failed import leaves the previous one alone.
+	CHECK( SignatureCache::Import( &Record, sizeof( Record ) ) );
+	Other.Checksum ^= 1;
+	CHECK( !SignatureCache::Import( &Other, sizeof( Other ) ) );
+	SignatureCache::Bind( Image );
+	CHECK( SignatureCache::Lookup( 0, 8 ) == Image + TEXT_RVA + 0x10 );
+}
+
+static void TestWrongImage( uint64_t Image )
+{
+	PIMAGE_NT_HEADERS64 NT = NTHEADER( Image );
+	uint32_t TimeDateStamp = NT->FileHeader.TimeDateStamp;
+	uint32_t SizeOfImage = NT->OptionalHeader.SizeOfImage;
+	uint32_t CheckSum = NT->OptionalHeader.CheckSum;
+
+	SignatureCache::SignatureCache_t Record;
+	ExportRecord( Image, &Record );
+
+	// Each part of the key on its own is enough to tell the images apart.
+	uint64_t Others[] =
+	{
+		CreateImage( TimeDateStamp + 1, SizeOfImage, CheckSum ),
+		CreateImage( TimeDateStamp, SizeOfImage + 0x1000, CheckSum ),
+		CreateImage( TimeDateStamp, SizeOfImage, CheckSum + 1 )
+	};
+
+	for ( uint64_t Other : Others )
+	{
+		Reset( );
+		CHECK( SignatureCache::Import( &Record, sizeof( Record ) ) );
+		SignatureCache::Bind( Other );
+		CHECK( SignatureCache::Lookup( 0, 8 ) == 0 );
+		CHECK( SignatureCache::Lookup( CACHE_ENTRY_HVCALLCODEVA, 7 ) == 0 );
+
+		// The stale entries must not come back with the next export either.
+		SignatureCache::SignatureCache_t Exported;
+		uint32_t Written;
+		CHECK( SignatureCache::Export( &Exported, sizeof( Exported ), &Written ) );
+		CHECK( Exported.Rva[ 0 ] == 0 && Exported.Rva[ CACHE_ENTRY_HVCALLCODEVA ] == 0 );
+		CHECK( Exported.TimeDateStamp == NTHEADER( Other )->FileHeader.TimeDateStamp );
+
+		free( (void*)Other );
+	}
+}
+
+int main( )
+{
+	uint64_t Image = CreateImage( 0x5F3A1C22, 0x1046000, 0xA8E1F3 );
+	uint64_t Reloaded = CreateImage( 0x5F3A1C22, 0x1046000, 0xA8E1F3 );
+
+	TestRoundTrip( Image, Reloaded );
+	TestTruncated( Image );
+	TestChecksum( Image );
+	TestWrongImage( Image );
+
+	free( (void*)Image );
+	free( (void*)Reloaded );
+
+	printf( "%s, %u failure(s)\n", Failures ? "FAILED" : "PASSED", Failures );
+	return Failures ? 1 : 0;
+}
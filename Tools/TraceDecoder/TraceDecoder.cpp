@@ -0,0 +1,336 @@
+/*
+*		File name:
+*			TraceDecoder.cpp
+*
+*		Use:
+*			Host side decoder for traces exported by HvDExportTrace. Merges the per-processor streams by TSC,
+*			prints rates and can convert the trace to the Chrome trace event format (chrome://tracing, Perfetto).
+*			Standalone and portable, build with any C++17 compiler, e.g. "c++ -std=c++17 -O2 TraceDecoder.cpp".
+*
+*			Usage: TraceDecoder <trace.bin> [--chrome <out.json>] [--top <processes>]
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../../Includes/HyperDeceitTrace.hpp"
+
+// Mirrors HyperDeceit::HyperV::ECommand.
+#define COMMAND_SLOW_FLUSH_ADDRESS_SPACE 2
+#define COMMAND_FAST_FLUSH_ADDRESS_SPACE 0x10002
+#define COMMAND_FLUSH_ADDRESS_LIST 0x3
+#define COMMAND_FLUSH_ADDRESS_SPACE_EX 0x13
+#define COMMAND_FLUSH_ADDRESS_LIST_EX 0x14
+#define COMMAND_ENTER_SLEEP_STATE 0x84
+#define COMMAND_DEBUG_DEVICE_AVAILABLE 0x87
+#define COMMAND_SWITCH_ADDRESS_SPACE 0x10001
+#define COMMAND_LONG_SPIN_WAIT 0x10008
+
+// Call code and fast bit, records also carry the variable header size above them.
+#define COMMAND_CODE_MASK 0x1FFFF
+
+// Bits of CR3 which aren't part of the page table base, the PCID and the no-flush bit.
+#define CR3_ADDRESS_MASK 0x000FFFFFFFFFF000ULL
+
+struct Event_t
+{
+	uint64_t Tsc;
+	uint32_t Cpu;
+	uint32_t Command;
+	uint64_t Input;
+	uint64_t Output;
+	uint64_t CR3;
+	uint64_t ReturnAddress;
+};
+
+struct Stream_t
+{
+	TraceStreamHeader_t Header;
+	std::vector<Event_t> Events;
+};
+
+/*
+*	Name of a hypercall code, null for codes HyperDeceit doesn't know about.
+*/
+static const char* GetCommandName( uint32_t Command )
+{
+	switch ( Command )
+	{
+		case COMMAND_SLOW_FLUSH_ADDRESS_SPACE: return "SlowFlushAddressSpace";
+		case COMMAND_FAST_FLUSH_ADDRESS_SPACE: return "FastFlushAddressSpace";
+		case COMMAND_FLUSH_ADDRESS_LIST: return "FlushAddressList";
+		case COMMAND_FLUSH_ADDRESS_SPACE_EX: return "FlushAddressSpaceEx";
+		case COMMAND_FLUSH_ADDRESS_LIST_EX: return "FlushAddressListEx";
+		case COMMAND_ENTER_SLEEP_STATE: return "EnterSleepState";
+		case COMMAND_DEBUG_DEVICE_AVAILABLE: return "DebugDeviceAvailable";
+		case COMMAND_SWITCH_ADDRESS_SPACE: return "SwitchAddressSpace";
+		case COMMAND_LONG_SPIN_WAIT: return "LongSpinWait";
+	}
+
+	return 0;
+}
+
+/*
+*	Is the hypercall code any of the TLB flushes?
+*/
+static bool IsFlushCommand( uint32_t Command )
+{
+	switch ( Command & ~0x10000 )
+	{
+		case COMMAND_SLOW_FLUSH_ADDRESS_SPACE:
+		case COMMAND_FLUSH_ADDRESS_LIST:
+		case COMMAND_FLUSH_ADDRESS_SPACE_EX:
+		case COMMAND_FLUSH_ADDRESS_LIST_EX:
+			return true;
+	}
+
+	return false;
+}
+
+static std::string FormatCommand( uint32_t Command )
+{
+	const char* Name = GetCommandName( Command );
+	if ( Name )
+		return Name;
+
+	char Buffer[ 32 ];
+	snprintf( Buffer, sizeof( Buffer ), "Hypercall_0x%X", Command );
+	return Buffer;
+}
+
+/*
+*	Reads and validates a whole trace file, turning the delta encoded records into absolute events.
+*/
+static bool LoadTrace( const char* Path, TraceFileHeader_t* Header, std::vector<Stream_t>* Streams )
+{
+	FILE* File = fopen( Path, "rb" );
+	if ( !File )
+	{
+		fprintf( stderr, "Can't open %s\n", Path );
+		return false;
+	}
+
+	std::vector<uint8_t> Data;
+	uint8_t Chunk[ 0x10000 ];
+	for ( size_t Read; (Read = fread( Chunk, 1, sizeof( Chunk ), File )) != 0; )
+		Data.insert( Data.end( ), Chunk, Chunk + Read );
+
+	fclose( File );
+
+	if ( Data.size( ) < sizeof( TraceFileHeader_t ) )
+	{
+		fprintf( stderr, "Truncated file header\n" );
+		return false;
+	}
+
+	memcpy( Header, Data.data( ), sizeof( TraceFileHeader_t ) );
+	if ( Header->Magic != TRACE_FILE_MAGIC || Header->Version != TRACE_FILE_VERSION || Header->RecordSize < sizeof( TraceRecord_t ) )
+	{
+		fprintf( stderr, "Not a version %d trace\n", TRACE_FILE_VERSION );
+		return false;
+	}
+
+	size_t Offset = sizeof( TraceFileHeader_t );
+	for ( uint32_t i = 0; i < Header->CpuCount; i++ )
+	{
+		Stream_t Stream;
+		if ( Data.size( ) - Offset < sizeof( TraceStreamHeader_t ) )
+		{
+			fprintf( stderr, "Truncated stream header <%u>\n", i );
+			return false;
+		}
+
+		memcpy( &Stream.Header, &Data[ Offset ], sizeof( TraceStreamHeader_t ) );
+		Offset += sizeof( TraceStreamHeader_t );
+
+		if ( (Data.size( ) - Offset) / Header->RecordSize < Stream.Header.RecordCount )
+		{
+			fprintf( stderr, "Truncated stream <%u>\n", i );
+			return false;
+		}
+
+		uint64_t Tsc = 0;
+		bool Synced = false;
+		for ( uint32_t a = 0; a < Stream.Header.RecordCount; a++, Offset += Header->RecordSize )
+		{
+			TraceRecord_t Record;
+			memcpy( &Record, &Data[ Offset ], sizeof( TraceRecord_t ) );
+
+			if ( Record.Command == TRACE_COMMAND_SYNC )
+			{
+				Tsc = Record.Input;
+				Synced = true;
+				continue;
+			}
+
+			// Records before the first sync have nothing to be relative to, a writer bug.
+			if ( !Synced )
+				continue;
+
+			Tsc += Record.TscDelta;
+			Stream.Events.push_back( { Tsc, Stream.Header.Cpu, Record.Command & COMMAND_CODE_MASK, Record.Input, Record.Output, Record.CR3, Record.ReturnAddress } );
+		}
+
+		Streams->push_back( std::move( Stream ) );
+	}
+
+	return true;
+}
+
+/*
+*	Merges the per-processor streams, which are each already ordered, into one timeline.
+*/
+static std::vector<Event_t> MergeStreams( const std::vector<Stream_t>& Streams )
+{
+	typedef std::pair<uint64_t, std::pair<size_t, size_t>> Cursor_t; // Tsc, stream, index.
+	std::priority_queue<Cursor_t, std::vector<Cursor_t>, std::greater<Cursor_t>> Heap;
+
+	size_t Total = 0;
+	for ( size_t i = 0; i < Streams.size( ); i++ )
+	{
+		Total += Streams[ i ].Events.size( );
+		if ( !Streams[ i ].Events.empty( ) )
+			Heap.push( { Streams[ i ].Events[ 0 ].Tsc, { i, 0 } } );
+	}
+
+	std::vector<Event_t> Merged;
+	Merged.reserve( Total );
+
+	while ( !Heap.empty( ) )
+	{
+		Cursor_t Cursor = Heap.top( );
+		Heap.pop( );
+
+		const std::vector<Event_t>& Events = Streams[ Cursor.second.first ].Events;
+		Merged.push_back( Events[ Cursor.second.second ] );
+
+		size_t Next = Cursor.second.second + 1;
+		if ( Next < Events.size( ) )
+			Heap.push( { Events[ Next ].Tsc, { Cursor.second.first, Next } } );
+	}
+
+	return Merged;
+}
+
+static void PrintReport( const TraceFileHeader_t& Header, const std::vector<Stream_t>& Streams, const std::vector<Event_t>& Events, size_t TopProcesses )
+{
+	double Seconds = Header.TscFrequency ? double( Header.EndTsc - Header.StartTsc ) / double( Header.TscFrequency ) : 0;
+	double Rate = Seconds > 0 ? 1 / Seconds : 0;
+
+	uint64_t Lost = 0;
+	for ( const Stream_t& Stream : Streams )
+		Lost += Stream.Header.Lost;
+
+	printf( "Duration:    %.3f s (TSC %.3f MHz)\n", Seconds, Header.TscFrequency / 1e6 );
+	printf( "Processors:  %u\n", Header.CpuCount );
+	printf( "Events:      %zu (%llu lost to full buffers)\n\n", Events.size( ), (unsigned long long)Lost );
+
+	std::map<uint32_t, uint64_t> PerCommand;
+	std::map<uint64_t, uint64_t> FlushesPerProcess;
+	std::map<uint32_t, uint64_t> SwitchesPerCpu;
+
+	for ( const Event_t& Event : Events )
+	{
+		PerCommand[ Event.Command ]++;
+
+		if ( IsFlushCommand( Event.Command ) )
+			FlushesPerProcess[ Event.CR3 & CR3_ADDRESS_MASK ]++;
+		else if ( Event.Command == COMMAND_SWITCH_ADDRESS_SPACE )
+			SwitchesPerCpu[ Event.Cpu ]++;
+	}
+
+	printf( "%-28s %12s %12s\n", "Command", "Count", "Per second" );
+	for ( auto& Entry : PerCommand )
+		printf( "%-28s %12llu %12.1f\n", FormatCommand( Entry.first ).c_str( ), (unsigned long long)Entry.second, Entry.second * Rate );
+
+	// Processes are identified by their page table base.
+	std::vector<std::pair<uint64_t, uint64_t>> Processes( FlushesPerProcess.begin( ), FlushesPerProcess.end( ) );
+	std::sort( Processes.begin( ), Processes.end( ), []( auto& A, auto& B ) { return A.second > B.second; } );
+	if ( Processes.size( ) > TopProcesses )
+		Processes.resize( TopProcesses );
+
+	printf( "\n%-28s %12s %12s\n", "Flushes by CR3", "Count", "Per second" );
+	for ( auto& Entry : Processes )
+		printf( "0x%-26llx %12llu %12.1f\n", (unsigned long long)Entry.first, (unsigned long long)Entry.second, Entry.second * Rate );
+
+	printf( "\n%-28s %12s %12s\n", "CR3 switches by CPU", "Count", "Per second" );
+	for ( auto& Entry : SwitchesPerCpu )
+		printf( "%-28u %12llu %12.1f\n", Entry.first, (unsigned long long)Entry.second, Entry.second * Rate );
+}
+
+/*
+*	Writes every event as an instant event on its processor's track, in the Chrome trace event format.
+*/
+static bool WriteChromeTrace( const char* Path, const TraceFileHeader_t& Header, const std::vector<Event_t>& Events )
+{
+	FILE* File = fopen( Path, "w" );
+	if ( !File )
+	{
+		fprintf( stderr, "Can't create %s\n", Path );
+		return false;
+	}
+
+	double TicksPerUs = Header.TscFrequency ? Header.TscFrequency / 1e6 : 1;
+
+	fprintf( File, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+	for ( size_t i = 0; i < Events.size( ); i++ )
+	{
+		const Event_t& Event = Events[ i ];
+		fprintf( File, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+			"\"args\":{\"Input\":\"0x%llx\",\"Output\":\"0x%llx\",\"CR3\":\"0x%llx\",\"ReturnAddress\":\"0x%llx\"}}",
+			i ? ",\n" : "", FormatCommand( Event.Command ).c_str( ), Event.Cpu, (Event.Tsc - Header.StartTsc) / TicksPerUs,
+			(unsigned long long)Event.Input, (unsigned long long)Event.Output, (unsigned long long)Event.CR3, (unsigned long long)Event.ReturnAddress );
+	}
+
+	fprintf( File, "\n]}\n" );
+	fclose( File );
+	return true;
+}
+
+int main( int argc, char** argv )
+{
+	const char* TracePath = 0;
+	const char* ChromePath = 0;
+	size_t TopProcesses = 16;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp( argv[ i ], "--chrome" ) && i + 1 < argc )
+			ChromePath = argv[ ++i ];
+		else if ( !strcmp( argv[ i ], "--top" ) && i + 1 < argc )
+			TopProcesses = strtoul( argv[ ++i ], 0, 0 );
+		else if ( !TracePath )
+			TracePath = argv[ i ];
+		else
+			TracePath = 0, i = argc;
+	}
+
+	if ( !TracePath )
+	{
+		fprintf( stderr, "Usage: %s <trace.bin> [--chrome <out.json>] [--top <processes>]\n", argv[ 0 ] );
+		return 1;
+	}
+
+	TraceFileHeader_t Header;
+	std::vector<Stream_t> Streams;
+	if ( !LoadTrace( TracePath, &Header, &Streams ) )
+		return 1;
+
+	std::vector<Event_t> Events = MergeStreams( Streams );
+	PrintReport( Header, Streams, Events, TopProcesses );
+
+	if ( ChromePath && !WriteChromeTrace( ChromePath, Header, Events ) )
+		return 1;
+
+	return 0;
+}
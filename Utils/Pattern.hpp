@@ -0,0 +1,171 @@
+/*
+*		File name:
+*			Pattern.hpp
+*
+*		Use:
+*			Compile-time patterns built from IDA-style signatures.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+
+namespace Utils
+{
+	/*
+	*	Bytes which are very common in x64 kernel code, ordered from most to least common.
+	*	Anything not in here is considered rare, which makes it a good anchor for scanning.
+	*/
+	inline constexpr uint8_t CommonBytes[] =
+	{
+		0x00, 0xFF, 0x48, 0x8B, 0xCC, 0x89, 0x24, 0x4C, 0x0F, 0x44, 0x8D, 0xE8, 0x85, 0x83, 0x45, 0xC0,
+		0x84, 0x74, 0x01, 0x41, 0x49, 0x33, 0x08, 0x10, 0x20, 0x28, 0x30, 0x38, 0x40, 0x50, 0x90, 0x75,
+		0xC3, 0x4D, 0x66, 0xC7, 0x80, 0x02, 0x03, 0x04, 0x05, 0x15, 0x0D, 0x18, 0xF8, 0xC1, 0x8E, 0x87
+	};
+
+	/*
+	*	Returns how common a byte is, 0 being rare.
+	*/
+	constexpr uint32_t GetByteFrequency( _In_ uint8_t Byte )
+	{
+		for ( uint32_t i = 0; i < sizeof( CommonBytes ); i++ )
+		{
+			if ( CommonBytes[ i ] == Byte )
+				return sizeof( CommonBytes ) - i;
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Picks the 2 rarest non-wildcard bytes of the pattern, candidates are found by comparing
+	*	both of them at once. Returns false if the pattern consists of wildcards only.
+	*/
+	constexpr bool SelectAnchors( _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _Out_ uint32_t* First, _Out_ uint32_t* Second )
+	{
+		uint32_t Best = ~0u, Next = ~0u;
+		for ( uint32_t i = 0; i < Length; i++ )
+		{
+			if ( !Mask[ i ] )
+				continue;
+
+			if ( Best == ~0u || GetByteFrequency( Pattern[ i ] ) < GetByteFrequency( Pattern[ Best ] ) )
+			{
+				Next = Best;
+				Best = i;
+			}
+			else if ( Next == ~0u || GetByteFrequency( Pattern[ i ] ) < GetByteFrequency( Pattern[ Next ] ) )
+				Next = i;
+		}
+
+		*First = Best;
+		*Second = Next == ~0u ? Best : Next;
+		return Best != ~0u;
+	}
+
+	/*
+	*	Non-template view of a pattern, so patterns of different lengths can be stored together.
+	*/
+	struct PatternView
+	{
+		const uint8_t* Bytes;
+		const uint8_t* Mask;
+		uint32_t Length;
+	};
+
+	// Not constexpr on purpose, reaching any of these while building a pattern fails compilation.
+	void InvalidPatternCharacter( );
+	void EmptyPattern( );
+
+	/*
+	*	Pattern built at compile time from an IDA-style signature such as "48 8B 05 ? ? ? ?".
+	*	Holds the bytes, an explicit wildcard mask (so 0xCC can be matched like any other byte),
+	*	the scan anchors and a Boyer-Moore-Horspool skip table.
+	*/
+	template <int N>
+	struct Pattern
+	{
+		static_assert( N > 1 && N < 512, "Pattern too long" );
+
+		uint8_t Bytes[ N / 2 ];
+		uint8_t Mask[ N / 2 ];
+		uint32_t Length;
+		uint32_t FirstAnchor;
+		uint32_t SecondAnchor;
+		uint8_t Skip[ 256 ];
+
+		// Horspool only beats the vectorized scan if it can skip more than an AVX2 stride at a time.
+		bool PreferHorspool;
+
+		consteval Pattern( const char( &Ida )[ N ] ) : Bytes{}, Mask{}, Length{}, FirstAnchor{}, SecondAnchor{}, Skip{}, PreferHorspool{}
+		{
+			for ( int i = 0; i < N - 1; )
+			{
+				char c = Ida[ i ];
+				if ( c == ' ' )
+				{
+					i++;
+					continue;
+				}
+
+				// "?" and "??" are both wildcards.
+				if ( c == '?' )
+				{
+					Mask[ Length++ ] = 0x00;
+					i += Ida[ i + 1 ] == '?' ? 2 : 1;
+					continue;
+				}
+
+				if ( i + 1 >= N - 1 )
+					InvalidPatternCharacter( );
+
+				Bytes[ Length ] = uint8_t( (HexToNibble( c ) << 4) | HexToNibble( Ida[ i + 1 ] ) );
+				Mask[ Length++ ] = 0xFF;
+				i += 2;
+			}
+
+			if ( !SelectAnchors( Bytes, Mask, Length, &FirstAnchor, &SecondAnchor ) )
+				EmptyPattern( );
+
+			// The shift can never go past the last wildcard, since that matches any byte.
+			uint32_t DefaultSkip = Length;
+			for ( uint32_t i = 0; i + 1 < Length; i++ )
+			{
+				if ( !Mask[ i ] )
+					DefaultSkip = Length - 1 - i;
+			}
+
+			for ( uint32_t i = 0; i < 256; i++ )
+				Skip[ i ] = uint8_t( DefaultSkip );
+
+			for ( uint32_t i = 0; i + 1 < Length; i++ )
+			{
+				if ( Mask[ i ] && Length - 1 - i < DefaultSkip )
+					Skip[ Bytes[ i ] ] = uint8_t( Length - 1 - i );
+			}
+
+			PreferHorspool = DefaultSkip > 32;
+		}
+
+		constexpr PatternView View( ) const
+		{
+			return PatternView{ Bytes, Mask, Length };
+		}
+
+	private:
+		static consteval uint8_t HexToNibble( _In_ char c )
+		{
+			if ( c >= '0' && c <= '9' )
+				return uint8_t( c - '0' );
+			if ( c >= 'A' && c <= 'F' )
+				return uint8_t( c - 'A' + 10 );
+			if ( c >= 'a' && c <= 'f' )
+				return uint8_t( c - 'a' + 10 );
+
+			InvalidPatternCharacter( );
+			return 0;
+		}
+	};
+}
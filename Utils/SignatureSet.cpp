@@ -0,0 +1,282 @@
+/*
+*		File name:
+*			SignatureSet.cpp
+*
+*		Use:
+*			Resolves multiple signatures in a single pass over a PE module.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "SignatureSet.hpp"
+#include "Utils.hpp"
+
+namespace Utils
+{
+	/*
+	*	Registers a signature. Bytes with a mask of 0 are wildcards.
+	*/
+	uint32_t SignatureSet::Add( _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length )
+	{
+		// Signatures are hardcoded, so any of these is a bug.
+		if ( Count >= SIGNATURE_SET_MAX_SIGNATURES || !Length || Length > SIGNATURE_SET_MAX_LENGTH || Nodes )
+			PANIC( PANIC_UNSUPPORTED_STATEMENT, "Invalid signature <%d>", Count );
+
+		Signature_t* Signature = &Signatures[ Count ];
+		memset( Signature, 0, sizeof( Signature_t ) );
+		memcpy( Signature->Pattern, Pattern, Length );
+		memcpy( Signature->Mask, Mask, Length );
+		Signature->Length = Length;
+
+		// Find the longest run of non-wildcard bytes, that's what the automaton matches on.
+		for ( uint32_t i = 0; i < Length; )
+		{
+			if ( !Mask[ i ] )
+			{
+				i++;
+				continue;
+			}
+
+			uint32_t Start = i;
+			while ( i < Length && Mask[ i ] )
+				i++;
+
+			if ( i - Start > Signature->KeyLength )
+			{
+				Signature->KeyOffset = Start;
+				Signature->KeyLength = i - Start;
+			}
+		}
+
+		// Wildcards only, nothing to match on.
+		if ( !Signature->KeyLength )
+			PANIC( PANIC_UNSUPPORTED_STATEMENT, "Signature <%d> has no literal bytes", Count );
+
+		return Count++;
+	}
+
+	/*
+	*	Builds the automaton with all the transitions filled in, so scanning is a single table lookup per byte.
+	*/
+	bool SignatureSet::Build( )
+	{
+		uint32_t MaxNodes = 1;
+		for ( uint32_t i = 0; i < Count; i++ )
+			MaxNodes += Signatures[ i ].KeyLength;
+
+		Nodes = (Node_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, MaxNodes * sizeof( Node_t ) );
+		if ( !Nodes )
+			return false;
+
+		memset( Nodes, 0, MaxNodes * sizeof( Node_t ) );
+		NodeCount = 1;
+
+		// Insert the literal runs into the trie, node 0 is the root which is never a child.
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			Signature_t* Signature = &Signatures[ i ];
+			uint32_t Node = 0;
+
+			for ( uint32_t a = 0; a < Signature->KeyLength; a++ )
+			{
+				uint8_t Byte = Signature->Pattern[ Signature->KeyOffset + a ];
+				if ( !Nodes[ Node ].Next[ Byte ] )
+					Nodes[ Node ].Next[ Byte ] = uint16_t( NodeCount++ );
+
+				Node = Nodes[ Node ].Next[ Byte ];
+			}
+
+			Signature->NextSameKey = Nodes[ Node ].Output;
+			Nodes[ Node ].Output = uint16_t( i + 1 );
+		}
+
+		// Breadth first walk to set up the fail links and fill in the missing transitions.
+		uint16_t* Queue = (uint16_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, NodeCount * sizeof( uint16_t ) );
+		if ( !Queue )
+		{
+			ExFreePool( Nodes );
+			Nodes = 0;
+			return false;
+		}
+
+		uint32_t Head = 0, Tail = 0;
+		for ( uint32_t Byte = 0; Byte < 256; Byte++ )
+		{
+			if ( Nodes[ 0 ].Next[ Byte ] )
+				Queue[ Tail++ ] = Nodes[ 0 ].Next[ Byte ];
+		}
+
+		while ( Head < Tail )
+		{
+			uint16_t Node = Queue[ Head++ ];
+			uint16_t Fail = Nodes[ Node ].Fail;
+
+			for ( uint32_t Byte = 0; Byte < 256; Byte++ )
+			{
+				uint16_t Child = Nodes[ Node ].Next[ Byte ];
+				if ( !Child )
+				{
+					Nodes[ Node ].Next[ Byte ] = Nodes[ Fail ].Next[ Byte ];
+					continue;
+				}
+
+				uint16_t ChildFail = Nodes[ Fail ].Next[ Byte ];
+				Nodes[ Child ].Fail = ChildFail;
+				Nodes[ Child ].OutputLink = Nodes[ ChildFail ].Output ? ChildFail : Nodes[ ChildFail ].OutputLink;
+				Queue[ Tail++ ] = Child;
+			}
+		}
+
+		ExFreePool( Queue );
+		return true;
+	}
+
+	/*
+	*	Runs the automaton over a memory block and verifies every hit against the full signature.
+	*	For code blocks, which must start on an instruction, hits inside an instruction are skipped.
+	*/
+	void SignatureSet::ScanBlock( _In_ uint64_t Start, _In_ uint32_t Size, _In_ bool Code )
+	{
+		uint8_t* Data = (uint8_t*)Start;
+		uint32_t State = 0;
+
+		for ( uint32_t i = 0; i < Size && Remaining; i++ )
+		{
+			State = Nodes[ State ].Next[ Data[ i ] ];
+
+			// Walk every node on the fail chain which ends a literal run.
+			for ( uint32_t Node = Nodes[ State ].Output ? State : Nodes[ State ].OutputLink; Node; Node = Nodes[ Node ].OutputLink )
+			{
+				for ( uint32_t Index = Nodes[ Node ].Output; Index; Index = Signatures[ Index - 1 ].NextSameKey )
+				{
+					Signature_t* Signature = &Signatures[ Index - 1 ];
+					if ( Signature->Result )
+						continue;
+
+					// Does the whole signature fit inside the block?
+					uint32_t End = i + 1;
+					if ( End < Signature->KeyOffset + Signature->KeyLength )
+						continue;
+
+					uint32_t Offset = End - Signature->KeyOffset - Signature->KeyLength;
+					if ( Signature->Length > Size - Offset )
+						continue;
+
+					uint32_t a = 0;
+					for ( ; a < Signature->Length; a++ )
+					{
+						if ( (Data[ Offset + a ] ^ Signature->Pattern[ a ]) & Signature->Mask[ a ] )
+							break;
+					}
+
+					if ( a != Signature->Length )
+						continue;
+
+					if ( Code && !IsInstructionBoundary( Start, Start + Offset ) )
+						continue;
+
+					Signature->Result = Start + Offset;
+					Remaining--;
+				}
+			}
+		}
+	}
+
+	/*
+	*	Validates the module, builds the automaton if needed and counts the unresolved signatures.
+	*/
+	bool SignatureSet::Prepare( _In_ uint64_t Base )
+	{
+		// Basic sanity checks.
+		if ( !Base || PIMAGE_DOS_HEADER( Base )->e_magic != IMAGE_DOS_SIGNATURE )
+			return false;
+
+		if ( NTHEADER( Base )->Signature != IMAGE_NT_SIGNATURE )
+			return false;
+
+		if ( !Nodes && !Build( ) )
+			return false;
+
+		Remaining = 0;
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			if ( !Signatures[ i ].Result )
+				Remaining++;
+		}
+
+		return true;
+	}
+
+	/*
+	*	Scans all non-discardable sections of a PE module once, resolving every signature.
+	*	Returns false if the module is invalid or the automaton could not be built.
+	*/
+	bool SignatureSet::Scan( _In_ uint64_t Base )
+	{
+		if ( !Prepare( Base ) )
+			return false;
+
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( Base );
+		PIMAGE_SECTION_HEADER SectionHeader = IMAGE_FIRST_SECTION( NT );
+		for ( int i = 0; i < NT->FileHeader.NumberOfSections && Remaining; i++, SectionHeader++ )
+		{
+			// Discardable sections are invalidated, so we should ignore them.
+			if ( SectionHeader->Characteristics & IMAGE_SCN_MEM_DISCARDABLE )
+				continue;
+
+			ScanBlock( Base + SectionHeader->VirtualAddress, SectionHeader->Misc.VirtualSize, false );
+		}
+
+		return true;
+	}
+
+	/*
+	*	Scans only the functions listed in the module's .pdata, optionally limited to the functions
+	*	starting in [Start, End). Every signature is code, so data and discardable sections are never
+	*	examined and matches which do not start on an instruction boundary are rejected.
+	*	Returns false if the module is invalid, has no exception directory or the automaton could not be built.
+	*/
+	bool SignatureSet::ScanFunctions( _In_ uint64_t Base, _In_opt_ uint64_t Start, _In_opt_ uint64_t End )
+	{
+		if ( !Prepare( Base ) )
+			return false;
+
+		RUNTIME_FUNCTION* Functions;
+		uint32_t FunctionCount;
+		if ( !GetExceptionTable( Base, &Functions, &FunctionCount ) )
+			return false;
+
+		SectionWalk_t Walk;
+		BeginSectionWalk( Base, &Walk );
+
+		for ( uint32_t i = 0; i < FunctionCount && Remaining; i++ )
+		{
+			uint64_t FunctionStart = Base + Functions[ i ].FunctionStart;
+			if ( FunctionStart < Start || (End && FunctionStart >= End) )
+				continue;
+
+			// Discardable sections are invalidated, so we should ignore them.
+			if ( IsDiscardableRva( &Walk, Functions[ i ].FunctionStart ) )
+				continue;
+
+			ScanBlock( FunctionStart, Functions[ i ].FunctionEnd - Functions[ i ].FunctionStart, true );
+		}
+
+		return true;
+	}
+
+	/*
+	*	Frees the automaton and forgets all signatures.
+	*/
+	void SignatureSet::Destroy( )
+	{
+		if ( Nodes )
+			ExFreePool( Nodes );
+
+		Nodes = 0;
+		NodeCount = 0;
+		Count = 0;
+		Remaining = 0;
+	}
+}
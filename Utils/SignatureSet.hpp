@@ -0,0 +1,101 @@
+/*
+*		File name:
+*			SignatureSet.hpp
+*
+*		Use:
+*			Resolves multiple signatures in a single pass over a PE module.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "Pattern.hpp"
+
+#define SIGNATURE_SET_MAX_SIGNATURES 16
+#define SIGNATURE_SET_MAX_LENGTH 64
+
+namespace Utils
+{
+	/*
+	*	Aho-Corasick automaton over the longest literal run of every signature, matches of the
+	*	literal run are then verified against the whole signature including the wildcards.
+	*	Register everything with Add, then Scan resolves all of them in one sweep.
+	*/
+	class SignatureSet
+	{
+	private:
+		struct Signature_t
+		{
+			uint8_t Pattern[ SIGNATURE_SET_MAX_LENGTH ];
+			uint8_t Mask[ SIGNATURE_SET_MAX_LENGTH ];
+			uint32_t Length;
+			uint32_t KeyOffset;
+			uint32_t KeyLength;
+			uint32_t NextSameKey;	// Index + 1 of the next signature ending on the same node.
+			uint64_t Result;
+		};
+
+		struct Node_t
+		{
+			uint16_t Next[ 256 ];
+			uint16_t Fail;
+			uint16_t Output;		// Index + 1 of the first signature ending on this node.
+			uint16_t OutputLink;	// Closest node on the fail chain which has an output.
+		};
+
+		Signature_t Signatures[ SIGNATURE_SET_MAX_SIGNATURES ];
+		uint32_t Count;
+		uint32_t Remaining;
+
+		Node_t* Nodes;
+		uint32_t NodeCount;
+
+		bool Build( );
+		void ScanBlock( _In_ uint64_t Start, _In_ uint32_t Size, _In_ bool Code );
+		bool Prepare( _In_ uint64_t Base );
+
+	public:
+		uint32_t Add( _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length );
+		bool Scan( _In_ uint64_t Base );
+		bool ScanFunctions( _In_ uint64_t Base, _In_opt_ uint64_t Start = 0, _In_opt_ uint64_t End = 0 );
+		void Destroy( );
+
+		/*
+		*	Adds a signature, the 0xCC byte is used as a wildcard.
+		*	Returns the index used to get the result after scanning.
+		*/
+		template <int T>
+		uint32_t Add( _In_ const char( &CPattern )[ T ] )
+		{
+			uint8_t Mask[ T - 1 ];
+			for ( int i = 0; i < T - 1; i++ )
+				Mask[ i ] = uint8_t( CPattern[ i ] ) == 0xCC ? 0x00 : 0xFF;
+
+			return Add( (const uint8_t*)CPattern, Mask, T - 1 );
+		}
+
+		/*
+		*	Adds a compile-time pattern.
+		*/
+		template <int N>
+		uint32_t Add( _In_ const Pattern<N>& Sig )
+		{
+			return Add( Sig.Bytes, Sig.Mask, Sig.Length );
+		}
+
+		uint32_t Add( _In_ const PatternView& Sig )
+		{
+			return Add( Sig.Bytes, Sig.Mask, Sig.Length );
+		}
+
+		/*
+		*	Gets the address of the first match of the signature, 0 if not found.
+		*/
+		uint64_t Result( _In_ uint32_t Index )
+		{
+			return Index < Count ? Signatures[ Index ].Result : 0;
+		}
+	};
+}
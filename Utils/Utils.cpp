@@ -10,51 +10,1045 @@
 */
 
 #include "Utils.hpp"
+#include "..\Misc\HDE\HDE64.hpp"
 
 namespace Utils
 {
+	// Saving the AVX state has a cost of its own, so only bother with it for bigger blocks.
+	#define AVX2_MIN_SEARCH_SIZE 0x4000
+
+	// Roughly the size of a L2 cache.
+	#define PARALLEL_SCAN_CHUNK_SIZE 0x40000
+
+	struct ParallelScan_t
+	{
+		uint64_t Base;
+		PIMAGE_SECTION_HEADER Sections;
+		const void* Pattern;
+		uint32_t Length;
+		ChunkScanner_t Scanner;
+		bool Pageable;				// Which sections the chunks come from, see FindPatternChunked.
+		uint32_t ChunkCount;
+		volatile long NextChunk;
+		volatile LONG64 Result;		// Lowest match so far, -1 if none.
+	};
+
+	struct DpcDispatch_t
+	{
+		void( *Worker )( void* Context );
+		void* Context;
+	};
+
+	#define MAX_INDEXED_MODULES 4
+
+	struct ExportEntry_t
+	{
+		uint64_t Hash;		// 0 if the slot is free.
+		uint32_t Rva;		// 0 if the hash is ambiguous, or the export is forwarded.
+		uint32_t Reserved;
+	};
+
+	struct ModuleIndex_t
+	{
+		uint64_t Base;
+		uint32_t SizeOfImage;
+
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		uint32_t* PageStart;	// Index of the first function ending past the start of each page.
+		uint32_t* NextFragment;	// Circular list of the entries of every logical function, in address order.
+
+		ExportEntry_t* Exports;	// Open addressing, linear probing.
+		uint32_t ExportMask;
+	};
+
+	ModuleIndex_t ModuleIndices[ MAX_INDEXED_MODULES ];
+
+	static bool BuildFragmentIndex( _Inout_ ModuleIndex_t* Index );
+
 	/*
-	*	Get function information from SEH data.
+	*	Checks if the data matches the pattern, 16 bytes at a time.
+	*/
+	static bool MatchMasked( _In_ const uint8_t* Data, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length )
+	{
+		uint32_t i = 0;
+		for ( ; i + 16 <= Length; i += 16 )
+		{
+			__m128i Diff = _mm_xor_si128( _mm_loadu_si128( (const __m128i*)(Data + i) ), _mm_loadu_si128( (const __m128i*)(Pattern + i) ) );
+			Diff = _mm_and_si128( Diff, _mm_loadu_si128( (const __m128i*)(Mask + i) ) );
+
+			if ( _mm_movemask_epi8( _mm_cmpeq_epi8( Diff, _mm_setzero_si128( ) ) ) != 0xFFFF )
+				return false;
+		}
+
+		for ( ; i < Length; i++ )
+		{
+			if ( (Data[ i ] ^ Pattern[ i ]) & Mask[ i ] )
+				return false;
+		}
+
+		return true;
+	}
+
+	/*
+	*	Checks if the processor and the OS support AVX2.
+	*/
+	static bool IsAvx2Supported( )
+	{
+		static int Supported = -1;
+		if ( Supported != -1 )
+			return Supported;
+
+		int Regs[ 4 ]{};
+		__cpuid( Regs, 0 );
+		if ( Regs[ 0 ] < 7 )
+			return Supported = false;
+
+		// CPUID.1:ECX.OSXSAVE + CPUID.1:ECX.AVX, and XCR0 must have the SSE and AVX state enabled.
+		__cpuid( Regs, 1 );
+		if ( !(Regs[ 2 ] & (1 << 27)) || !(Regs[ 2 ] & (1 << 28)) || (_xgetbv( 0 ) & 6) != 6 )
+			return Supported = false;
+
+		// CPUID.7.0:EBX.AVX2
+		__cpuidex( Regs, 7, 0 );
+		return Supported = (Regs[ 1 ] & (1 << 5)) != 0;
+	}
+
+	/*
+	*	Finds candidates 16 bytes at a time by comparing both anchors, and verifies them.
+	*/
+	static uint64_t ScanSSE2( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ uint32_t First, _In_ uint32_t Second )
+	{
+		uint8_t* Data = (uint8_t*)SearchStart;
+		uint32_t Last = SearchSize - Length;
+		__m128i FirstByte = _mm_set1_epi8( char( Pattern[ First ] ) );
+		__m128i SecondByte = _mm_set1_epi8( char( Pattern[ Second ] ) );
+
+		uint32_t Offset = 0;
+		for ( ; Offset + 16 <= Last + 1; Offset += 16 )
+		{
+			__m128i Hits = _mm_and_si128(
+				_mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)(Data + Offset + First) ), FirstByte ),
+				_mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)(Data + Offset + Second) ), SecondByte ) );
+
+			uint32_t Candidates = uint32_t( _mm_movemask_epi8( Hits ) );
+			while ( Candidates )
+			{
+				unsigned long Bit;
+				_BitScanForward( &Bit, Candidates );
+
+				if ( MatchMasked( Data + Offset + Bit, Pattern, Mask, Length ) )
+					return uint64_t( Data + Offset + Bit );
+
+				Candidates &= Candidates - 1;
+			}
+		}
+
+		// Scan whatever is left over.
+		return FindPatternScalar( SearchStart + Offset, SearchSize - Offset, Pattern, Mask, Length );
+	}
+
+	/*
+	*	Same as ScanSSE2, but 32 bytes at a time.
+	*	The caller is responsible for saving the AVX state.
+	*/
+	static uint64_t ScanAVX2( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ uint32_t First, _In_ uint32_t Second )
+	{
+		uint8_t* Data = (uint8_t*)SearchStart;
+		uint32_t Last = SearchSize - Length;
+		__m256i FirstByte = _mm256_set1_epi8( char( Pattern[ First ] ) );
+		__m256i SecondByte = _mm256_set1_epi8( char( Pattern[ Second ] ) );
+
+		uint32_t Offset = 0;
+		for ( ; Offset + 32 <= Last + 1; Offset += 32 )
+		{
+			__m256i Hits = _mm256_and_si256(
+				_mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)(Data + Offset + First) ), FirstByte ),
+				_mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)(Data + Offset + Second) ), SecondByte ) );
+
+			uint32_t Candidates = uint32_t( _mm256_movemask_epi8( Hits ) );
+			while ( Candidates )
+			{
+				unsigned long Bit;
+				_BitScanForward( &Bit, Candidates );
+
+				if ( MatchMasked( Data + Offset + Bit, Pattern, Mask, Length ) )
+				{
+					_mm256_zeroupper( );
+					return uint64_t( Data + Offset + Bit );
+				}
+
+				Candidates &= Candidates - 1;
+			}
+		}
+
+		_mm256_zeroupper( );
+		return FindPatternScalar( SearchStart + Offset, SearchSize - Offset, Pattern, Mask, Length );
+	}
+
+	/*
+	*	Search for a pattern in a memory block, one byte at a time.
+	*	Bytes with a mask of 0 are wildcards, 0xFF means the byte has to match.
+	*/
+	uint64_t FindPatternScalar( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length )
+	{
+		if ( !Length || Length > SearchSize )
+			return 0;
+
+		uint8_t* Data = (uint8_t*)SearchStart;
+		for ( uint32_t Offset = 0; Offset <= SearchSize - Length; Offset++ )
+		{
+			uint32_t i = 0;
+			for ( ; i < Length; i++ )
+			{
+				if ( (Data[ Offset + i ] ^ Pattern[ i ]) & Mask[ i ] )
+					break;
+			}
+
+			if ( i == Length )
+				return uint64_t( Data + Offset );
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Checks if the pattern matches at the address, the caller must make sure the memory is valid.
+	*/
+	bool IsPatternAt( _In_ uint64_t Address, _In_ const PatternView& Pattern )
+	{
+		if ( !Address || !Pattern.Length )
+			return false;
+
+		return MatchMasked( (const uint8_t*)Address, Pattern.Bytes, Pattern.Mask, Pattern.Length );
+	}
+
+	/*
+	*	Search for a pattern in a memory block using SSE2, or AVX2 if available.
+	*	Bytes with a mask of 0 are wildcards, 0xFF means the byte has to match.
+	*/
+	uint64_t FindPatternMasked( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length )
+	{
+		if ( !SearchStart || !Length || Length > SearchSize )
+			return 0;
+
+		// Nothing to anchor on, so the very first byte matches.
+		uint32_t First, Second;
+		if ( !SelectAnchors( Pattern, Mask, Length, &First, &Second ) )
+			return SearchStart;
+
+		return FindPatternAnchored( SearchStart, SearchSize, Pattern, Mask, Length, First, Second );
+	}
+
+	/*
+	*	Same as FindPatternMasked, but with the anchors already picked out, see SelectAnchors.
+	*/
+	uint64_t FindPatternAnchored( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ uint32_t First, _In_ uint32_t Second )
+	{
+		if ( !SearchStart || !Length || Length > SearchSize )
+			return 0;
+
+		if ( SearchSize >= AVX2_MIN_SEARCH_SIZE && KeGetCurrentIrql( ) <= DISPATCH_LEVEL && IsAvx2Supported( ) )
+		{
+			XSTATE_SAVE State;
+			if ( NT_SUCCESS( KeSaveExtendedProcessorState( XSTATE_MASK_AVX, &State ) ) )
+			{
+				uint64_t Result = ScanAVX2( SearchStart, SearchSize, Pattern, Mask, Length, First, Second );
+				KeRestoreExtendedProcessorState( &State );
+				return Result;
+			}
+		}
+
+		return ScanSSE2( SearchStart, SearchSize, Pattern, Mask, Length, First, Second );
+	}
+
+	/*
+	*	Boyer-Moore-Horspool search, the skip table is indexed by the last byte of the current window.
+	*	Bytes with a mask of 0 are wildcards, 0xFF means the byte has to match.
+	*/
+	uint64_t FindPatternHorspool( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ const uint8_t* Skip )
+	{
+		if ( !SearchStart || !Length || Length > SearchSize )
+			return 0;
+
+		uint8_t* Data = (uint8_t*)SearchStart;
+		for ( uint32_t Offset = 0; Offset <= SearchSize - Length; Offset += Skip[ Data[ Offset + Length - 1 ] ] )
+		{
+			if ( MatchMasked( Data + Offset, Pattern, Mask, Length ) )
+				return uint64_t( Data + Offset );
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Gets the number of chunks a section is split into for parallel scanning,
+	*	0 unless the section is pageable or non-paged as asked for.
+	*/
+	static uint32_t GetSectionChunkCount( _In_ PIMAGE_SECTION_HEADER Section, _In_ bool Pageable )
+	{
+		// Discardable sections are invalidated, so we should ignore them.
+		if ( Section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE )
+			return 0;
+
+		if ( !(Section->Characteristics & IMAGE_SCN_MEM_NOT_PAGED) != Pageable )
+			return 0;
+
+		return (Section->Misc.VirtualSize + PARALLEL_SCAN_CHUNK_SIZE - 1) / PARALLEL_SCAN_CHUNK_SIZE;
+	}
+
+	/*
+	*	Grabs chunks and scans them until there are none left, or a lower match was found.
+	*/
+	static void ParallelScanWorker( _In_ void* Context )
+	{
+		ParallelScan_t* Scan = (ParallelScan_t*)Context;
+
+		for ( ;; )
+		{
+			uint32_t Index = uint32_t( InterlockedIncrement( &Scan->NextChunk ) - 1 );
+			if ( Index >= Scan->ChunkCount )
+				return;
+
+			// Find the section the chunk belongs to.
+			PIMAGE_SECTION_HEADER Section = Scan->Sections;
+			for ( uint32_t Chunks; Index >= (Chunks = GetSectionChunkCount( Section, Scan->Pageable )); Section++ )
+				Index -= Chunks;
+
+			uint32_t Offset = Index * PARALLEL_SCAN_CHUNK_SIZE;
+			uint64_t Start = Scan->Base + Section->VirtualAddress + Offset;
+
+			// Chunks are handed out in ascending order, so every chunk left is above the match.
+			if ( Start >= uint64_t( Scan->Result ) )
+				return;
+
+			// Overlap into the next chunk so matches crossing the boundary are not missed.
+			uint32_t Size = Section->Misc.VirtualSize - Offset;
+			if ( Size > PARALLEL_SCAN_CHUNK_SIZE + Scan->Length - 1 )
+				Size = PARALLEL_SCAN_CHUNK_SIZE + Scan->Length - 1;
+
+			uint64_t Address = Scan->Scanner( Start, Size, Scan->Pattern );
+			if ( !Address )
+				continue;
+
+			// Keep the lowest match.
+			LONG64 Current = Scan->Result;
+			while ( Address < uint64_t( Current ) )
+			{
+				LONG64 Previous = InterlockedCompareExchange64( &Scan->Result, LONG64( Address ), Current );
+				if ( Previous == Current )
+					break;
+
+				Current = Previous;
+			}
+		}
+	}
+
+	/*
+	*	DPC routine for KeGenericCallDpc, runs the worker on the current processor.
+	*/
+	static void DispatchDpcRoutine( _In_ PKDPC Dpc, _In_ PVOID DeferredContext, _In_ PVOID SystemArgument1, _In_ PVOID SystemArgument2 )
+	{
+		UNREFERENCED_PARAMETER( Dpc );
+
+		DpcDispatch_t* Dispatch = (DpcDispatch_t*)DeferredContext;
+		Dispatch->Worker( Dispatch->Context );
+
+		KeSignalCallDpcSynchronize( SystemArgument2 );
+		KeSignalCallDpcDone( SystemArgument1 );
+	}
+
+	/*
+	*	Runs the worker on every processor with a DPC, and waits for all of them to finish.
+	*/
+	void DispatchOnAllProcessors( _In_ void( *Worker )( void* Context ), _In_ void* Context )
+	{
+		DpcDispatch_t Dispatch{ Worker, Context };
+		KeGenericCallDpc( DispatchDpcRoutine, &Dispatch );
+	}
+
+	/*
+	*	Counts the chunks of every section the scan is currently after.
+	*/
+	static uint32_t GetScanChunkCount( _In_ const ParallelScan_t* Scan, _In_ uint32_t SectionCount )
+	{
+		uint32_t ChunkCount = 0;
+		for ( uint32_t i = 0; i < SectionCount; i++ )
+			ChunkCount += GetSectionChunkCount( &Scan->Sections[ i ], Scan->Pageable );
+
+		return ChunkCount;
+	}
+
+	/*
+	*	Scans all non-discardable sections of a PE module in chunks. The non-paged sections are spread
+	*	over all processors, the pageable ones are scanned on the calling thread.
+	*	Returns the lowest match, same as a sequential scan would.
+	*/
+	uint64_t FindPatternChunked( _In_ uint64_t Base, _In_ const void* Pattern, _In_ uint32_t Length, _In_ ChunkScanner_t Scanner, _In_opt_ ScanDispatcher_t Dispatcher )
+	{
+		// Basic sanity checks.
+		if ( !Base || !Length || PIMAGE_DOS_HEADER( Base )->e_magic != IMAGE_DOS_SIGNATURE )
+			return 0;
+
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( Base );
+		if ( NT->Signature != IMAGE_NT_SIGNATURE )
+			return 0;
+
+		ParallelScan_t Scan{};
+		Scan.Base = Base;
+		Scan.Sections = IMAGE_FIRST_SECTION( NT );
+		Scan.Pattern = Pattern;
+		Scan.Length = Length;
+		Scan.Scanner = Scanner;
+		Scan.Result = -1;
+		Scan.ChunkCount = GetScanChunkCount( &Scan, NT->FileHeader.NumberOfSections );
+
+		// DPCs can't be waited on above passive level, so just scan on this processor then.
+		if ( !Dispatcher && KeGetCurrentIrql( ) == PASSIVE_LEVEL && KeQueryActiveProcessorCountEx( ALL_PROCESSOR_GROUPS ) > 1 )
+			Dispatcher = DispatchOnAllProcessors;
+
+		if ( Dispatcher )
+			Dispatcher( ParallelScanWorker, &Scan );
+		else
+			ParallelScanWorker( &Scan );
+
+		// The workers run at DISPATCH_LEVEL where a page fault is fatal, so the pageable sections (PAGE*) are
+		// left to this thread. The worker keeps whichever of the two matches is lower.
+		Scan.Pageable = true;
+		Scan.NextChunk = 0;
+		Scan.ChunkCount = GetScanChunkCount( &Scan, NT->FileHeader.NumberOfSections );
+		ParallelScanWorker( &Scan );
+
+		return Scan.Result == -1 ? 0 : uint64_t( Scan.Result );
+	}
+
+	/*
+	*	Gets the exception directory of a module, which is sorted by FunctionStart.
+	*/
+	bool GetExceptionTable( _In_ uint64_t Base, _Out_ RUNTIME_FUNCTION** Functions, _Out_ uint32_t* Count )
+	{
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( Base );
+		PIMAGE_DATA_DIRECTORY ExceptionDirectory = &NT->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXCEPTION ];
+
+		// Exception data not present?
+		if (!ExceptionDirectory->VirtualAddress || ExceptionDirectory->Size < sizeof( RUNTIME_FUNCTION ))
+			return false;
+
+		*Functions = (RUNTIME_FUNCTION*)(Base + ExceptionDirectory->VirtualAddress);
+		*Count = ExceptionDirectory->Size / sizeof( RUNTIME_FUNCTION );
+		return true;
+	}
+
+	/*
+	*	Starts a walk over the sections of a module, see IsDiscardableRva.
+	*/
+	void BeginSectionWalk( _In_ uint64_t Base, _Out_ SectionWalk_t* Walk )
+	{
+		PIMAGE_NT_HEADERS64 NT = NTHEADER( Base );
+		Walk->Section = IMAGE_FIRST_SECTION( NT );
+		Walk->End = Walk->Section + NT->FileHeader.NumberOfSections;
+	}
+
+	/*
+	*	Checks if an RVA lies in a discardable section, whose pages are freed once the module is initialized.
+	*	RVAs outside of every section count as discardable too, nothing says they are mapped.
+	*	The RVAs have to be ascending, such as the .pdata entries in order, so the section headers
+	*	are only walked once for a whole sweep.
+	*/
+	bool IsDiscardableRva( _Inout_ SectionWalk_t* Walk, _In_ uint32_t Rva )
+	{
+		while (Walk->Section < Walk->End && Rva >= Walk->Section->VirtualAddress + Walk->Section->Misc.VirtualSize)
+			Walk->Section++;
+
+		if (Walk->Section == Walk->End || Rva < Walk->Section->VirtualAddress)
+			return true;
+
+		return (Walk->Section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE) != 0;
+	}
+
+	/*
+	*	Binary search for the function containing the RVA.
+	*/
+	static RUNTIME_FUNCTION* SearchExceptionTable( _In_ RUNTIME_FUNCTION* Functions, _In_ uint32_t Count, _In_ uint32_t Rva )
+	{
+		// Find the first function ending past the RVA.
+		uint32_t Low = 0, High = Count;
+		while (Low < High)
+		{
+			uint32_t Middle = Low + (High - Low) / 2;
+			if (Functions[ Middle ].FunctionEnd <= Rva)
+				Low = Middle + 1;
+			else
+				High = Middle;
+		}
+
+		if (Low < Count && Functions[ Low ].FunctionStart <= Rva)
+			return &Functions[ Low ];
+
+		return 0;
+	}
+
+	/*
+	*	Gets the index of a module, null if it was not indexed.
+	*/
+	static ModuleIndex_t* GetModuleIndex( _In_ uint64_t Base )
+	{
+		for (uint32_t i = 0; i < MAX_INDEXED_MODULES; i++)
+		{
+			if (Base && ModuleIndices[ i ].Base == Base)
+				return &ModuleIndices[ i ];
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Builds the page to function table of a module index.
+	*/
+	static bool BuildFunctionIndex( _Inout_ ModuleIndex_t* Index )
+	{
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		if (!GetExceptionTable( Index->Base, &Functions, &Count ))
+			return false;
+
+		uint32_t PageCount = (Index->SizeOfImage + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		uint32_t* PageStart = (uint32_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, PageCount * sizeof( uint32_t ) );
+		if (!PageStart)
+			return false;
+
+		for (uint32_t Page = 0, i = 0; Page < PageCount; Page++)
+		{
+			while (i < Count && Functions[ i ].FunctionEnd <= (Page << PAGE_SHIFT))
+				i++;
+
+			PageStart[ Page ] = i;
+		}
+
+		Index->Functions = Functions;
+		Index->Count = Count;
+		Index->PageStart = PageStart;
+		return true;
+	}
+
+	/*
+	*	Inserts an export into the hash table, a hash seen twice is marked as ambiguous.
+	*/
+	static void InsertExport( _Inout_ ModuleIndex_t* Index, _In_ uint64_t Hash, _In_ uint32_t Rva )
+	{
+		for (uint32_t Slot = uint32_t( Hash ) & Index->ExportMask;; Slot = (Slot + 1) & Index->ExportMask)
+		{
+			ExportEntry_t* Entry = &Index->Exports[ Slot ];
+			if (Entry->Hash == Hash)
+			{
+				Entry->Rva = 0;
+				return;
+			}
+
+			if (!Entry->Hash)
+			{
+				Entry->Hash = Hash;
+				Entry->Rva = Rva;
+				return;
+			}
+		}
+	}
+
+	/*
+	*	Builds the export hash table of a module index, no names are stored.
+	*/
+	static bool BuildExportIndex( _Inout_ ModuleIndex_t* Index )
+	{
+		PIMAGE_DATA_DIRECTORY ExportDirectory = &NTHEADER( Index->Base )->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXPORT ];
+		if (!ExportDirectory->VirtualAddress || !ExportDirectory->Size)
+			return false;
+
+		PIMAGE_EXPORT_DIRECTORY Exports = (PIMAGE_EXPORT_DIRECTORY)(Index->Base + ExportDirectory->VirtualAddress);
+		uint32_t* Names = (uint32_t*)(Index->Base + Exports->AddressOfNames);
+		uint16_t* Ordinals = (uint16_t*)(Index->Base + Exports->AddressOfNameOrdinals);
+		uint32_t* Functions = (uint32_t*)(Index->Base + Exports->AddressOfFunctions);
+
+		// Keep the load factor under 2/3 so probe chains stay short.
+		uint32_t Capacity = 16;
+		while (Capacity * 2 < Exports->NumberOfNames * 3)
+			Capacity <<= 1;
+
+		Index->Exports = (ExportEntry_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Capacity * sizeof( ExportEntry_t ) );
+		if (!Index->Exports)
+			return false;
+
+		memset( Index->Exports, 0, Capacity * sizeof( ExportEntry_t ) );
+		Index->ExportMask = Capacity - 1;
+
+		for (uint32_t i = 0; i < Exports->NumberOfNames; i++)
+		{
+			uint32_t Rva = Ordinals[ i ] < Exports->NumberOfFunctions ? Functions[ Ordinals[ i ] ] : 0;
+
+			// Forwarders point to a string inside the export directory, not to code.
+			if (Rva >= ExportDirectory->VirtualAddress && Rva - ExportDirectory->VirtualAddress < ExportDirectory->Size)
+				Rva = 0;
+
+			InsertExport( Index, HashExportString( (const char*)(Index->Base + Names[ i ]) ), Rva );
+		}
+
+		return true;
+	}
+
+	/*
+	*	Frees whatever parts of a module index were built and clears its slot.
+	*/
+	static void FreeModuleIndex( _Inout_ ModuleIndex_t* Index )
+	{
+		if (Index->PageStart)
+			ExFreePool( Index->PageStart );
+
+		if (Index->NextFragment)
+			ExFreePool( Index->NextFragment );
+
+		if (Index->Exports)
+			ExFreePool( Index->Exports );
+
+		memset( Index, 0, sizeof( ModuleIndex_t ) );
+	}
+
+	/*
+	*	Builds a page to function index and an export hash table for a module, so lookups inside
+	*	it skip RtlPcToFileHeader, the binary search and string compares. Meant to be called during initialization.
+	*/
+	bool IndexModule( _In_ uint64_t Base )
+	{
+		if (!Base || GetModuleIndex( Base ))
+			return Base != 0;
+
+		ModuleIndex_t* Index = 0;
+		for (uint32_t i = 0; i < MAX_INDEXED_MODULES && !Index; i++)
+		{
+			if (!ModuleIndices[ i ].Base)
+				Index = &ModuleIndices[ i ];
+		}
+
+		if (!Index)
+			return false;
+
+		Index->Base = Base;
+		Index->SizeOfImage = NTHEADER( Base )->OptionalHeader.SizeOfImage;
+
+		bool Functions = BuildFunctionIndex( Index ) && BuildFragmentIndex( Index );
+		bool Exports = BuildExportIndex( Index );
+		if (!Functions && !Exports)
+		{
+			// The function index may be half built, with the fragment index missing.
+			FreeModuleIndex( Index );
+			return false;
+		}
+
+		return true;
+	}
+
+	/*
+	*	Frees every index built by IndexModule.
+	*/
+	void DestroyModuleIndices( )
+	{
+		for (uint32_t i = 0; i < MAX_INDEXED_MODULES; i++)
+			FreeModuleIndex( &ModuleIndices[ i ] );
+	}
+
+	/*
+	*	Gets the address of an export by the hash of its name, see HashExportName.
+	*	Uses the index if the module has one, otherwise hashes every name.
+	*/
+	uint64_t FindExport( _In_ uint64_t Base, _In_ uint64_t Hash )
+	{
+		if (!Base || !Hash)
+			return 0;
+
+		ModuleIndex_t* Index = GetModuleIndex( Base );
+		if (Index && Index->Exports)
+		{
+			for (uint32_t Slot = uint32_t( Hash ) & Index->ExportMask;; Slot = (Slot + 1) & Index->ExportMask)
+			{
+				ExportEntry_t* Entry = &Index->Exports[ Slot ];
+				if (!Entry->Hash)
+					return 0;
+
+				if (Entry->Hash == Hash)
+					return Entry->Rva ? Base + Entry->Rva : 0;
+			}
+		}
+
+		PIMAGE_DATA_DIRECTORY ExportDirectory = &NTHEADER( Base )->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXPORT ];
+		if (!ExportDirectory->VirtualAddress || !ExportDirectory->Size)
+			return 0;
+
+		PIMAGE_EXPORT_DIRECTORY Exports = (PIMAGE_EXPORT_DIRECTORY)(Base + ExportDirectory->VirtualAddress);
+		uint32_t* Names = (uint32_t*)(Base + Exports->AddressOfNames);
+		uint16_t* Ordinals = (uint16_t*)(Base + Exports->AddressOfNameOrdinals);
+		uint32_t* Functions = (uint32_t*)(Base + Exports->AddressOfFunctions);
+
+		for (uint32_t i = 0; i < Exports->NumberOfNames; i++)
+		{
+			if (HashExportString( (const char*)(Base + Names[ i ]) ) != Hash || Ordinals[ i ] >= Exports->NumberOfFunctions)
+				continue;
+
+			uint32_t Rva = Functions[ Ordinals[ i ] ];
+			if (Rva >= ExportDirectory->VirtualAddress && Rva - ExportDirectory->VirtualAddress < ExportDirectory->Size)
+				return 0;
+
+			return Base + Rva;
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Finds the RUNTIME_FUNCTION containing the address, and the base of its module.
 	*	DISCLAIMER: THIS IMPLEMENTATION ONLY SUPPORTS KERNEL ADDRESSES!!!!!
 	*/
-	bool GetFunctionInformation( _In_ uint64_t Addr, _In_opt_ RUNTIME_FUNCTION* RuntimeDataOut, _In_opt_ UNWIND_INFO_HDR* UnwindInfoOut )
+	RUNTIME_FUNCTION* LookupFunctionEntry( _In_ uint64_t Addr, _Out_opt_ uint64_t* BaseOut )
 	{
 		// Address is null?
 		if (!Addr)
-			return false;
+			return 0;
+
+		// Indexed modules only need a walk over the functions in a single page.
+		for (uint32_t i = 0; i < MAX_INDEXED_MODULES; i++)
+		{
+			ModuleIndex_t* Index = &ModuleIndices[ i ];
+			if (!Index->Base || !Index->PageStart || Addr - Index->Base >= Index->SizeOfImage)
+				continue;
+
+			uint32_t Rva = uint32_t( Addr - Index->Base );
+			uint32_t Function = Index->PageStart[ Rva >> PAGE_SHIFT ];
+			while (Function < Index->Count && Index->Functions[ Function ].FunctionEnd <= Rva)
+				Function++;
+
+			if (BaseOut)
+				*BaseOut = Index->Base;
+
+			if (Function < Index->Count && Index->Functions[ Function ].FunctionStart <= Rva)
+				return &Index->Functions[ Function ];
+
+			return 0;
+		}
 
 		// Get base address of driver from address.
 		uint64_t BaseAddress;
 		if (!RtlPcToFileHeader( Addr, &BaseAddress ))
-			return false;	// Was not found.
+			return 0;	// Was not found.
 
-		PIMAGE_NT_HEADERS64 NT = NTHEADER( BaseAddress );
-		PIMAGE_DATA_DIRECTORY ExceptionDirectory = &NT->OptionalHeader.DataDirectory[ IMAGE_DIRECTORY_ENTRY_EXCEPTION ];
+		if (BaseOut)
+			*BaseOut = BaseAddress;
 
-		// Exception data not present?
-		if (!ExceptionDirectory->VirtualAddress || !ExceptionDirectory->Size)
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		if (!GetExceptionTable( BaseAddress, &Functions, &Count ))
+			return 0;
+
+		return SearchExceptionTable( Functions, Count, uint32_t( Addr - BaseAddress ) );
+	}
+
+	/*
+	*	Get function information from SEH data.
+	*	DISCLAIMER: THIS IMPLEMENTATION ONLY SUPPORTS KERNEL ADDRESSES!!!!!
+	*/
+	bool GetFunctionInformation( _In_ uint64_t Addr, _In_opt_ RUNTIME_FUNCTION* RuntimeDataOut, _In_opt_ UNWIND_INFO_HDR* UnwindInfoOut )
+	{
+		uint64_t BaseAddress;
+		RUNTIME_FUNCTION* RuntimeData = LookupFunctionEntry( Addr, &BaseAddress );
+
+		// Not found
+		if (!RuntimeData)
+			return false;
+
+		if (RuntimeDataOut)
+			*RuntimeDataOut = *RuntimeData;
+
+		if (UnwindInfoOut)
+			*UnwindInfoOut = *(UNWIND_INFO_HDR*)(BaseAddress + RuntimeData->UnwindInfo);
+
+		return true;
+	}
+
+	/*
+	*	Resolves entries which point to another RUNTIME_FUNCTION instead of an UNWIND_INFO.
+	*/
+	static const RUNTIME_FUNCTION* ResolveIndirectEntry( _In_ uint64_t Base, _In_ const RUNTIME_FUNCTION* Function )
+	{
+		if (Function->UnwindInfo & RUNTIME_FUNCTION_INDIRECT)
+			return (const RUNTIME_FUNCTION*)(Base + (Function->UnwindInfo & ~RUNTIME_FUNCTION_INDIRECT));
+
+		return Function;
+	}
+
+	/*
+	*	Decodes the UNWIND_INFO of a RUNTIME_FUNCTION, the unwind codes are not copied.
+	*/
+	bool DecodeUnwindInfo( _In_ uint64_t Base, _In_ const RUNTIME_FUNCTION* Function, _Out_ UnwindInfo_t* Out )
+	{
+		memset( Out, 0, sizeof( UnwindInfo_t ) );
+
+		Function = ResolveIndirectEntry( Base, Function );
+		UNWIND_INFO_HDR* Header = (UNWIND_INFO_HDR*)(Base + Function->UnwindInfo);
+
+		Out->Version = Header->Flags & 7;
+		Out->Flags = Header->Flags >> 3;
+		Out->PrologueSize = Header->PrologueSize;
+		Out->NumOfUnwindCodes = Header->NumOfUnwindCodes;
+		Out->FrameRegister = Header->FrRegOff & 0xF;
+		Out->FrameOffset = (Header->FrRegOff >> 4) * 16;
+		Out->UnwindCodes = (const UNWIND_CODE*)(Header + 1);
+
+		// Only version 1 and 2 exist.
+		if (Out->Version != 1 && Out->Version != 2)
 			return false;
 
-		int NumOfFunctions = ExceptionDirectory->Size / sizeof( RUNTIME_FUNCTION );
-		for (int i = 0; i < NumOfFunctions; i++)
+		// The unwind code array is always padded to an even count, the optional data follows.
+		const void* Trailer = &Out->UnwindCodes[ (Header->NumOfUnwindCodes + 1) & ~1 ];
+
+		if (Out->Flags & UNW_FLAG_CHAININFO)
+			Out->Chained = *(const RUNTIME_FUNCTION*)Trailer;
+		else if (Out->Flags & (UNW_FLAG_EHANDLER | UNW_FLAG_UHANDLER))
+			Out->ExceptionHandler = *(const uint32_t*)Trailer;
+
+		return true;
+	}
+
+	/*
+	*	Follows the unwind chain of an entry up to the primary entry of the function.
+	*/
+	static bool GetPrimaryEntry( _In_ uint64_t Base, _In_ const RUNTIME_FUNCTION* Function, _Out_ RUNTIME_FUNCTION* Primary, _Out_opt_ UnwindInfo_t* PrimaryUnwind )
+	{
+		RUNTIME_FUNCTION Current = *ResolveIndirectEntry( Base, Function );
+
+		// The chain should never be this deep, anything beyond is corrupt.
+		for (uint32_t Depth = 0; Depth < 32; Depth++)
 		{
-			RUNTIME_FUNCTION* RuntimeData = (RUNTIME_FUNCTION*)(BaseAddress + ExceptionDirectory->VirtualAddress + i * sizeof( RUNTIME_FUNCTION ));
+			UnwindInfo_t Unwind;
+			if (!DecodeUnwindInfo( Base, &Current, &Unwind ))
+				return false;
 
-			// Is the address inside the function bounds?
-			if ((BaseAddress + RuntimeData->FunctionStart) <= Addr && (BaseAddress + RuntimeData->FunctionEnd) >= Addr)
+			if (!(Unwind.Flags & UNW_FLAG_CHAININFO))
 			{
-				// Found
-				if (RuntimeDataOut)
-					*RuntimeDataOut = *RuntimeData;
+				*Primary = Current;
+				if (PrimaryUnwind)
+					*PrimaryUnwind = Unwind;
 
-				if (UnwindInfoOut)
-					*UnwindInfoOut = *(UNWIND_INFO_HDR*)(BaseAddress + RuntimeData->UnwindInfo);
-			
 				return true;
 			}
+
+			Current = *ResolveIndirectEntry( Base, &Unwind.Chained );
 		}
 
-		// Not found
 		return false;
 	}
-}
\ No newline at end of file
+
+	/*
+	*	Links the entries of every logical function into a circular list in address order, so
+	*	GetLogicalFunction never has to go over the whole table. Only chained entries are followed.
+	*/
+	static bool BuildFragmentIndex( _Inout_ ModuleIndex_t* Index )
+	{
+		uint32_t* Next = (uint32_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Index->Count * sizeof( uint32_t ) );
+		uint32_t* Tail = (uint32_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Index->Count * sizeof( uint32_t ) );
+		if (!Next || !Tail)
+		{
+			if (Next)
+				ExFreePool( Next );
+
+			if (Tail)
+				ExFreePool( Tail );
+
+			return false;
+		}
+
+		// First pass, Next holds the index of the primary entry each entry belongs to.
+		for (uint32_t i = 0; i < Index->Count; i++)
+		{
+			Next[ i ] = i;
+			Tail[ i ] = MAXULONG;
+
+			// Only chained entries can belong to another function, skip the rest without following anything.
+			const RUNTIME_FUNCTION* Entry = ResolveIndirectEntry( Index->Base, &Index->Functions[ i ] );
+			if (!((((UNWIND_INFO_HDR*)(Index->Base + Entry->UnwindInfo))->Flags >> 3) & UNW_FLAG_CHAININFO))
+				continue;
+
+			RUNTIME_FUNCTION Primary;
+			if (!GetPrimaryEntry( Index->Base, &Index->Functions[ i ], &Primary, 0 ))
+				continue;
+
+			RUNTIME_FUNCTION* Owner = SearchExceptionTable( Index->Functions, Index->Count, Primary.FunctionStart );
+			if (Owner && Owner->FunctionStart == Primary.FunctionStart)
+				Next[ i ] = uint32_t( Owner - Index->Functions );
+		}
+
+		// Second pass, in address order. Each entry is appended after the last one seen of its function,
+		// and the last one always links back to the first. Next[ i ] is only overwritten once i was visited.
+		for (uint32_t i = 0; i < Index->Count; i++)
+		{
+			uint32_t Owner = Next[ i ];
+			if (Tail[ Owner ] == MAXULONG)
+			{
+				Next[ i ] = i;
+			}
+			else
+			{
+				Next[ i ] = Next[ Tail[ Owner ] ];
+				Next[ Tail[ Owner ] ] = i;
+			}
+
+			Tail[ Owner ] = i;
+		}
+
+		ExFreePool( Tail );
+		Index->NextFragment = Next;
+		return true;
+	}
+
+	/*
+	*	Gets the full code extent of the function containing the address, following
+	*	UNW_FLAG_CHAININFO so fragments split off from the primary entry are included.
+	*	Functions with more than MAX_FUNCTION_FRAGMENTS fragments only get the first ones, flagged as Truncated.
+	*/
+	bool GetLogicalFunction( _In_ uint64_t Addr, _Out_ LogicalFunction_t* Out )
+	{
+		memset( Out, 0, sizeof( LogicalFunction_t ) );
+
+		uint64_t Base;
+		RUNTIME_FUNCTION* Function = LookupFunctionEntry( Addr, &Base );
+		if (!Function)
+			return false;
+
+		if (!GetPrimaryEntry( Base, Function, &Out->Primary, &Out->PrimaryUnwind ))
+			return false;
+
+		Out->Base = Base;
+
+		// Indexed modules already have the fragments linked together.
+		ModuleIndex_t* Index = GetModuleIndex( Base );
+		if (Index && Index->NextFragment && Function >= Index->Functions && Function < Index->Functions + Index->Count)
+		{
+			// Find the wrap around, the entry after it is the lowest one.
+			uint32_t Last = uint32_t( Function - Index->Functions );
+			while (Index->NextFragment[ Last ] > Last)
+				Last = Index->NextFragment[ Last ];
+
+			uint32_t First = Index->NextFragment[ Last ];
+			for (uint32_t i = First;; i = Index->NextFragment[ i ])
+			{
+				if (Out->FragmentCount < MAX_FUNCTION_FRAGMENTS)
+					Out->Fragments[ Out->FragmentCount++ ] = Index->Functions[ i ];
+				else
+					Out->Truncated = true;
+
+				if (i == Last)
+					break;
+			}
+
+			return true;
+		}
+
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		if (!GetExceptionTable( Base, &Functions, &Count ))
+			return false;
+
+		// Every fragment chains back to the primary entry, and the table is sorted so they come out in order.
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			RUNTIME_FUNCTION Primary;
+			if (Functions[ i ].FunctionStart != Out->Primary.FunctionStart)
+			{
+				// Only chained entries can belong to another function, skip the rest without following anything.
+				const RUNTIME_FUNCTION* Entry = ResolveIndirectEntry( Base, &Functions[ i ] );
+				if (!((((UNWIND_INFO_HDR*)(Base + Entry->UnwindInfo))->Flags >> 3) & UNW_FLAG_CHAININFO))
+					continue;
+
+				if (!GetPrimaryEntry( Base, &Functions[ i ], &Primary, 0 ) || Primary.FunctionStart != Out->Primary.FunctionStart)
+					continue;
+			}
+
+			if (Out->FragmentCount < MAX_FUNCTION_FRAGMENTS)
+				Out->Fragments[ Out->FragmentCount++ ] = Functions[ i ];
+			else
+				Out->Truncated = true;
+		}
+
+		return Out->FragmentCount != 0;
+	}
+
+	/*
+	*	Gets the absolute address an instruction refers to, either through a RIP relative
+	*	memory operand or a relative branch. Returns 0 if it has neither or fails to decode,
+	*	in which case the length is 0 as well.
+	*/
+	uint64_t ResolveRelative( _In_ uint64_t Address, _Out_opt_ uint32_t* LengthOut )
+	{
+		hde64s HDE;
+		hde64_disasm( (void*)Address, &HDE );
+
+		if (LengthOut)
+			*LengthOut = (HDE.flags & F_ERROR) ? 0 : HDE.len;
+
+		if (HDE.flags & F_ERROR)
+			return 0;
+
+		// mod 00 r/m 101, the displacement is relative to the end of the instruction, immediates included.
+		if ((HDE.flags & F_DISP32) && HDE.modrm_mod == 0 && HDE.modrm_rm == 5)
+			return Address + HDE.len + int32_t( HDE.disp.disp32 );
+
+		if (HDE.flags & F_RELATIVE)
+		{
+			if (HDE.flags & F_IMM8)
+				return Address + HDE.len + int8_t( HDE.imm.imm8 );
+
+			if (HDE.flags & F_IMM16)
+				return Address + HDE.len + int16_t( HDE.imm.imm16 );
+
+			return Address + HDE.len + int32_t( HDE.imm.imm32 );
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Decodes from a known instruction boundary, such as a function start, to tell if an address
+	*	is the start of an instruction as well.
+	*/
+	bool IsInstructionBoundary( _In_ uint64_t Start, _In_ uint64_t Address )
+	{
+		while (Start < Address)
+		{
+			uint32_t Length = hde64_length( (void*)Start );
+			if (!Length)
+				return false;
+
+			Start += Length;
+		}
+
+		return Start == Address;
+	}
+
+	/*
+	*	Resolves the next Count relative references starting at Address, walking over
+	*	any instruction in between. Every instruction is decoded once, returns the amount resolved.
+	*/
+	uint32_t ResolveRelatives( _In_ uint64_t Address, _Out_ uint64_t* Targets, _In_ uint32_t Count, _In_ uint32_t MaxInstructions )
+	{
+		uint32_t Resolved = 0;
+		for (uint32_t i = 0; i < MaxInstructions && Resolved < Count; i++)
+		{
+			uint32_t Length;
+			uint64_t Target = ResolveRelative( Address, &Length );
+			if (!Length)
+				break;
+
+			if (Target)
+				Targets[ Resolved++ ] = Target;
+
+			Address += Length;
+		}
+
+		return Resolved;
+	}
+}
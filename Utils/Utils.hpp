@@ -11,10 +11,101 @@
 
 #pragma once
 #include "..\Common.hpp"
+#include "Pattern.hpp"
+
+// Max number of RUNTIME_FUNCTION entries a single logical function can be split into.
+#define MAX_FUNCTION_FRAGMENTS 16
 
 namespace Utils
 {
+	/*
+	*	Decoded UNWIND_INFO of a single RUNTIME_FUNCTION.
+	*/
+	struct UnwindInfo_t
+	{
+		uint8_t Version;
+		uint8_t Flags;					// UNW_FLAG_*
+		uint8_t PrologueSize;
+		uint8_t NumOfUnwindCodes;
+		uint8_t FrameRegister;
+		uint32_t FrameOffset;			// Already scaled by 16.
+		const UNWIND_CODE* UnwindCodes;
+		uint32_t ExceptionHandler;		// RVA, only set with UNW_FLAG_EHANDLER / UNW_FLAG_UHANDLER.
+		RUNTIME_FUNCTION Chained;		// Parent entry, only set with UNW_FLAG_CHAININFO.
+	};
+
+	/*
+	*	A function as the compiler sees it, the primary entry which holds the prologue
+	*	plus every fragment chained to it, sorted by address.
+	*/
+	struct LogicalFunction_t
+	{
+		uint64_t Base;
+		RUNTIME_FUNCTION Primary;
+		UnwindInfo_t PrimaryUnwind;
+		uint32_t FragmentCount;
+		bool Truncated;					// There were more than MAX_FUNCTION_FRAGMENTS, only the first ones are listed.
+		RUNTIME_FUNCTION Fragments[ MAX_FUNCTION_FRAGMENTS ];
+	};
+
+	/*
+	*	Position of a walk over a module's section headers, see IsDiscardableRva.
+	*/
+	struct SectionWalk_t
+	{
+		PIMAGE_SECTION_HEADER Section;
+		PIMAGE_SECTION_HEADER End;
+	};
+
+	bool GetExceptionTable( _In_ uint64_t Base, _Out_ RUNTIME_FUNCTION** Functions, _Out_ uint32_t* Count );
+	void BeginSectionWalk( _In_ uint64_t Base, _Out_ SectionWalk_t* Walk );
+	bool IsDiscardableRva( _Inout_ SectionWalk_t* Walk, _In_ uint32_t Rva );
+	bool DecodeUnwindInfo( _In_ uint64_t Base, _In_ const RUNTIME_FUNCTION* Function, _Out_ UnwindInfo_t* Out );
+	bool GetLogicalFunction( _In_ uint64_t Addr, _Out_ LogicalFunction_t* Out );
+
 	bool GetFunctionInformation( _In_ uint64_t Addr, _In_opt_ RUNTIME_FUNCTION* RuntimeDataOut = 0, _In_opt_ UNWIND_INFO_HDR* UnwindInfoOut = 0);
+	RUNTIME_FUNCTION* LookupFunctionEntry( _In_ uint64_t Addr, _Out_opt_ uint64_t* BaseOut = 0 );
+	uint64_t ResolveRelative( _In_ uint64_t Address, _Out_opt_ uint32_t* LengthOut = 0 );
+	bool IsInstructionBoundary( _In_ uint64_t Start, _In_ uint64_t Address );
+	uint32_t ResolveRelatives( _In_ uint64_t Address, _Out_ uint64_t* Targets, _In_ uint32_t Count, _In_ uint32_t MaxInstructions = 16 );
+	bool IndexModule( _In_ uint64_t Base );
+	void DestroyModuleIndices( );
+	uint64_t FindExport( _In_ uint64_t Base, _In_ uint64_t Hash );
+
+	/*
+	*	FNV-1a of an export name, 0 is reserved for empty slots in the export index.
+	*/
+	constexpr uint64_t HashExportString( _In_ const char* Name )
+	{
+		uint64_t Hash = 0xCBF29CE484222325;
+		for ( ; *Name; Name++ )
+			Hash = (Hash ^ uint8_t( *Name )) * 0x100000001B3;
+
+		return Hash ? Hash : 1;
+	}
+
+	/*
+	*	Hashes an export name at compile time, so the name never ends up in the binary.
+	*/
+	template <int N>
+	consteval uint64_t HashExportName( _In_ const char( &Name )[ N ] )
+	{
+		return HashExportString( Name );
+	}
+
+	uint64_t FindPatternMasked( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length );
+	uint64_t FindPatternAnchored( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ uint32_t First, _In_ uint32_t Second );
+	uint64_t FindPatternHorspool( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length, _In_ const uint8_t* Skip );
+	uint64_t FindPatternScalar( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const uint8_t* Pattern, _In_ const uint8_t* Mask, _In_ uint32_t Length );
+	bool IsPatternAt( _In_ uint64_t Address, _In_ const PatternView& Pattern );
+
+	// Runs Worker( Context ) on every processor at once and returns once all of them returned.
+	// FindPatternParallel can be driven by anything implementing this, e.g. a thread pool.
+	typedef void( *ScanDispatcher_t )( _In_ void( *Worker )( void* Context ), _In_ void* Context );
+	typedef uint64_t( *ChunkScanner_t )( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const void* Pattern );
+
+	void DispatchOnAllProcessors( _In_ void( *Worker )( void* Context ), _In_ void* Context );
+	uint64_t FindPatternChunked( _In_ uint64_t Base, _In_ const void* Pattern, _In_ uint32_t Length, _In_ ChunkScanner_t Scanner, _In_opt_ ScanDispatcher_t Dispatcher );
 
 	/*
 	*	Search for a pattern in a memory block.
@@ -23,33 +114,33 @@ namespace Utils
 	template <int T>
 	static uint64_t FindPattern_C( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const char( &CPattern )[ T ] )
 	{
-		uint8_t* Pattern = (uint8_t*)CPattern;
-		for ( uint8_t* i = (uint8_t*)SearchStart; i < (uint8_t*)(SearchStart + SearchSize - T - 1); i++ )
-		{
-			bool Found = true;
-
-			for ( int a = 0; a < T - 1; a++ )
-			{
-				if ( i[ a ] != Pattern[ a ] && Pattern[ a ] != 0xCC )
-				{
-					Found = false;
-					break;
-				}
-			}
-
-			if ( Found )
-				return uint64_t(i);
-		}
+		// Turn the 0xCC wildcards into a mask, the vectorized scanner does the rest.
+		uint8_t Mask[ T - 1 ];
+		for ( int i = 0; i < T - 1; i++ )
+			Mask[ i ] = uint8_t( CPattern[ i ] ) == 0xCC ? 0x00 : 0xFF;
 
-		return 0;
+		return FindPatternMasked( SearchStart, SearchSize, (const uint8_t*)CPattern, Mask, T - 1 );
+	}
+
+	/*
+	*	Search for a compile-time pattern in a memory block, everything is precomputed
+	*	so there is no setup cost.
+	*/
+	template <int N>
+	static uint64_t FindPattern_C( _In_ uint64_t SearchStart, _In_ uint32_t SearchSize, _In_ const Pattern<N>& Sig )
+	{
+		if ( Sig.PreferHorspool )
+			return FindPatternHorspool( SearchStart, SearchSize, Sig.Bytes, Sig.Mask, Sig.Length, Sig.Skip );
+
+		return FindPatternAnchored( SearchStart, SearchSize, Sig.Bytes, Sig.Mask, Sig.Length, Sig.FirstAnchor, Sig.SecondAnchor );
 	}
 
 	/*
 	*	Searches for a pattern in a PE module.
-	*	0xCC byte is ignored while searching, use it as a wildcard.
+	*	Takes either a Utils::Pattern, or a raw string where the 0xCC byte is used as a wildcard.
 	*/
-	template <int T>
-	static uint64_t FindPattern( _In_ uint64_t Base, _In_ const char( &Pattern )[ T ] )
+	template <typename P>
+	static uint64_t FindPattern( _In_ uint64_t Base, _In_ const P& Pattern )
 	{
 		// Basic sanity checks.
 		if ( !Base || PIMAGE_DOS_HEADER( Base )->e_magic != IMAGE_DOS_SIGNATURE )
@@ -74,4 +165,111 @@ namespace Utils
 
 		return 0;
 	}
+
+	/*
+	*	Searches for a code pattern inside a single function or fragment, skipping matches
+	*	which do not start on an instruction boundary.
+	*/
+	template <typename P>
+	static uint64_t FindPatternInFragment( _In_ uint64_t FunctionStart, _In_ uint32_t Size, _In_ const P& Pattern )
+	{
+		for ( uint32_t Offset = 0; Offset < Size; )
+		{
+			uint64_t Address = FindPattern_C( FunctionStart + Offset, Size - Offset, Pattern );
+			if ( !Address )
+				break;
+
+			if ( IsInstructionBoundary( FunctionStart, Address ) )
+				return Address;
+
+			Offset = uint32_t( Address - FunctionStart ) + 1;
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Searches for a code pattern only inside the functions listed in a module's .pdata,
+	*	optionally limited to the functions starting in [Start, End). Data and discardable sections
+	*	are never examined and matches which do not start on an instruction boundary are skipped.
+	*/
+	template <typename P>
+	static uint64_t FindPatternInFunctions( _In_ uint64_t Base, _In_ const P& Pattern, _In_opt_ uint64_t Start = 0, _In_opt_ uint64_t End = 0 )
+	{
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		if ( !Base || !GetExceptionTable( Base, &Functions, &Count ) )
+			return 0;
+
+		SectionWalk_t Walk;
+		BeginSectionWalk( Base, &Walk );
+
+		for ( uint32_t i = 0; i < Count; i++ )
+		{
+			uint64_t FunctionStart = Base + Functions[ i ].FunctionStart;
+			if ( FunctionStart < Start || (End && FunctionStart >= End) )
+				continue;
+
+			// INIT and friends are freed after boot.
+			if ( IsDiscardableRva( &Walk, Functions[ i ].FunctionStart ) )
+				continue;
+
+			uint64_t Address = FindPatternInFragment( FunctionStart, Functions[ i ].FunctionEnd - Functions[ i ].FunctionStart, Pattern );
+			if ( Address )
+				return Address;
+		}
+
+		return 0;
+	}
+
+	/*
+	*	Searches for a code pattern inside the function containing an address, such as an export,
+	*	chained fragments included.
+	*/
+	template <typename P>
+	static uint64_t FindPatternInFunction( _In_ uint64_t Addr, _In_ const P& Pattern )
+	{
+		LogicalFunction_t Function;
+		if ( !GetLogicalFunction( Addr, &Function ) )
+			return 0;
+
+		for ( uint32_t i = 0; i < Function.FragmentCount; i++ )
+		{
+			RUNTIME_FUNCTION* Fragment = &Function.Fragments[ i ];
+			uint64_t Address = FindPatternInFragment( Function.Base + Fragment->FunctionStart, Fragment->FunctionEnd - Fragment->FunctionStart, Pattern );
+			if ( Address )
+				return Address;
+		}
+
+		return 0;
+	}
+
+	template <int T>
+	constexpr uint32_t GetPatternLength( _In_ const char( & )[ T ] )
+	{
+		return T - 1;
+	}
+
+	template <int N>
+	constexpr uint32_t GetPatternLength( _In_ const Pattern<N>& Sig )
+	{
+		return Sig.Length;
+	}
+
+	/*
+	*	Searches for a pattern in a PE module using every processor.
+	*	Sections are split into chunks which are handed out in ascending order, the lowest match wins.
+	*	Without a dispatcher the chunks of non-paged sections are scanned by DPCs on all processors,
+	*	pageable sections are always scanned on the calling thread.
+	*/
+	template <typename P>
+	static uint64_t FindPatternParallel( _In_ uint64_t Base, _In_ const P& Pattern, _In_opt_ ScanDispatcher_t Dispatcher = 0 )
+	{
+		ChunkScanner_t Scanner = []( uint64_t SearchStart, uint32_t SearchSize, const void* Sig ) -> uint64_t
+		{
+			return FindPattern_C( SearchStart, SearchSize, *(const P*)Sig );
+		};
+
+		return FindPatternChunked( Base, &Pattern, GetPatternLength( Pattern ), Scanner, Dispatcher );
+	}
 }
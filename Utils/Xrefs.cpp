@@ -0,0 +1,466 @@
+/*
+*		File name:
+*			Xrefs.cpp
+*
+*		Use:
+*			Cross-reference index over every function listed in an image's .pdata.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#include "Xrefs.hpp"
+#include "..\Misc\HDE\HDE64.hpp"
+
+namespace Utils::Xrefs
+{
+	uint64_t IndexBase = 0;
+
+	// Image the index is built for by the first query, see Bind.
+	uint64_t BoundBase = 0;
+
+	// Set once the index is complete, only one query builds it at a time.
+	volatile bool Built = false;
+	volatile long Building = 0;
+
+	// In source order, which is the order of the sweep since .pdata is sorted.
+	Xref_t* Entries = 0;
+	uint32_t EntryCount = 0;
+	uint32_t EntryCapacity = 0;
+
+	// Indices into Entries, sorted by target.
+	uint32_t* ByTarget = 0;
+
+	/*
+	*	Appends an entry, doubling the allocation when it is full.
+	*/
+	static bool Append( _In_ uint32_t Source, _In_ uint32_t Target, _In_ EXrefKind Kind )
+	{
+		if (EntryCount == EntryCapacity)
+		{
+			uint32_t Capacity = EntryCapacity ? EntryCapacity * 2 : 0x10000;
+			Xref_t* Grown = (Xref_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, Capacity * sizeof( Xref_t ) );
+			if (!Grown)
+				return false;
+
+			if (Entries)
+			{
+				memcpy( Grown, Entries, EntryCount * sizeof( Xref_t ) );
+				ExFreePool( Entries );
+			}
+
+			Entries = Grown;
+			EntryCapacity = Capacity;
+		}
+
+		Entries[ EntryCount++ ] = Xref_t{ Source, Target, Kind };
+		return true;
+	}
+
+	/*
+	*	Tells whether a RIP relative memory operand is read, written or only has its address taken.
+	*	Covers the instructions compilers emit for globals, anything unknown counts as a read.
+	*/
+	static EXrefKind ClassifyMemoryOperand( _In_ const hde64_batch* Batch, _In_ uint32_t Index )
+	{
+		uint8_t Opcode = Batch->opcode[ Index ];
+		uint8_t Opcode2 = Batch->opcode2[ Index ];
+		uint8_t Reg = Batch->modrm_reg[ Index ];
+
+		if (Opcode == 0x8D)
+			return EXrefKind::Address;
+
+		// VEX and EVEX, opcode2 is the opcode within the map.
+		if (Batch->vex_map[ Index ])
+		{
+			switch (Batch->vex_map[ Index ])
+			{
+			case 1:
+				switch (Opcode2)
+				{
+				case 0x11: case 0x13: case 0x17: case 0x29: case 0x2B: case 0x7F: case 0xD6: case 0xE7:
+					return EXrefKind::Write;
+				}
+				break;
+			case 2:
+				// vmaskmov and vpmaskmov stores.
+				if (Opcode2 == 0x2E || Opcode2 == 0x2F || Opcode2 == 0x8E)
+					return EXrefKind::Write;
+				break;
+			case 3:
+				// vpextr, vextract and vcvtps2ph.
+				switch (Opcode2)
+				{
+				case 0x14: case 0x15: case 0x16: case 0x17: case 0x19: case 0x1B: case 0x1D: case 0x39: case 0x3B:
+					return EXrefKind::Write;
+				}
+				break;
+			}
+
+			return EXrefKind::Read;
+		}
+
+		if (Opcode != 0x0F)
+		{
+			// add, or, adc, sbb, and, sub, xor r/m, r. cmp only reads.
+			if (Opcode < 0x40 && (Opcode & 7) < 2)
+				return Opcode >= 0x38 ? EXrefKind::Read : EXrefKind::Write;
+
+			switch (Opcode)
+			{
+			case 0x80: case 0x81: case 0x83:
+				return Reg == 7 ? EXrefKind::Read : EXrefKind::Write;
+			case 0x86: case 0x87: case 0x88: case 0x89: case 0x8F: case 0xC6: case 0xC7:
+			case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+				return EXrefKind::Write;
+			case 0xF6: case 0xF7:
+				return Reg == 2 || Reg == 3 ? EXrefKind::Write : EXrefKind::Read;
+			case 0xFE: case 0xFF:
+				return Reg <= 1 ? EXrefKind::Write : EXrefKind::Read;
+			}
+
+			return EXrefKind::Read;
+		}
+
+		// 0F 3A pextr and extractps. The movbe store shares 0F 38 F1 with crc32, so 0F 38 counts as a read.
+		if (Opcode2 == 0x3A)
+		{
+			uint8_t Opcode3 = Batch->opcode3[ Index ];
+			return Opcode3 >= 0x14 && Opcode3 <= 0x17 ? EXrefKind::Write : EXrefKind::Read;
+		}
+
+		if (Opcode2 == 0x38)
+			return EXrefKind::Read;
+
+		// setcc.
+		if ((Opcode2 & 0xF0) == 0x90)
+			return EXrefKind::Write;
+
+		switch (Opcode2)
+		{
+		case 0x11: case 0x13: case 0x17: case 0x29: case 0x2B: case 0x7F: case 0xD6: case 0xE7:
+		case 0xAB: case 0xB0: case 0xB1: case 0xB3: case 0xBB: case 0xC0: case 0xC1: case 0xC3:
+			return EXrefKind::Write;
+		case 0xBA:
+			return Reg >= 5 ? EXrefKind::Write : EXrefKind::Read;
+		}
+
+		return EXrefKind::Read;
+	}
+
+	/*
+	*	Records every reference of a decoded batch, in instruction order so Entries stays sorted by source.
+	*/
+	static bool RecordBatch( _In_ uint64_t Start, _In_ const hde64_batch* Batch )
+	{
+		uint32_t Rva = uint32_t( Start - IndexBase );
+
+		// rip lists instruction indices in ascending order, walk it alongside the instructions.
+		uint32_t Relative = 0;
+		for (uint32_t i = 0; i < Batch->count; i++)
+		{
+			uint32_t Offset = Batch->offset[ i ];
+			uint32_t Next = Rva + Offset + Batch->len[ i ];
+
+			if (Relative < Batch->rip_count && Batch->rip[ Relative ] == i)
+			{
+				EXrefKind Kind = ClassifyMemoryOperand( Batch, i );
+				if (!Append( Rva + Offset, Next + Batch->rip_disp[ Relative++ ], Kind ))
+					return false;
+			}
+			else if (Batch->opcode[ i ] == 0xE8 || Batch->opcode[ i ] == 0xE9)
+			{
+				// Direct call and jmp, rel32 is always the last field.
+				int32_t Displacement = *(int32_t*)(Start + Offset + Batch->len[ i ] - 4);
+				if (!Append( Rva + Offset, Next + Displacement, Batch->opcode[ i ] == 0xE8 ? EXrefKind::Call : EXrefKind::Jump ))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	/*
+	*	Orders two entries by target, then by source.
+	*/
+	static bool TargetLess( _In_ uint32_t Left, _In_ uint32_t Right )
+	{
+		if (Entries[ Left ].Target != Entries[ Right ].Target)
+			return Entries[ Left ].Target < Entries[ Right ].Target;
+
+		return Entries[ Left ].Source < Entries[ Right ].Source;
+	}
+
+	/*
+	*	Heap sort of ByTarget, no recursion and no extra memory.
+	*/
+	static void SortByTarget( )
+	{
+		auto SiftDown = []( uint32_t Root, uint32_t Count )
+		{
+			for (uint32_t Child; (Child = Root * 2 + 1) < Count; Root = Child)
+			{
+				if (Child + 1 < Count && TargetLess( ByTarget[ Child ], ByTarget[ Child + 1 ] ))
+					Child++;
+
+				if (!TargetLess( ByTarget[ Root ], ByTarget[ Child ] ))
+					return;
+
+				uint32_t Temp = ByTarget[ Root ];
+				ByTarget[ Root ] = ByTarget[ Child ];
+				ByTarget[ Child ] = Temp;
+			}
+		};
+
+		for (uint32_t i = EntryCount / 2; i > 0; i--)
+			SiftDown( i - 1, EntryCount );
+
+		for (uint32_t End = EntryCount; End > 1; End--)
+		{
+			uint32_t Temp = ByTarget[ 0 ];
+			ByTarget[ 0 ] = ByTarget[ End - 1 ];
+			ByTarget[ End - 1 ] = Temp;
+			SiftDown( 0, End - 1 );
+		}
+	}
+
+	/*
+	*	Frees the index, the binding is left alone.
+	*/
+	static void FreeIndex( )
+	{
+		Built = false;
+
+		if (Entries)
+			ExFreePool( Entries );
+
+		if (ByTarget)
+			ExFreePool( ByTarget );
+
+		IndexBase = 0;
+		Entries = 0;
+		EntryCount = 0;
+		EntryCapacity = 0;
+		ByTarget = 0;
+	}
+
+	/*
+	*	Sweeps every function in the image's .pdata once, recording RIP relative data references
+	*	and direct call/jmp targets. Queries afterwards are binary searches.
+	*	The sweep takes a while on ntoskrnl, so it is left to the first query that needs it, see Bind.
+	*/
+	bool Build( _In_ uint64_t Base )
+	{
+		FreeIndex( );
+
+		RUNTIME_FUNCTION* Functions;
+		uint32_t Count;
+		if (!Base || !GetExceptionTable( Base, &Functions, &Count ))
+			return false;
+
+		// One allocation for every array of the batch.
+		uint8_t* Scratch = (uint8_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, XREF_DECODE_BATCH * (sizeof( uint32_t ) * 2 + sizeof( int32_t ) + 6) );
+		if (!Scratch)
+			return false;
+
+		hde64_batch Batch = {};
+		Batch.offset = (uint32_t*)Scratch;
+		Batch.rip = Batch.offset + XREF_DECODE_BATCH;
+		Batch.rip_disp = (int32_t*)(Batch.rip + XREF_DECODE_BATCH);
+		Batch.len = (uint8_t*)(Batch.rip_disp + XREF_DECODE_BATCH);
+		Batch.opcode = Batch.len + XREF_DECODE_BATCH;
+		Batch.opcode2 = Batch.opcode + XREF_DECODE_BATCH;
+		Batch.opcode3 = Batch.opcode2 + XREF_DECODE_BATCH;
+		Batch.vex_map = Batch.opcode3 + XREF_DECODE_BATCH;
+		Batch.modrm_reg = Batch.vex_map + XREF_DECODE_BATCH;
+		Batch.capacity = XREF_DECODE_BATCH;
+
+		IndexBase = Base;
+
+		SectionWalk_t Walk;
+		BeginSectionWalk( Base, &Walk );
+
+		bool Success = true;
+		for (uint32_t i = 0; i < Count && Success; i++)
+		{
+			// INIT is freed once the image is initialized.
+			if (IsDiscardableRva( &Walk, Functions[ i ].FunctionStart ))
+				continue;
+
+			uint64_t Start = Base + Functions[ i ].FunctionStart;
+			uint32_t Size = Functions[ i ].FunctionEnd - Functions[ i ].FunctionStart;
+
+			// Stops at the first instruction that fails to decode, the rest of the fragment is likely data.
+			for (uint32_t Done = 0; Done < Size && Success;)
+			{
+				if (!hde64_decode_range( (void*)(Start + Done), Size - Done, &Batch ))
+					break;
+
+				Success = RecordBatch( Start + Done, &Batch );
+				Done += Batch.size;
+			}
+		}
+
+		ExFreePool( Scratch );
+
+		if (Success && EntryCount)
+		{
+			ByTarget = (uint32_t*)ExAllocatePool( POOL_TYPE::NonPagedPoolNx, EntryCount * sizeof( uint32_t ) );
+			Success = ByTarget != 0;
+		}
+
+		if (!Success || !EntryCount)
+		{
+			FreeIndex( );
+			return false;
+		}
+
+		for (uint32_t i = 0; i < EntryCount; i++)
+			ByTarget[ i ] = i;
+
+		SortByTarget( );
+
+		// Queries on other processors may see Built as soon as it is set.
+		_ReadWriteBarrier( );
+		Built = true;
+		return true;
+	}
+
+	/*
+	*	Remembers the image to build the index for, nothing is swept until a query needs it.
+	*/
+	void Bind( _In_ uint64_t Base )
+	{
+		if (BoundBase != Base)
+			FreeIndex( );
+
+		BoundBase = Base;
+	}
+
+	/*
+	*	Builds the index of the bound image on the first query, at PASSIVE_LEVEL only as the sweep takes a while.
+	*	Queries racing the build find nothing, and a failed build is not retried.
+	*/
+	static bool EnsureBuilt( )
+	{
+		if (Built)
+			return true;
+
+		if (!BoundBase || KeGetCurrentIrql() != PASSIVE_LEVEL || _InterlockedExchange( &Building, 1 ))
+			return false;
+
+		bool Success = Build( BoundBase );
+		if (!Success)
+			BoundBase = 0;
+
+		_InterlockedExchange( &Building, 0 );
+		return Success;
+	}
+
+	/*
+	*	Frees the index and forgets the bound image.
+	*/
+	void Destroy( )
+	{
+		FreeIndex( );
+		BoundBase = 0;
+	}
+
+	/*
+	*	Tells whether the index is already built for the image, without building it.
+	*/
+	bool IsBuilt( _In_ uint64_t Base )
+	{
+		return Built && IndexBase == Base;
+	}
+
+	/*
+	*	Copies a matching entry out, returns the updated total.
+	*/
+	static uint32_t Collect( _In_ const Xref_t* Entry, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut, _In_ uint32_t Total )
+	{
+		if (Kind != EXrefKind::Any && Entry->Kind != Kind)
+			return Total;
+
+		if (Out && Total < MaxOut)
+			Out[ Total ] = *Entry;
+
+		return Total + 1;
+	}
+
+	/*
+	*	Gets every reference to an address. Returns the total amount, at most MaxOut are copied.
+	*/
+	uint32_t QueryTo( _In_ uint64_t Target, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut )
+	{
+		if (!EnsureBuilt( ) || Target - IndexBase > 0xFFFFFFFF)
+			return 0;
+
+		uint32_t Rva = uint32_t( Target - IndexBase );
+
+		uint32_t Low = 0, High = EntryCount;
+		while (Low < High)
+		{
+			uint32_t Middle = Low + (High - Low) / 2;
+			if (Entries[ ByTarget[ Middle ] ].Target < Rva)
+				Low = Middle + 1;
+			else
+				High = Middle;
+		}
+
+		uint32_t Total = 0;
+		for (; Low < EntryCount && Entries[ ByTarget[ Low ] ].Target == Rva; Low++)
+			Total = Collect( &Entries[ ByTarget[ Low ] ], Kind, Out, MaxOut, Total );
+
+		return Total;
+	}
+
+	/*
+	*	Gets every reference made by instructions in [Start, End). Returns the total amount, at most MaxOut are copied.
+	*/
+	uint32_t QueryFrom( _In_ uint64_t Start, _In_ uint64_t End, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut )
+	{
+		if (!EnsureBuilt( ) || Start < IndexBase || End <= Start)
+			return 0;
+
+		uint64_t StartRva = Start - IndexBase;
+		uint64_t EndRva = End - IndexBase;
+
+		uint32_t Low = 0, High = EntryCount;
+		while (Low < High)
+		{
+			uint32_t Middle = Low + (High - Low) / 2;
+			if (Entries[ Middle ].Source < StartRva)
+				Low = Middle + 1;
+			else
+				High = Middle;
+		}
+
+		uint32_t Total = 0;
+		for (; Low < EntryCount && Entries[ Low ].Source < EndRva; Low++)
+			Total = Collect( &Entries[ Low ], Kind, Out, MaxOut, Total );
+
+		return Total;
+	}
+
+	/*
+	*	Gets every reference made by the function containing an address, chained fragments included.
+	*	Returns the total amount, at most MaxOut are copied.
+	*/
+	uint32_t QueryFunction( _In_ uint64_t Addr, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut )
+	{
+		LogicalFunction_t Function;
+		if (!EnsureBuilt( ) || !GetLogicalFunction( Addr, &Function ))
+			return 0;
+
+		uint32_t Total = 0;
+		for (uint32_t i = 0; i < Function.FragmentCount; i++)
+		{
+			uint32_t Copied = Total < MaxOut ? Total : MaxOut;
+			Total += QueryFrom( Function.Base + Function.Fragments[ i ].FunctionStart, Function.Base + Function.Fragments[ i ].FunctionEnd,
+				Kind, Out ? Out + Copied : 0, MaxOut - Copied );
+		}
+
+		return Total;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+*		File name:
+*			Xrefs.hpp
+*
+*		Use:
+*			Cross-reference index over every function listed in an image's .pdata.
+*
+*		Author:
+*			Xyrem ( https://reversing.info | Xyrem@reversing.info )
+*/
+
+#pragma once
+#include "..\Common.hpp"
+#include "Utils.hpp"
+
+// Instructions decoded per hde64_decode_range call while sweeping a function.
+#define XREF_DECODE_BATCH 1024
+
+namespace Utils::Xrefs
+{
+	enum class EXrefKind : uint8_t
+	{
+		Read,		// RIP relative memory operand that is only read, test and cmp included.
+		Write,		// RIP relative memory operand that is written to.
+		Address,	// lea, the address itself is taken.
+		Call,		// call rel32
+		Jump,		// jmp rel32
+		Any = 0xFF
+	};
+
+	/*
+	*	A single reference, both addresses are RVAs into the indexed image.
+	*/
+	struct Xref_t
+	{
+		uint32_t Source;	// Instruction making the reference.
+		uint32_t Target;
+		EXrefKind Kind;
+	};
+
+	void Bind( _In_ uint64_t Base );
+	bool Build( _In_ uint64_t Base );
+	void Destroy( );
+	bool IsBuilt( _In_ uint64_t Base );
+
+	uint32_t QueryTo( _In_ uint64_t Target, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut );
+	uint32_t QueryFrom( _In_ uint64_t Start, _In_ uint64_t End, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut );
+	uint32_t QueryFunction( _In_ uint64_t Addr, _In_ EXrefKind Kind, _Out_opt_ Xref_t* Out, _In_ uint32_t MaxOut );
+}